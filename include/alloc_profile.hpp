@@ -0,0 +1,86 @@
+// Allocation accounting for profiling builds
+// Copyright (c) 2019 Slek
+//
+// Building with ASS_ALLOC_PROFILING (ENABLE_ALLOC_PROFILING in CMake) links
+// src/alloc_profile.cpp, which replaces the global operator new and delete
+// with counting versions. Every allocation is attributed to the innermost
+// trace span open on its thread, and the event loops declare how many events
+// they handle with ALLOC_EVENTS, so the report printed on exit (to stderr, or
+// to the file named by ASS_ALLOC_PROFILE) gives allocations and bytes per
+// event for each span.
+//
+// ALLOC_EXPECT_NONE(name) aborts the run when its thread allocates before
+// the end of the enclosing scope: benchmarks wrap their steady-state event
+// loops in it. Without ASS_ALLOC_PROFILING everything here compiles out.
+
+#ifndef ALLOC_PROFILE_HPP_
+#define ALLOC_PROFILE_HPP_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace alloc {
+
+struct Counts {
+  std::uint64_t allocations;
+  std::uint64_t bytes;
+};
+
+#ifdef ASS_ALLOC_PROFILING
+
+// Make name the span allocations of the calling thread are attributed to,
+// returns the previous one for LeaveSpan
+int EnterSpan(const char* name);
+void LeaveSpan(int previous);
+
+// Count events handled by the current span of the calling thread
+void AddEvents(std::uint64_t events);
+
+// Allocations of the calling thread so far
+Counts ThreadCounts();
+
+#else
+
+inline Counts ThreadCounts() { return Counts{0, 0}; }
+
+#endif
+
+class ExpectNone {
+public:
+
+  explicit ExpectNone(const char* name)
+    : name_(name), begin_(ThreadCounts()) { }
+
+  ~ExpectNone() {
+    const Counts end = ThreadCounts();
+    if (end.allocations == begin_.allocations) return;
+    std::fprintf(stderr, "[ERROR] %llu allocation(s) of %llu bytes in '%s'\n",
+                 static_cast<unsigned long long>(end.allocations - begin_.allocations),
+                 static_cast<unsigned long long>(end.bytes - begin_.bytes), name_);
+    std::abort();
+  }
+
+private:
+
+  ExpectNone(const ExpectNone&) = delete;
+  ExpectNone& operator=(const ExpectNone&) = delete;
+
+  const char* name_;
+  const Counts begin_;
+};
+
+} // namespace alloc
+
+#define ALLOC_CONCAT_(a, b) a##b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_(a, b)
+
+#ifdef ASS_ALLOC_PROFILING
+  #define ALLOC_EVENTS(count) ::alloc::AddEvents(static_cast<std::uint64_t>(count))
+  #define ALLOC_EXPECT_NONE(name) ::alloc::ExpectNone ALLOC_CONCAT(alloc_expect_, __LINE__)(name)
+#else
+  #define ALLOC_EVENTS(count) static_cast<void>(0)
+  #define ALLOC_EXPECT_NONE(name) static_cast<void>(0)
+#endif
+
+#endif // ALLOC_PROFILE_HPP_
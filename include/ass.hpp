@@ -4,19 +4,32 @@
 #ifndef ASS_HPP_
 #define ASS_HPP_
 
+#include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <cmath>
+#include <cstddef>
 #include <exception>
+#include <fstream>
+#include <iostream>
+#include <istream>
+#include <iterator>
 #include <list>
+#include <memory>
 #include <ostream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
-#include <boost/filesystem.hpp>
+#include <sys/stat.h>
+#include <sys/types.h>
 
+#include "fstream.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
 #include "util/string.h"
 
 namespace ass {
@@ -24,29 +37,80 @@ namespace ass {
 typedef std::uint32_t time_t;
 typedef std::int32_t time_signed_t;
 
-const std::string BOM = "\xef\xbb\xbf";
+// String constants are plain literals, so no global is built at startup
+constexpr char BOM[] = "\xef\xbb\xbf";
 
-const std::string SCRIPT_INFO = "[Script Info]";
-const std::string STYLES = "[V4+ Styles]";
-const std::string FONTS = "[Fonts]";
-const std::string GRAPHICS = "[Graphics]";
-const std::string EVENTS = "[Events]";
+constexpr char SCRIPT_INFO[] = "[Script Info]";
+constexpr char STYLES[] = "[V4+ Styles]";
+constexpr char FONTS[] = "[Fonts]";
+constexpr char GRAPHICS[] = "[Graphics]";
+constexpr char EVENTS[] = "[Events]";
 
-const std::string COMMAND_EVENT = "Command";
-const std::string COMMENT_EVENT = "Comment";
-const std::string DIALOGUE_EVENT = "Dialogue";
-const std::string MOVIE_EVENT = "Movie";
-const std::string PICTURE_EVENT = "Picture";
-const std::string SOUND_EVENT = "Sound";
+constexpr char COMMAND_EVENT[] = "Command";
+constexpr char COMMENT_EVENT[] = "Comment";
+constexpr char DIALOGUE_EVENT[] = "Dialogue";
+constexpr char MOVIE_EVENT[] = "Movie";
+constexpr char PICTURE_EVENT[] = "Picture";
+constexpr char SOUND_EVENT[] = "Sound";
 
-const std::string FONT_LINE = "fontname";
-const std::string FILE_LINE = "filename";
+constexpr char FONT_LINE[] = "fontname";
+constexpr char FILE_LINE[] = "filename";
 
-const std::string LINE_SEPARATOR = "\n";
-const std::string FIELD_DELIMITER = ",";
+constexpr char LINE_SEPARATOR[] = "\n";
+constexpr char FIELD_DELIMITER[] = ",";
 
-const std::unordered_set<std::string> SECTIONS = {ass::SCRIPT_INFO, ass::STYLES, ass::FONTS, ass::GRAPHICS, ass::EVENTS};
-const std::unordered_set<std::string> MULTILINE_FIELDS = {ass::FONT_LINE, ass::FILE_LINE};
+// Length of a string constant
+template <std::size_t N>
+constexpr std::size_t length(const char (&)[N]) {
+  return N - 1;
+}
+
+namespace detail {
+
+constexpr bool equals(const char* data, std::size_t size, const char* literal, std::size_t i = 0) {
+  return (literal[i] == '\0') ? (i == size) : ((i < size) && (data[i] == literal[i]) && equals(data, size, literal, i + 1));
+}
+
+} // namespace detail
+
+const std::size_t STANDARD_SECTION_COUNT = 5;
+
+// Standard sections in canonical order
+constexpr const char* STANDARD_SECTIONS[STANDARD_SECTION_COUNT] = {SCRIPT_INFO, STYLES, FONTS, GRAPHICS, EVENTS};
+
+// Rank of a standard section in the canonical order, STANDARD_SECTION_COUNT
+// for any other name. Standard section names all differ in length, so the
+// length picks the only candidate to compare with.
+constexpr std::size_t section_rank(const char* data, std::size_t size) {
+  return (size == ass::length(SCRIPT_INFO)) ? (detail::equals(data, size, SCRIPT_INFO) ? 0 : STANDARD_SECTION_COUNT)
+       : (size == ass::length(STYLES)) ? (detail::equals(data, size, STYLES) ? 1 : STANDARD_SECTION_COUNT)
+       : (size == ass::length(FONTS)) ? (detail::equals(data, size, FONTS) ? 2 : STANDARD_SECTION_COUNT)
+       : (size == ass::length(GRAPHICS)) ? (detail::equals(data, size, GRAPHICS) ? 3 : STANDARD_SECTION_COUNT)
+       : (size == ass::length(EVENTS)) ? (detail::equals(data, size, EVENTS) ? 4 : STANDARD_SECTION_COUNT)
+       : STANDARD_SECTION_COUNT;
+}
+
+inline std::size_t section_rank(const std::string& section) {
+  return section_rank(section.data(), section.size());
+}
+
+inline bool is_standard_section(const std::string& section) {
+  return section_rank(section) != STANDARD_SECTION_COUNT;
+}
+
+// Whether lines of a type carry multi-line data (fonts and graphics)
+constexpr bool is_multiline_field(const char* data, std::size_t size) {
+  return (size == ass::length(FONT_LINE)) &&
+         (detail::equals(data, size, FONT_LINE) || detail::equals(data, size, FILE_LINE));
+}
+
+inline bool is_multiline_field(const std::string& type) {
+  return is_multiline_field(type.data(), type.size());
+}
+
+static_assert(ass::length(FONT_LINE) == ass::length(FILE_LINE), "multi-line field names must have the same length");
+static_assert((section_rank("[Events]", 8) == 4) && (section_rank("[Event]", 7) == STANDARD_SECTION_COUNT),
+              "section lookup must be usable in constant expressions");
 
 class not_found : public std::exception {
 public:
@@ -85,6 +149,33 @@ private:
   std::string message_;
 };
 
+// Problem found while loading a script in lenient mode
+struct Diagnostic {
+  enum Kind { MISSING_HEADER, MISSING_DELIMITER, MISSING_FIELD, INVALID_TIMESTAMP };
+
+  Kind kind;
+  std::size_t line;   // 1-based line number
+  std::size_t offset; // Byte offset of the line start
+};
+
+inline const char* diagnostic_kind_name(Diagnostic::Kind kind) {
+  switch (kind) {
+    case Diagnostic::MISSING_HEADER: return "missing-header";
+    case Diagnostic::MISSING_DELIMITER: return "missing-delimiter";
+    case Diagnostic::MISSING_FIELD: return "missing-field";
+    case Diagnostic::INVALID_TIMESTAMP: return "invalid-timestamp";
+  }
+  return "unknown";
+}
+
+// Outcome of a lenient load. Lines with diagnostics are skipped, except for
+// a missing [Script Info] header, which is assumed.
+struct ParseResult {
+  std::vector<Diagnostic> diagnostics;
+
+  bool ok() const { return diagnostics.empty(); }
+};
+
 inline ass::time_t timestamp(const double seconds) {
   return static_cast<ass::time_t>(seconds * 100.);
 }
@@ -93,7 +184,7 @@ inline ass::time_signed_t timestamp_signed(const double seconds) {
   return static_cast<ass::time_signed_t>(seconds * 100.);
 }
 
-inline bool getline(std::ifstream& input, std::string& output, const std::string& delim = ass::LINE_SEPARATOR) {
+inline bool getline(std::istream& input, std::string& output, const std::string& delim = ass::LINE_SEPARATOR) {
   output.clear();
 
   if (!input.good()) return false;
@@ -102,22 +193,22 @@ inline bool getline(std::ifstream& input, std::string& output, const std::string
   std::string buffer;
   buffer.reserve(delim.size());
 
-  std::ifstream::char_type ch;
+  std::istream::int_type ch;
   std::string::size_type idx = 0;
   while (idx < delim.size()) {
-    if ((ch = input.get()) == std::ifstream::traits_type::eof()) {
+    if ((ch = input.get()) == std::istream::traits_type::eof()) {
       output.append(buffer);
       return !output.empty();
     }
-    if (delim.at(idx) == ch) {
-      buffer.push_back(ch);
+    if (delim.at(idx) == static_cast<char>(ch)) {
+      buffer.push_back(static_cast<char>(ch));
       idx++;
     } else {
       if (!buffer.empty()) {
         output.append(buffer);
         buffer.clear();
       }
-      output.push_back(ch);
+      output.push_back(static_cast<char>(ch));
     }
   }
 
@@ -203,34 +294,63 @@ inline bool apply_permutation(const std::vector<std::string>& v, const std::vect
   return true;
 }
 
-inline ass::time_t parse_time(const std::string& time_str) {
-  ass::time_t timestamp = 0;
-
-  std::vector<std::string> v = StringSplit(time_str, ":");
-  if (v.size() != 3) throw io_error("invalid timestamp format");
-
-  unsigned long parsed_ul;
-  double parsed_d;
-
-  if (v[0].size() != 1) throw io_error("invalid timestamp format");
-  parsed_ul = std::stoul(v[0]);
-  timestamp += static_cast<ass::time_t>(parsed_ul * 360000ul);
+// Hours a timestamp may have, so that it fits in time_signed_t too
+const ass::time_t MAX_HOURS = 5964;
+const ass::time_t MAX_TIMESTAMP = MAX_HOURS * 360000u + 359999u;
+
+// Parse a H:MM:SS.cc timestamp in [begin, end) into *timestamp, without
+// throwing. Hours may take several digits, for long running streams. The
+// fraction is read digit by digit, so it is exact (digits past the
+// centiseconds are dropped). Returns false when the timestamp is malformed.
+inline bool parse_time(const char* begin, const char* end, ass::time_t* timestamp) {
+  while ((begin < end) && IsWhiteSpace(*begin)) ++begin;
+  while ((end > begin) && IsWhiteSpace(*(end - 1))) --end;
+
+  const char* p = begin;
+  ass::time_t h = 0;
+  while ((p < end) && std::isdigit(static_cast<unsigned char>(*p))) {
+    h = h * 10u + static_cast<ass::time_t>(*p++ - '0');
+    if (h > MAX_HOURS) return false;
+  }
+  if ((p == begin) || (end - p < 4) || (*p != ':')) return false;
+  ++p;
 
-  if (v[1].size() != 2) throw io_error("invalid timestamp format");
-  parsed_ul = std::stoul(v[1]);
-  if (parsed_ul >= 60ul) throw io_error("invalid timestamp format");
-  timestamp += static_cast<ass::time_t>(parsed_ul * 6000ul);
+  if (!std::isdigit(static_cast<unsigned char>(p[0])) || !std::isdigit(static_cast<unsigned char>(p[1])) || (p[2] != ':'))
+    return false;
+  ass::time_t min = static_cast<ass::time_t>((p[0] - '0') * 10 + (p[1] - '0'));
+  if (min >= 60u) return false;
+  p += 3;
+
+  ass::time_t sec = 0;
+  const char* digits = p;
+  while ((p < end) && std::isdigit(static_cast<unsigned char>(*p)) && (p - digits < 2))
+    sec = sec * 10u + static_cast<ass::time_t>(*p++ - '0');
+  if ((p == digits) || (sec >= 60u)) return false;
+
+  ass::time_t cs = 0;
+  if ((p < end) && (*p == '.')) {
+    ++p;
+    for (ass::time_t scale = 10u; (p < end) && std::isdigit(static_cast<unsigned char>(*p)); ++p, scale /= 10u)
+      cs += static_cast<ass::time_t>(*p - '0') * scale;
+  }
+  if (p != end) return false;
 
-  parsed_d = std::stod(v[2]);
-  if (parsed_d >= 60.) throw io_error("invalid timestamp format");
-  timestamp += static_cast<ass::time_t>(parsed_d * 100.);
+  *timestamp = h * 360000u + min * 6000u + sec * 100u + cs;
+  return true;
+}
 
+inline ass::time_t parse_time(const char* begin, const char* end) {
+  ass::time_t timestamp = 0;
+  if (!parse_time(begin, end, &timestamp)) throw io_error("invalid timestamp format");
   return timestamp;
 }
 
-inline std::string format_time(const ass::time_t timestamp) {
-  if (timestamp >= 3600000ul) throw io_error("invalid timestamp value");
+inline ass::time_t parse_time(const std::string& time_str) {
+  return parse_time(time_str.data(), time_str.data() + time_str.size());
+}
 
+// Format a timestamp as H:MM:SS.cc, with as many hour digits as needed
+inline std::string format_time(const ass::time_t timestamp) {
   ass::time_t remaining = timestamp;
 
   ass::time_t h = remaining / 360000ul;
@@ -245,6 +365,12 @@ inline std::string format_time(const ass::time_t timestamp) {
   return StringPrintf("%01u:%02u:%02u.%02u", h, min, sec, remaining);
 }
 
+// Same for a signed timestamp, with a leading '-' when negative
+inline std::string format_time_signed(const ass::time_signed_t timestamp) {
+  return (timestamp < 0) ? "-" + format_time(static_cast<ass::time_t>(-static_cast<std::int64_t>(timestamp)))
+                         : format_time(static_cast<ass::time_t>(timestamp));
+}
+
 class ASSFile {
 public:
 
@@ -255,11 +381,11 @@ public:
 
   explicit ASSFile(const std::string& file)
     : has_bom_(true), line_break_(ass::LINE_SEPARATOR) {
-    boost::filesystem::path filepath(file);
-    if (!boost::filesystem::is_regular_file(filepath))
+    struct stat st;
+    if ((::stat(file.c_str(), &st) != 0) || !S_ISREG(st.st_mode))
       throw not_found("file not found");
 
-    std::ifstream input(filepath.string());
+    ass::ifstream input(file);
     load(input);
   }
 
@@ -274,130 +400,254 @@ public:
   std::string& ScriptComment() { return script_comment_; }
 
   /* Getters */
-  const std::list<std::pair<std::string, std::string>>& Section(const std::string& section) const { return sections_map_.at(section); }
+  const std::list<std::pair<std::string, std::string>>& Section(const std::string& section) const { return *sections_map_.at(section); }
+
+  // Lines of a section, for changing them: a section shared with another
+  // script is copied first. The reference must not be kept across share().
+  std::list<std::pair<std::string, std::string>>& Section(const std::string& section) { return detach(sections_map_.at(section)); }
 
   const std::unordered_set<std::string>& Sections() const { return sections_; }
 
+  // Sections, known or not, in output order
+  const std::vector<std::string>& SectionOrder() const { return order_; }
+
+  // Verbatim lines of a section unknown to the tools, if it is one
+  const std::string* RawSection(const std::string& section) const {
+    std::unordered_map<std::string, std::shared_ptr<const std::string>>::const_iterator it = raw_sections_.find(section);
+    return (it != raw_sections_.end()) ? it->second.get() : nullptr;
+  }
+
   bool HasSection(const std::string& section) const {
-    if ((sections_.find(section) != sections_.end()) && !sections_map_.at(section).empty())
+    if ((sections_.find(section) != sections_.end()) && !sections_map_.at(section)->empty())
       return true;
     return false;
   }
 
   /* Methods */
   void add_line(const std::string& section, const std::string& type, const std::string& data) {
-    sections_.insert(section);
-    sections_map_[section].push_back(std::make_pair(type, data));
+    if (sections_.insert(section).second) order_section(section);
+    std::shared_ptr<Lines>& lines = sections_map_[section];
+    if (!lines) lines = std::make_shared<Lines>();
+    detach(lines).push_back(std::make_pair(type, data));
+  }
+
+  // Same, taking over the strings instead of copying them
+  void add_line(const std::string& section, std::string&& type, std::string&& data) {
+    if (sections_.insert(section).second) order_section(section);
+    std::shared_ptr<Lines>& lines = sections_map_[section];
+    if (!lines) lines = std::make_shared<Lines>();
+    detach(lines).push_back(std::make_pair(std::move(type), std::move(data)));
   }
 
   void clear() {
     script_comment_.clear();
     sections_.clear();
     sections_map_.clear();
+    order_.clear();
+    raw_sections_.clear();
+  }
+
+  // Take the line break, the section order and the unknown sections of
+  // other, so that they are written back as they were read. Unknown sections
+  // are shared, never copied.
+  void copy_layout(const ASSFile& other) {
+    line_break_ = other.line_break_;
+    order_ = other.order_;
+    raw_sections_ = other.raw_sections_;
   }
 
   void insert(const std::string& section, const std::list<std::pair<std::string, std::string>>& data) {
-    sections_.insert(section);
+    if (sections_.insert(section).second) order_section(section);
     for (const std::pair<std::string, std::string>& entry : data)
       add_line(section, entry.first, entry.second);
   }
 
-  void load(std::ifstream& input) {
+  // Take a section of other without copying it: both scripts reference the
+  // same lines until one of them changes them. Appended when this script
+  // has the section already.
+  void share(const std::string& section, const ASSFile& other) {
+    const std::shared_ptr<Lines>& lines = other.sections_map_.at(section);
+    std::shared_ptr<Lines>& own = sections_map_[section];
+    if (sections_.insert(section).second) order_section(section);
+    if (!own || own->empty()) own = lines;
+    else insert(section, *lines);
+  }
+
+  // Load a script from input. When result is given, malformed lines are
+  // recorded in it and skipped instead of throwing. Comment lines (';') are
+  // only kept in unknown sections: in standard ones, where every line is
+  // parsed as a typed entry, they are dropped.
+  void load(std::istream& input, ParseResult* result = nullptr) {
+    TRACE_SPAN("ASSFile::load");
     clear();
 
-    if (!input.is_open())
+    if (!input)
       throw io_error("can't open input file");
 
     std::string line;
     if (!getline(input, line, LINE_SEPARATOR))
       throw io_error("can't read input file");
 
+    std::size_t line_number = 1, line_offset = 0;
+    std::size_t next_offset = line.size() + (input.eof() ? 0 : ass::length(LINE_SEPARATOR));
+
     if (StringStartsWith(line, ass::BOM)) {
       has_bom_ = true;
       line = StringGetAfter(line, ass::BOM);
     } else {
       has_bom_ = false;
     }
-    if (line.back() == '\r') line_break_ = "\r\n";
-    StringTrim(&line);
-
-    if (line != SCRIPT_INFO)
-      throw io_error("input file isn't a valid V4 Script");
+    if (!line.empty() && (line.back() == '\r')) line_break_ = "\r\n";
+
+    // Without a header, lenient mode assumes it and reads the first line as data
+    bool pending = false;
+    std::string header = line;
+    StringTrim(&header);
+    if (header != SCRIPT_INFO) {
+      if (!result)
+        throw io_error("input file isn't a valid V4 Script");
+      result->diagnostics.push_back({Diagnostic::MISSING_HEADER, line_number, line_offset});
+      if (!line.empty() && (line.back() == '\r')) line.pop_back();
+      pending = true;
+    }
 
     bool skip_section = false;
     std::string current_type, current_data;
     std::string current_section = ass::SCRIPT_INFO;
     sections_.insert(current_section);
-    while (getline(input, line, line_break_)) {
-      if (line.front() == ';') continue;
+    order_.push_back(current_section);
+
+    // Lines of the unknown section being read; trailing blank lines are
+    // only kept when more lines follow
+    std::string raw_section, raw_data, raw_blanks;
+
+    // Fields checked in lenient mode
+    bool has_times = false;
+    std::size_t start_idx = 0, end_idx = 0;
+
+    while (pending || getline(input, line, line_break_)) {
+      if (pending) {
+        pending = false;
+      } else {
+        line_number++;
+        line_offset = next_offset;
+        next_offset += line.size() + (input.eof() ? 0 : line_break_.size());
+      }
 
       std::string trimmed_line = line;
       StringTrim(&trimmed_line);
 
+      if (skip_section && !defines_section(trimmed_line)) {
+        if (trimmed_line.empty()) {
+          raw_blanks.append(line).append(line_break_);
+        } else {
+          raw_data.append(raw_blanks).append(line).append(line_break_);
+          raw_blanks.clear();
+        }
+        continue;
+      }
+
       if (trimmed_line.empty()) continue; // No data? Ignore it then...
 
+      // Continue multi-line data (fonts and graphics). Encoded lines may
+      // start with ';' or '[', so they are told apart by their characters.
+      if (!current_type.empty() && is_encoded_line(trimmed_line)) {
+        current_data += line_break_ + trimmed_line;
+
+        // Multi-line data ends here?
+        if (trimmed_line.size() < 80) {
+          add_line(current_section, std::move(current_type), std::move(current_data));
+          current_type.clear();
+          current_data.clear();
+        }
+        continue;
+      }
+
+      if (line.front() == ';') continue;
+
       if (defines_section(trimmed_line)) {
         // Terminate multi-line data, if needed
         if (!current_type.empty()) {
-          add_line(current_section, current_type, current_data);
+          add_line(current_section, std::move(current_type), std::move(current_data));
 
           current_type.clear();
           current_data.clear();
         }
 
+        if (skip_section) add_raw_section(raw_section, raw_data);
+        raw_data.clear();
+        raw_blanks.clear();
+
         // Set flags
-        skip_section = (ass::SECTIONS.find(trimmed_line) == ass::SECTIONS.end());
-        if (!skip_section)
+        skip_section = !ass::is_standard_section(trimmed_line);
+        if (skip_section)
+          raw_section = trimmed_line;
+        else
           current_section = trimmed_line;
+        if (std::find(order_.begin(), order_.end(), trimmed_line) == order_.end())
+          order_.push_back(trimmed_line);
       } else {
-        // Data
-        if (!skip_section && !current_type.empty()) {
-          // Continue multi-line data (fonts and graphics)
-          if (!std::islower(trimmed_line.front())) current_data += line_break_ + trimmed_line;
-
-          // Multi-line data ends here?
-          if (std::islower(trimmed_line.front()) || trimmed_line.size() < 80) {
-            // Insert data
-            add_line(current_section, current_type, current_data);
-
-            // Clear temporals
-            current_type.clear();
-            current_data.clear();
-            continue;
-          }
+        // Data. Any other line ends multi-line data.
+        if (!current_type.empty()) {
+          add_line(current_section, std::move(current_type), std::move(current_data));
+          current_type.clear();
+          current_data.clear();
         }
 
         if (!skip_section && current_type.empty()) {
           // New line
           std::string::size_type delim_pos = line.find(":");
           if (delim_pos == std::string::npos) {
-            std::cout << line << std::endl;
-            throw io_error("line type delimiter not found");
+            if (!result)
+              throw io_error(StringPrintf("line %zu: line type delimiter not found", line_number).c_str());
+            result->diagnostics.push_back({Diagnostic::MISSING_DELIMITER, line_number, line_offset});
+            continue;
           }
 
           std::string type = line.substr(0, delim_pos);
           std::string data = line.substr(delim_pos+1);
 
           StringTrim(&type);
-          if (ass::MULTILINE_FIELDS.find(type) != ass::MULTILINE_FIELDS.end()) {
+          if (ass::is_multiline_field(type)) {
             // Multi-line data
-            current_type = type;
-            current_data = data;
+            current_type = std::move(type);
+            current_data = std::move(data);
             continue;
           }
 
+          // Drop events whose timing would make later operations fail
+          if (result && (current_section == ass::EVENTS)) {
+            if (type == "Format") {
+              has_times = get_field_index(data, "Start", &start_idx) && get_field_index(data, "End", &end_idx);
+            } else if (has_times) {
+              Diagnostic::Kind kind;
+              if (!check_times(data, start_idx, end_idx, &kind)) {
+                result->diagnostics.push_back({kind, line_number, line_offset});
+                continue;
+              }
+            }
+          }
+
           // Single line data
-          add_line(current_section, type, data);
+          add_line(current_section, std::move(type), std::move(data));
         }
       }
     }
 
     if (!current_type.empty())
-      add_line(current_section, current_type, current_data);
+      add_line(current_section, std::move(current_type), std::move(current_data));
+    if (skip_section)
+      add_raw_section(raw_section, raw_data);
   }
 
   void remove_line(const std::string& section, std::list<std::pair<std::string, std::string>>::const_iterator it) {
-    std::list<std::pair<std::string, std::string>>& data_list = sections_map_.at(section);
+    std::shared_ptr<Lines>& lines = sections_map_.at(section);
+    if (lines.use_count() > 1) {
+      // it points into the shared lines, find it again in the copy
+      const std::ptrdiff_t index = std::distance(static_cast<const Lines&>(*lines).begin(), it);
+      it = std::next(static_cast<const Lines&>(detach(lines)).begin(), index);
+    }
+    std::list<std::pair<std::string, std::string>>& data_list = *lines;
 
     data_list.erase(it);
     if (data_list.empty())
@@ -407,20 +657,100 @@ public:
   void remove_section(const std::string& section) {
     sections_.erase(section);
     sections_map_.erase(section);
+    raw_sections_.erase(section);
   }
 
 private:
 
+  typedef std::list<std::pair<std::string, std::string>> Lines;
+
+  // Lines no other script references, copied when shared
+  static Lines& detach(std::shared_ptr<Lines>& lines) {
+    if (lines.use_count() > 1) lines = std::make_shared<Lines>(*lines);
+    return *lines;
+  }
+
+  // Place a new known section before the first known section that follows
+  // it in the standard order, or last
+  void order_section(const std::string& section) {
+    if (std::find(order_.begin(), order_.end(), section) != order_.end()) return;
+
+    std::vector<std::string>::iterator pos = order_.end();
+    for (std::size_t next = ass::section_rank(section) + 1; next < ass::STANDARD_SECTION_COUNT; ++next) {
+      pos = std::find(order_.begin(), order_.end(), ass::STANDARD_SECTIONS[next]);
+      if (pos != order_.end()) break;
+    }
+    order_.insert(pos, section);
+  }
+
+  // Keep the lines of an unknown section; a repeated one is appended to the
+  // first
+  void add_raw_section(const std::string& section, std::string& data) {
+    std::shared_ptr<const std::string>& raw = raw_sections_[section];
+    if (raw) data.insert(0, *raw);
+    raw = std::make_shared<const std::string>(std::move(data));
+  }
+
+  // Whether line holds uuencoded data only (characters '!' to '`')
+  static bool is_encoded_line(const std::string& line) {
+    for (char ch : line)
+      if ((ch < '!') || (ch > '`')) return false;
+    return true;
+  }
+
+  // Whether the Start and End fields of an event are present and, when not
+  // empty, valid timestamps
+  static bool check_times(const std::string& data, std::size_t start_idx, std::size_t end_idx, Diagnostic::Kind* kind) {
+    for (std::size_t index : {start_idx, end_idx}) {
+      std::string::size_type begin, end;
+      if (!get_field(data, index, &begin, &end)) {
+        *kind = Diagnostic::MISSING_FIELD;
+        return false;
+      }
+      if (end == std::string::npos) end = data.size();
+
+      ass::time_t timestamp;
+      if ((begin < end) && !parse_time(data.data() + begin, data.data() + end, &timestamp)) {
+        *kind = Diagnostic::INVALID_TIMESTAMP;
+        return false;
+      }
+    }
+    return true;
+  }
+
   bool has_bom_;
 
   std::string line_break_;
   std::string script_comment_;
 
   std::unordered_set<std::string> sections_;
-  std::unordered_map<std::string, std::list<std::pair<std::string, std::string>>> sections_map_;
+  std::unordered_map<std::string, std::shared_ptr<Lines>> sections_map_; // Copied on write when shared
+
+  std::vector<std::string> order_;
+  std::unordered_map<std::string, std::shared_ptr<const std::string>> raw_sections_;
 };
 
-inline std::ostream& operator<<(std::ostream& lhs, const ASSFile& rhs) {
+namespace detail {
+
+typedef std::list<std::pair<std::string, std::string>> Lines;
+
+// Events sections with at least this many lines are formatted in parallel
+const std::size_t PARALLEL_WRITE_LINES = 1 << 14;
+
+inline void write_lines(std::ostream& out, const Lines& lines, const std::string& line_break) {
+  for (const std::pair<std::string, std::string>& entry : lines)
+    out << line_break << entry.first << ":" << entry.second;
+}
+
+inline void append_lines(std::string* out, Lines::const_iterator first, Lines::const_iterator last, const std::string& line_break) {
+  for (; first != last; ++first)
+    out->append(line_break).append(first->first).append(1, ':').append(first->second);
+}
+
+// Write a script, handing the lines of its [Events] section to write_events
+template <typename WriteEvents>
+void write_script(std::ostream& lhs, const ASSFile& rhs, WriteEvents write_events) {
+  TRACE_SPAN("write");
 
   if (rhs.BOM())
     lhs << ass::BOM;
@@ -429,7 +759,15 @@ inline std::ostream& operator<<(std::ostream& lhs, const ASSFile& rhs) {
     throw io_error("missing 'ScriptInfo' section");
 
   const std::string& line_break = rhs.LineBreak();
-  for (const std::string& section : {ass::SCRIPT_INFO, ass::STYLES, ass::FONTS, ass::GRAPHICS, ass::EVENTS}) {
+  for (const std::string& section : rhs.SectionOrder()) {
+    // Unknown sections go back as one block
+    const std::string* raw = rhs.RawSection(section);
+    if (raw) {
+      lhs << line_break << section << line_break;
+      lhs.write(raw->data(), static_cast<std::streamsize>(raw->size()));
+      continue;
+    }
+
     if (!rhs.HasSection(section)) continue;
     if (section != SCRIPT_INFO) lhs << line_break;
     lhs << section;
@@ -437,11 +775,76 @@ inline std::ostream& operator<<(std::ostream& lhs, const ASSFile& rhs) {
     if ((section == ass::SCRIPT_INFO) && !rhs.ScriptComment().empty())
       lhs << line_break << rhs.ScriptComment();
 
-    for (const std::pair<std::string, std::string>& entry : rhs.Section(section))
-      lhs << line_break << entry.first << ":" << entry.second;
+    if (section == ass::EVENTS) write_events(rhs.Section(section), line_break);
+    else write_lines(lhs, rhs.Section(section), line_break);
     lhs << line_break;
   }
+}
+
+// Format the lines in ranges, one per thread, and write them after each
+// other: at precomputed offsets with pwrite when the output is a plain file
+inline void write_lines_parallel(ass::ofstream& out, const Lines& lines, const std::string& line_break, std::size_t threads) {
+  TRACE_SPAN("write_parallel");
+  std::vector<Lines::const_iterator> bounds;
+  std::size_t i = 0;
+  for (Lines::const_iterator it = lines.begin(); it != lines.end(); ++it, ++i)
+    if ((i % ((lines.size() + threads - 1) / threads)) == 0) bounds.push_back(it);
+  bounds.push_back(lines.end());
+
+  const std::size_t ranges = bounds.size() - 1;
+  std::vector<std::string> buffers(ranges);
+  ThreadPool pool(threads);
+  {
+    TRACE_SPAN("format");
+    for (std::size_t r = 0; r < ranges; ++r)
+      pool.AddTask([&buffers, &bounds, &line_break, r]() { append_lines(&buffers[r], bounds[r], bounds[r + 1], line_break); });
+    pool.Wait();
+  }
+
+  off_t offset;
+  if (!out.begin_positional(&offset)) {
+    for (const std::string& buffer : buffers)
+      out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    return;
+  }
+
+  TRACE_SPAN("pwrite");
+  std::vector<off_t> offsets(ranges);
+  for (std::size_t r = 0; r < ranges; ++r) {
+    offsets[r] = offset;
+    offset += static_cast<off_t>(buffers[r].size());
+  }
+
+  std::atomic<bool> ok(true);
+  for (std::size_t r = 0; r < ranges; ++r) {
+    pool.AddTask([&out, &buffers, &offsets, &ok, r]() {
+      if (!out.write_at(buffers[r].data(), buffers[r].size(), offsets[r])) ok = false;
+    });
+  }
+  pool.Wait();
+  out.end_positional(offset, ok);
+}
+
+} // namespace detail
+
+inline std::ostream& operator<<(std::ostream& lhs, const ASSFile& rhs) {
+  detail::write_script(lhs, rhs, [&lhs](const detail::Lines& lines, const std::string& line_break) {
+    detail::write_lines(lhs, lines, line_break);
+  });
+  return lhs;
+}
 
+// Files get large [Events] sections formatted by several threads, with the
+// same output
+inline ass::ofstream& operator<<(ass::ofstream& lhs, const ASSFile& rhs) {
+  const std::size_t threads = std::thread::hardware_concurrency();
+  detail::write_script(lhs, rhs, [&lhs, threads](const detail::Lines& lines, const std::string& line_break) {
+    if ((threads > 1) && (lines.size() >= detail::PARALLEL_WRITE_LINES)) {
+      detail::write_lines_parallel(lhs, lines, line_break, threads);
+      return;
+    }
+    detail::write_lines(lhs, lines, line_break);
+  });
   return lhs;
 }
 
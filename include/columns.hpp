@@ -0,0 +1,341 @@
+// Structure-of-arrays timestamp columns for ASS events
+// Copyright (c) 2019 Slek
+//
+// EventColumns parses Start, End and Layer of every event once into
+// contiguous integer columns. Shift, scale, rebase and range checks then run
+// as plain loops over the whole column (which the compiler vectorizes), and
+// only the rows whose times actually changed are re-rendered as text, or
+// rewritten in place when the caller owns the lines.
+
+#ifndef COLUMNS_HPP_
+#define COLUMNS_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "schema.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+// Exact scale factor num/den
+struct Ratio {
+  std::int64_t num;
+  std::int64_t den;
+
+  Ratio()
+    : num(1), den(1) { }
+
+  Ratio(std::int64_t num, std::int64_t den)
+    : num(num), den(den) { }
+
+  // Closest ratio with a 10^9 denominator
+  static Ratio FromDouble(double value) {
+    const std::int64_t den = 1000000000;
+    return Ratio(std::llround(value * static_cast<double>(den)), den);
+  }
+
+  double value() const { return static_cast<double>(num) / static_cast<double>(den); }
+  bool is_one() const { return num == den; }
+};
+
+// Parse "num/den" or a decimal number ("1.001", "25") into an exact ratio
+inline bool parse_ratio(const std::string& str, Ratio* ratio) {
+  std::string::size_type slash = str.find('/');
+  if (slash != std::string::npos) {
+    char* end = nullptr;
+    const std::string num_str = str.substr(0, slash), den_str = str.substr(slash + 1);
+    const long long num = std::strtoll(num_str.c_str(), &end, 10);
+    if (num_str.empty() || (*end != '\0')) return false;
+    const long long den = std::strtoll(den_str.c_str(), &end, 10);
+    if (den_str.empty() || (*end != '\0')) return false;
+    if ((num <= 0) || (den <= 0) || (num > std::numeric_limits<std::int32_t>::max()) ||
+        (den > std::numeric_limits<std::int32_t>::max())) return false;
+    *ratio = Ratio(num, den);
+    return true;
+  }
+
+  std::int64_t num = 0, den = 1;
+  bool dot = false, digits = false;
+  for (char c : str) {
+    if ((c == '.') && !dot) {
+      dot = true;
+    } else if ((c >= '0') && (c <= '9')) {
+      digits = true;
+      if ((num > std::numeric_limits<std::int32_t>::max() / 10) || (dot && (den >= 1000000000))) {
+        // Too many digits for an exact ratio
+        char* end = nullptr;
+        double value = std::strtod(str.c_str(), &end);
+        if ((*end != '\0') || !std::isnormal(value) || (value < 0.0)) return false;
+        *ratio = Ratio::FromDouble(value);
+        return true;
+      }
+      num = num * 10 + (c - '0');
+      if (dot) den *= 10;
+    } else {
+      return false;
+    }
+  }
+  if (!digits || (num == 0)) return false;
+
+  *ratio = Ratio(num, den);
+  return true;
+}
+
+/* Column kernels */
+
+// col[i] += offset, returns false if any value leaves the int32 range
+inline bool shift_column(ass::time_signed_t* col, std::size_t n, std::int64_t offset) {
+  bool overflow = false;
+  for (std::size_t i = 0; i < n; ++i) {
+    const std::int64_t value = static_cast<std::int64_t>(col[i]) + offset;
+    overflow |= (value != static_cast<ass::time_signed_t>(value));
+    col[i] = static_cast<ass::time_signed_t>(value);
+  }
+  return !overflow;
+}
+
+// col[i] = floor(col[i] * num / den), returns false on int32 overflow. The
+// quotient is estimated in floating point and corrected by one step with the
+// exact integer remainder, so no division is performed per element.
+inline bool scale_column(ass::time_signed_t* col, std::size_t n, const Ratio& ratio) {
+  const double factor = ratio.value();
+  const std::int64_t num = ratio.num, den = ratio.den;
+  bool overflow = false;
+  for (std::size_t i = 0; i < n; ++i) {
+    const std::int64_t t = col[i];
+    std::int64_t q = static_cast<std::int64_t>(std::floor(static_cast<double>(t) * factor));
+    const std::int64_t r = t * num - q * den;
+    q -= (r < 0);
+    q += (r >= den);
+    overflow |= (q != static_cast<ass::time_signed_t>(q));
+    col[i] = static_cast<ass::time_signed_t>(q);
+  }
+  return !overflow;
+}
+
+// True when every value with (mask[i] & bit) lies in [min, max]
+inline bool check_column(const ass::time_signed_t* col, const std::uint8_t* mask, std::uint8_t bit, std::size_t n,
+                         ass::time_signed_t min, ass::time_signed_t max) {
+  bool bad = false;
+  for (std::size_t i = 0; i < n; ++i)
+    bad |= ((mask[i] & bit) != 0) & ((col[i] < min) | (col[i] > max));
+  return !bad;
+}
+
+class EventColumns {
+public:
+
+  enum : std::uint8_t {
+    START_DEFINED = 1 << 0,
+    END_DEFINED = 1 << 1,
+    END_PRESENT = 1 << 2 // End field isn't empty in the source line
+  };
+
+  typedef std::list<std::pair<std::string, std::string>>::const_iterator const_iterator;
+
+  // Parse the events in [first, last) described by format (the data of the
+  // Format line). End is ignored in command and sound events.
+  EventColumns(const std::string& format, const_iterator first, const_iterator last) {
+    TRACE_SPAN("timestamps");
+
+    const EventSchema schema(format);
+    if (!schema.has(EventField::START))
+      throw ass::io_error("'Start' field not found in format definition string");
+    if (!schema.has(EventField::END))
+      throw ass::io_error("'End' field not found in format definition string");
+
+    EventFields fields;
+    for (const_iterator it = first; it != last; ++it) {
+      const std::string& line_type = it->first;
+      const std::string& line_data = it->second;
+
+      Row row = {&(*it), 0, 0, 0, 0};
+      std::uint8_t flags = 0;
+      ass::time_signed_t start_ts = 0, end_ts = 0;
+      std::int32_t layer = 0;
+
+      schema.split(line_data, &fields);
+
+      const FieldRange& start_field = fields[EventField::START];
+      if (!start_field.found()) throw ass::io_error("'Start' field cannot be retrieved");
+      if (!start_field.empty()) {
+        start_ts = static_cast<ass::time_signed_t>(ass::parse_time(line_data.data() + start_field.begin, line_data.data() + start_field.end));
+        flags |= START_DEFINED;
+      }
+      row.start_begin = start_field.begin;
+      row.start_end = start_field.end;
+
+      const FieldRange& end_field = fields[EventField::END];
+      if (!end_field.found()) throw ass::io_error("'End' field cannot be retrieved");
+      if (!end_field.empty()) {
+        end_ts = static_cast<ass::time_signed_t>(ass::parse_time(line_data.data() + end_field.begin, line_data.data() + end_field.end));
+        flags |= END_DEFINED | END_PRESENT;
+      }
+      row.end_begin = end_field.begin;
+      row.end_end = end_field.end;
+
+      if (row.start_begin == row.end_begin)
+        throw ass::io_error("unexpected error");
+
+      // End ignored in command and sound events
+      if ((line_type == ass::COMMAND_EVENT) || (line_type == ass::SOUND_EVENT)) {
+        flags &= ~END_DEFINED;
+        end_ts = 0;
+      }
+
+      if (fields[EventField::LAYER].found() && !fields[EventField::LAYER].empty())
+        layer = static_cast<std::int32_t>(std::strtol(line_data.c_str() + fields[EventField::LAYER].begin, nullptr, 10));
+
+      rows_.push_back(row);
+      start.push_back(start_ts);
+      end.push_back(end_ts);
+      this->layer.push_back(layer);
+      this->flags.push_back(flags);
+    }
+
+    start0_ = start;
+    end0_ = end;
+  }
+
+  std::size_t size() const { return rows_.size(); }
+
+  const std::pair<std::string, std::string>& line(std::size_t i) const { return *rows_[i].line; }
+  const std::string& type(std::size_t i) const { return rows_[i].line->first; }
+  const std::string& data(std::size_t i) const { return rows_[i].line->second; }
+
+  bool start_defined(std::size_t i) const { return (flags[i] & START_DEFINED) != 0; }
+  bool end_defined(std::size_t i) const { return (flags[i] & END_DEFINED) != 0; }
+
+  // End is not kept for events without Start
+  void drop_end_without_start() {
+    for (std::size_t i = 0; i < flags.size(); ++i)
+      if (!(flags[i] & START_DEFINED)) flags[i] &= ~END_DEFINED;
+  }
+
+  /* Whole-column operations, applied to defined values only */
+  bool shift(std::int64_t offset) {
+    TRACE_SPAN("shift");
+    bool ok = shift_column(start.data(), size(), offset);
+    ok &= shift_column(end.data(), size(), offset);
+    return ok;
+  }
+
+  bool scale(const Ratio& ratio) {
+    TRACE_SPAN("scale");
+    if (ratio.is_one()) return true;
+    bool ok = scale_column(start.data(), size(), ratio);
+    ok &= scale_column(end.data(), size(), ratio);
+    return ok;
+  }
+
+  // Move rows starting at or after t back by t, with ends before t set to
+  // zero. after[i] tells whether row i was moved.
+  void rebase(ass::time_signed_t t, std::vector<std::uint8_t>* after) {
+    TRACE_SPAN("rebase");
+    after->resize(size());
+    std::uint8_t* moved = after->data();
+    for (std::size_t i = 0; i < size(); ++i) {
+      const bool m = ((flags[i] & START_DEFINED) != 0) & (start[i] >= t);
+      moved[i] = m;
+      start[i] -= m ? t : 0;
+      end[i] = m ? ((end[i] >= t) ? end[i] - t : 0) : end[i];
+    }
+  }
+
+  bool check(ass::time_signed_t min, ass::time_signed_t max) const {
+    return check_column(start.data(), flags.data(), START_DEFINED, size(), min, max) &&
+           check_column(end.data(), flags.data(), END_DEFINED, size(), min, max);
+  }
+
+  // Whether row i must be re-rendered
+  bool changed(std::size_t i) const {
+    const std::uint8_t f = flags[i];
+    if ((f & START_DEFINED) && (start[i] != start0_[i])) return true;
+    if (f & END_DEFINED) return end[i] != end0_[i];
+    return (f & END_PRESENT) != 0; // End dropped
+  }
+
+  // Line data of row i with the current Start and End values
+  std::string render(std::size_t i) const {
+    const std::string& line_data = data(i);
+    if (!changed(i)) return line_data;
+
+    const Row& row = rows_[i];
+    std::string start_str, end_str;
+    if (start_defined(i))
+      start_str = ass::format_time(static_cast<ass::time_t>(start[i]));
+    if (end_defined(i))
+      end_str = ass::format_time(static_cast<ass::time_t>(end[i]));
+
+    std::string out;
+    out.reserve(line_data.size() + 4);
+    if (row.start_begin < row.end_begin) {
+      out.append(line_data, 0, row.start_begin);
+      out += start_str;
+      out.append(line_data, row.start_end, row.end_begin - row.start_end);
+      out += end_str;
+      out.append(line_data, row.end_end, std::string::npos);
+    } else {
+      out.append(line_data, 0, row.end_begin);
+      out += end_str;
+      out.append(line_data, row.end_end, row.start_begin - row.end_end);
+      out += start_str;
+      out.append(line_data, row.start_end, std::string::npos);
+    }
+    return out;
+  }
+
+  // Write the current Start and End values of row i into line_data, the
+  // source line of the row owned by the caller, replacing just those fields.
+  // Unchanged rows are left alone.
+  void update(std::size_t i, std::string* line_data) const {
+    if (!changed(i)) return;
+
+    const Row& row = rows_[i];
+    std::string start_str, end_str;
+    if (start_defined(i))
+      start_str = ass::format_time(static_cast<ass::time_t>(start[i]));
+    if (end_defined(i))
+      end_str = ass::format_time(static_cast<ass::time_t>(end[i]));
+
+    // The later field first, so the offsets of the other one still hold
+    if (row.start_begin < row.end_begin) {
+      line_data->replace(row.end_begin, row.end_end - row.end_begin, end_str);
+      line_data->replace(row.start_begin, row.start_end - row.start_begin, start_str);
+    } else {
+      line_data->replace(row.start_begin, row.start_end - row.start_begin, start_str);
+      line_data->replace(row.end_begin, row.end_end - row.end_begin, end_str);
+    }
+  }
+
+  std::vector<ass::time_signed_t> start;
+  std::vector<ass::time_signed_t> end;
+  std::vector<std::int32_t> layer;
+  std::vector<std::uint8_t> flags;
+
+private:
+
+  struct Row {
+    const std::pair<std::string, std::string>* line;
+    std::string::size_type start_begin, start_end;
+    std::string::size_type end_begin, end_end;
+  };
+
+  std::vector<Row> rows_;
+  std::vector<ass::time_signed_t> start0_;
+  std::vector<ass::time_signed_t> end0_;
+};
+
+} // namespace ass
+
+#endif // COLUMNS_HPP_
@@ -0,0 +1,379 @@
+// Text encodings of input and output scripts
+// Copyright (c) 2019 Slek
+//
+// Scripts are handled as UTF-8. UTF-16 (LE/BE) files are recognized by
+// their byte order mark or, without one, by the zero bytes of ASCII text.
+// Other input that isn't valid UTF-8 is read as Windows-1252. Decoder and
+// Encoder convert block by block, carrying incomplete sequences over to the
+// next block, and copy ASCII runs 8 bytes at a time.
+
+#ifndef ENCODING_HPP_
+#define ENCODING_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace ass {
+
+enum class Encoding {
+  UTF8,
+  UTF16LE,
+  UTF16BE,
+  WINDOWS1252
+};
+
+inline const char* encoding_name(Encoding encoding) {
+  switch (encoding) {
+    case Encoding::UTF8: return "UTF-8";
+    case Encoding::UTF16LE: return "UTF-16LE";
+    case Encoding::UTF16BE: return "UTF-16BE";
+    case Encoding::WINDOWS1252: return "Windows-1252";
+  }
+  return "unknown";
+}
+
+namespace detail {
+
+// Code points of Windows-1252 bytes 0x80-0x9f (unassigned ones map to the
+// C1 control with the same value)
+const std::uint16_t WINDOWS1252_HIGH[32] = {
+  0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+  0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+  0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+  0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178
+};
+
+const std::uint32_t REPLACEMENT_CHARACTER = 0xfffd;
+
+// 8 bytes whose bits set in mask are all clear. Masks are built from byte
+// patterns, so the test doesn't depend on the host byte order.
+inline bool word_clear(const unsigned char* data, const unsigned char (&pattern)[8]) {
+  std::uint64_t word, mask;
+  std::memcpy(&word, data, 8);
+  std::memcpy(&mask, pattern, 8);
+  return (word & mask) == 0;
+}
+
+const unsigned char ASCII_MASK[8] = {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80};
+const unsigned char UTF16LE_ASCII_MASK[8] = {0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff};
+const unsigned char UTF16BE_ASCII_MASK[8] = {0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80};
+
+inline void append_utf8(std::uint32_t cp, std::string* out) {
+  if (cp < 0x80) {
+    out->push_back(static_cast<char>(cp));
+  } else if (cp < 0x800) {
+    out->push_back(static_cast<char>(0xc0 | (cp >> 6)));
+    out->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+  } else if (cp < 0x10000) {
+    out->push_back(static_cast<char>(0xe0 | (cp >> 12)));
+    out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+  } else {
+    out->push_back(static_cast<char>(0xf0 | (cp >> 18)));
+    out->push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+  }
+}
+
+// Length of the UTF-8 sequence starting with lead, 0 when invalid
+inline std::size_t utf8_length(unsigned char lead) {
+  if (lead < 0x80) return 1;
+  if (lead < 0xc2) return 0;
+  if (lead < 0xe0) return 2;
+  if (lead < 0xf0) return 3;
+  if (lead < 0xf5) return 4;
+  return 0;
+}
+
+// Decode the UTF-8 sequence of length bytes at data, false when invalid
+inline bool utf8_decode(const unsigned char* data, std::size_t length, std::uint32_t* cp) {
+  static const std::uint32_t MIN[5] = {0, 0, 0x80, 0x800, 0x10000};
+  static const unsigned char LEAD_MASK[5] = {0, 0x7f, 0x1f, 0x0f, 0x07};
+  std::uint32_t value = data[0] & LEAD_MASK[length];
+  for (std::size_t i = 1; i < length; ++i) {
+    if ((data[i] & 0xc0) != 0x80) return false;
+    value = (value << 6) | (data[i] & 0x3f);
+  }
+  if ((value < MIN[length]) || (value > 0x10ffff) || ((value >= 0xd800) && (value < 0xe000))) return false;
+  *cp = value;
+  return true;
+}
+
+} // namespace detail
+
+// Whether data is valid UTF-8, a sequence cut at the end being accepted
+inline bool is_utf8(const char* data, std::size_t size) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  std::size_t i = 0;
+  while (i < size) {
+    if ((i + 8 <= size) && detail::word_clear(bytes + i, detail::ASCII_MASK)) {
+      i += 8;
+      continue;
+    }
+    const std::size_t length = detail::utf8_length(bytes[i]);
+    if (length == 0) return false;
+    if (i + length > size) {
+      for (std::size_t j = i + 1; j < size; ++j)
+        if ((bytes[j] & 0xc0) != 0x80) return false;
+      return true;
+    }
+    std::uint32_t cp;
+    if (!detail::utf8_decode(bytes + i, length, &cp)) return false;
+    i += length;
+  }
+  return true;
+}
+
+// Encoding of a stream starting with data
+inline Encoding detect_encoding(const char* data, std::size_t size) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  if ((size >= 2) && (bytes[0] == 0xff) && (bytes[1] == 0xfe)) return Encoding::UTF16LE;
+  if ((size >= 2) && (bytes[0] == 0xfe) && (bytes[1] == 0xff)) return Encoding::UTF16BE;
+  if ((size >= 3) && (bytes[0] == 0xef) && (bytes[1] == 0xbb) && (bytes[2] == 0xbf)) return Encoding::UTF8;
+
+  // Without BOM, ASCII text in UTF-16 has a zero byte in most code units,
+  // always on the same side
+  const std::size_t sample = std::min<std::size_t>(size, 4096) & ~static_cast<std::size_t>(1);
+  std::size_t even_zeros = 0, odd_zeros = 0;
+  for (std::size_t i = 0; i < sample; i += 2) {
+    even_zeros += (bytes[i] == 0);
+    odd_zeros += (bytes[i + 1] == 0);
+  }
+  const std::size_t units = sample / 2;
+  if ((units >= 2) && (2 * odd_zeros > units) && (8 * even_zeros < odd_zeros)) return Encoding::UTF16LE;
+  if ((units >= 2) && (2 * even_zeros > units) && (8 * odd_zeros < even_zeros)) return Encoding::UTF16BE;
+
+  return is_utf8(data, size) ? Encoding::UTF8 : Encoding::WINDOWS1252;
+}
+
+// Converts text in some encoding to UTF-8
+class Decoder {
+public:
+
+  explicit Decoder(Encoding encoding = Encoding::UTF8)
+    : encoding_(encoding), carry_(0), has_carry_(false), high_(0) { }
+
+  Encoding encoding() const { return encoding_; }
+
+  // Append the UTF-8 conversion of [data, data + size) to out
+  void Decode(const char* data, std::size_t size, std::string* out) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    switch (encoding_) {
+      case Encoding::UTF8:
+        out->append(data, size);
+        break;
+      case Encoding::UTF16LE:
+      case Encoding::UTF16BE:
+        DecodeUTF16(bytes, size, out);
+        break;
+      case Encoding::WINDOWS1252:
+        DecodeWindows1252(bytes, size, out);
+        break;
+    }
+  }
+
+  // Flush an unfinished sequence at the end of input
+  void Finish(std::string* out) {
+    if (has_carry_ || high_) detail::append_utf8(detail::REPLACEMENT_CHARACTER, out);
+    has_carry_ = false;
+    high_ = 0;
+  }
+
+private:
+
+  void DecodeUTF16(const unsigned char* bytes, std::size_t size, std::string* out) {
+    const bool le = (encoding_ == Encoding::UTF16LE);
+    std::size_t i = 0;
+
+    if (has_carry_ && (size > 0)) {
+      const unsigned char pair[2] = {carry_, bytes[0]};
+      Unit(le ? (pair[0] | (pair[1] << 8)) : ((pair[0] << 8) | pair[1]), out);
+      has_carry_ = false;
+      i = 1;
+    }
+
+    const unsigned char (&mask)[8] = le ? detail::UTF16LE_ASCII_MASK : detail::UTF16BE_ASCII_MASK;
+    const std::size_t low = le ? 0 : 1;
+    while (i + 2 <= size) {
+      if (!high_ && (i + 8 <= size) && detail::word_clear(bytes + i, mask)) {
+        out->push_back(static_cast<char>(bytes[i + low]));
+        out->push_back(static_cast<char>(bytes[i + low + 2]));
+        out->push_back(static_cast<char>(bytes[i + low + 4]));
+        out->push_back(static_cast<char>(bytes[i + low + 6]));
+        i += 8;
+        continue;
+      }
+      Unit(le ? (bytes[i] | (bytes[i + 1] << 8)) : ((bytes[i] << 8) | bytes[i + 1]), out);
+      i += 2;
+    }
+
+    if (i < size) {
+      carry_ = bytes[i];
+      has_carry_ = true;
+    }
+  }
+
+  void Unit(std::uint32_t unit, std::string* out) {
+    if (high_) {
+      if ((unit >= 0xdc00) && (unit < 0xe000)) {
+        detail::append_utf8(0x10000 + ((high_ - 0xd800) << 10) + (unit - 0xdc00), out);
+        high_ = 0;
+        return;
+      }
+      detail::append_utf8(detail::REPLACEMENT_CHARACTER, out);
+      high_ = 0;
+    }
+    if ((unit >= 0xd800) && (unit < 0xdc00)) high_ = unit;
+    else if ((unit >= 0xdc00) && (unit < 0xe000)) detail::append_utf8(detail::REPLACEMENT_CHARACTER, out);
+    else detail::append_utf8(unit, out);
+  }
+
+  void DecodeWindows1252(const unsigned char* bytes, std::size_t size, std::string* out) {
+    std::size_t i = 0;
+    while (i < size) {
+      if ((i + 8 <= size) && detail::word_clear(bytes + i, detail::ASCII_MASK)) {
+        out->append(reinterpret_cast<const char*>(bytes + i), 8);
+        i += 8;
+        continue;
+      }
+      const unsigned char ch = bytes[i++];
+      if (ch < 0x80) out->push_back(static_cast<char>(ch));
+      else if (ch < 0xa0) detail::append_utf8(detail::WINDOWS1252_HIGH[ch - 0x80], out);
+      else detail::append_utf8(ch, out);
+    }
+  }
+
+  Encoding encoding_;
+  unsigned char carry_;  // Odd byte of a UTF-16 code unit
+  bool has_carry_;
+  std::uint32_t high_;   // Pending high surrogate, 0 when none
+};
+
+// Converts UTF-8 text to some encoding. Invalid UTF-8 becomes U+FFFD, and
+// characters Windows-1252 can't represent become '?'.
+class Encoder {
+public:
+
+  explicit Encoder(Encoding encoding = Encoding::UTF8)
+    : encoding_(encoding) { }
+
+  Encoding encoding() const { return encoding_; }
+
+  // Append the conversion of [data, data + size) to out
+  void Encode(const char* data, std::size_t size, std::string* out) {
+    if (encoding_ == Encoding::UTF8) {
+      out->append(data, size);
+      return;
+    }
+
+    // Complete the sequence cut at the end of the previous block
+    std::size_t i = 0;
+    while (!carry_.empty() && (i < size)) {
+      if ((static_cast<unsigned char>(data[i]) & 0xc0) != 0x80) {
+        carry_.clear();
+        Char(detail::REPLACEMENT_CHARACTER, out);
+        break;
+      }
+      carry_.push_back(data[i++]);
+      if (carry_.size() == detail::utf8_length(static_cast<unsigned char>(carry_[0]))) {
+        const std::string pending = carry_;
+        carry_.clear();
+        Convert(reinterpret_cast<const unsigned char*>(pending.data()), pending.size(), out);
+      }
+    }
+
+    Convert(reinterpret_cast<const unsigned char*>(data) + i, size - i, out);
+  }
+
+  // Flush an unfinished sequence at the end of output
+  void Finish(std::string* out) {
+    if (!carry_.empty()) Char(detail::REPLACEMENT_CHARACTER, out);
+    carry_.clear();
+  }
+
+private:
+
+  void Convert(const unsigned char* bytes, std::size_t size, std::string* out) {
+    std::size_t i = 0;
+    while (i < size) {
+      if ((i + 8 <= size) && detail::word_clear(bytes + i, detail::ASCII_MASK)) {
+        Ascii(bytes + i, out);
+        i += 8;
+        continue;
+      }
+      const std::size_t length = detail::utf8_length(bytes[i]);
+      if (length == 0) {
+        Char(detail::REPLACEMENT_CHARACTER, out);
+        i++;
+        continue;
+      }
+      if (i + length > size) {
+        carry_.assign(reinterpret_cast<const char*>(bytes + i), size - i);
+        return;
+      }
+      std::uint32_t cp;
+      if (detail::utf8_decode(bytes + i, length, &cp)) {
+        Char(cp, out);
+        i += length;
+      } else {
+        Char(detail::REPLACEMENT_CHARACTER, out);
+        i++;
+      }
+    }
+  }
+
+  void Ascii(const unsigned char* bytes, std::string* out) {
+    if (encoding_ == Encoding::WINDOWS1252) {
+      out->append(reinterpret_cast<const char*>(bytes), 8);
+      return;
+    }
+    char units[16];
+    const std::size_t low = (encoding_ == Encoding::UTF16LE) ? 0 : 1;
+    for (std::size_t k = 0; k < 8; ++k) {
+      units[2 * k + low] = static_cast<char>(bytes[k]);
+      units[2 * k + 1 - low] = 0;
+    }
+    out->append(units, 16);
+  }
+
+  void Char(std::uint32_t cp, std::string* out) {
+    if (encoding_ == Encoding::WINDOWS1252) {
+      if ((cp < 0x80) || ((cp >= 0xa0) && (cp < 0x100))) {
+        out->push_back(static_cast<char>(cp));
+        return;
+      }
+      for (std::size_t k = 0; k < 32; ++k) {
+        if (detail::WINDOWS1252_HIGH[k] == cp) {
+          out->push_back(static_cast<char>(0x80 + k));
+          return;
+        }
+      }
+      out->push_back('?');
+      return;
+    }
+
+    if (cp >= 0x10000) {
+      Unit(0xd800 + ((cp - 0x10000) >> 10), out);
+      Unit(0xdc00 + ((cp - 0x10000) & 0x3ff), out);
+    } else {
+      Unit(cp, out);
+    }
+  }
+
+  void Unit(std::uint32_t unit, std::string* out) {
+    const char hi = static_cast<char>(unit >> 8), lo = static_cast<char>(unit & 0xff);
+    if (encoding_ == Encoding::UTF16LE) { out->push_back(lo); out->push_back(hi); }
+    else { out->push_back(hi); out->push_back(lo); }
+  }
+
+  Encoding encoding_;
+  std::string carry_;  // Incomplete UTF-8 sequence
+};
+
+} // namespace ass
+
+#endif // ENCODING_HPP_
@@ -0,0 +1,652 @@
+// File streams with transparent gzip/zstd compression
+// Copyright (c) 2019 Slek
+//
+// ass::ifstream detects gzip and zstd input from its magic bytes and
+// decompresses it in large blocks straight into the get area, so the parser
+// reads it like a plain file. Text that isn't UTF-8 is transcoded to UTF-8 in
+// the same pass (see encoding.hpp). ass::ofstream compresses when the file
+// name ends in .gz or .zst, optionally encoding the text first. gzip needs
+// zlib (ASS_HAVE_ZLIB) and zstd needs libzstd (ASS_HAVE_ZSTD); without them
+// such files fail to open.
+//
+// Opened to skip unchanged output, ass::ofstream compares the bytes it
+// produces with the existing file instead of writing them. The file is only
+// written, from the first difference on, when its contents change, so an
+// identical output keeps its mtime.
+//
+// Plain (uncompressed UTF-8) output also takes blocks at explicit offsets
+// with pwrite, so that several threads can write their parts of it at once.
+
+#ifndef FSTREAM_HPP_
+#define FSTREAM_HPP_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <ios>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(ASS_HAVE_ZLIB)
+  #include <zlib.h>
+#endif
+
+#if defined(ASS_HAVE_ZSTD)
+  #include <zstd.h>
+#endif
+
+#include "encoding.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+enum class Compression {
+  NONE,
+  GZIP,
+  ZSTD
+};
+
+// Compression used for a file name (by extension)
+inline Compression compression_for_path(const std::string& path) {
+  if (StringEndsWith(path, ".gz")) return Compression::GZIP;
+  if (StringEndsWith(path, ".zst") || StringEndsWith(path, ".zstd")) return Compression::ZSTD;
+  return Compression::NONE;
+}
+
+// Compression of a stream starting with data (by magic bytes)
+inline Compression compression_for_data(const char* data, std::size_t size) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  if ((size >= 2) && (bytes[0] == 0x1f) && (bytes[1] == 0x8b)) return Compression::GZIP;
+  if ((size >= 4) && (bytes[0] == 0x28) && (bytes[1] == 0xb5) && (bytes[2] == 0x2f) && (bytes[3] == 0xfd)) return Compression::ZSTD;
+  return Compression::NONE;
+}
+
+inline bool compression_supported(Compression compression) {
+  switch (compression) {
+    case Compression::NONE: return true;
+#if defined(ASS_HAVE_ZLIB)
+    case Compression::GZIP: return true;
+#endif
+#if defined(ASS_HAVE_ZSTD)
+    case Compression::ZSTD: return true;
+#endif
+    default: return false;
+  }
+}
+
+namespace detail {
+
+const std::size_t STREAM_BLOCK_SIZE = 1 << 18;
+
+class decompress_buf : public std::streambuf {
+public:
+
+  decompress_buf()
+    : file_(nullptr), compression_(Compression::NONE), in_pos_(0), in_size_(0), eof_(false), error_(false), detected_(false) { }
+
+  ~decompress_buf() { close(); }
+
+  bool open(const std::string& path) {
+    close();
+    file_ = std::fopen(path.c_str(), "rb");
+    if (!file_) return false;
+
+    in_.resize(STREAM_BLOCK_SIZE);
+    out_.resize(STREAM_BLOCK_SIZE);
+    Fill();
+    compression_ = compression_for_data(in_.data(), in_size_);
+    if (!compression_supported(compression_) || !InitDecoder()) {
+      close();
+      return false;
+    }
+    setg(out_.data(), out_.data(), out_.data());
+    return true;
+  }
+
+  bool is_open() const { return file_ != nullptr; }
+
+  // Encoding of the input, known once reading started
+  Encoding encoding() const { return decoder_.encoding(); }
+
+  void close() {
+    if (!file_) return;
+    EndDecoder();
+    std::fclose(file_);
+    file_ = nullptr;
+    in_pos_ = in_size_ = 0;
+    eof_ = error_ = false;
+    detected_ = false;
+    decoder_ = Decoder();
+    text_.clear();
+    setg(nullptr, nullptr, nullptr);
+  }
+
+protected:
+
+  int_type underflow() override {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    if (!file_) return traits_type::eof();
+
+    for (;;) {
+      const std::size_t produced = Produce();
+      if (!detected_ && produced) {
+        decoder_ = Decoder(detect_encoding(out_.data(), produced));
+        detected_ = true;
+      }
+
+      if (decoder_.encoding() == Encoding::UTF8) {
+        if (produced == 0) return traits_type::eof();
+        setg(out_.data(), out_.data(), out_.data() + produced);
+        return traits_type::to_int_type(*gptr());
+      }
+
+      text_.clear();
+      if (produced) decoder_.Decode(out_.data(), produced, &text_);
+      else decoder_.Finish(&text_);
+      if (text_.empty()) {
+        if (produced == 0) return traits_type::eof();
+        continue;
+      }
+      setg(&text_[0], &text_[0], &text_[0] + text_.size());
+      return traits_type::to_int_type(*gptr());
+    }
+  }
+
+private:
+
+  decompress_buf(const decompress_buf&) = delete;
+  decompress_buf& operator=(const decompress_buf&) = delete;
+
+  // Read or decompress the next block into out_, returns its size (0 at the
+  // end of input)
+  std::size_t Produce() {
+    if (error_) throw std::ios_base::failure("truncated or corrupt compressed input");
+
+    // Output decoded before an error is still delivered
+    std::size_t produced = 0;
+    while ((produced == 0) && !error_) {
+      if (compression_ == Compression::NONE) {
+        // Plain files are read straight into the get area
+        if (in_pos_ < in_size_) {
+          produced = in_size_ - in_pos_;
+          std::memcpy(out_.data(), in_.data() + in_pos_, produced);
+          in_pos_ = in_size_;
+        } else {
+          produced = std::fread(out_.data(), 1, out_.size(), file_);
+          if (produced == 0) break;
+        }
+        continue;
+      }
+
+      if ((in_pos_ == in_size_) && !eof_) Fill();
+      if ((in_pos_ == in_size_) && eof_ && Drained()) break;
+      produced = Decode();
+    }
+
+    if ((produced == 0) && error_) throw std::ios_base::failure("truncated or corrupt compressed input");
+    return produced;
+  }
+
+  void Fill() {
+    in_pos_ = 0;
+    in_size_ = std::fread(in_.data(), 1, in_.size(), file_);
+    if (in_size_ < in_.size()) eof_ = true;
+  }
+
+  bool InitDecoder() {
+#if defined(ASS_HAVE_ZLIB)
+    if (compression_ == Compression::GZIP) {
+      std::memset(&zs_, 0, sizeof(zs_));
+      zs_done_ = false;
+      return inflateInit2(&zs_, 15 + 32) == Z_OK; // gzip or zlib header
+    }
+#endif
+#if defined(ASS_HAVE_ZSTD)
+    if (compression_ == Compression::ZSTD) {
+      zds_ = ZSTD_createDStream();
+      return zds_ && !ZSTD_isError(ZSTD_initDStream(zds_));
+    }
+#endif
+    return true;
+  }
+
+  void EndDecoder() {
+#if defined(ASS_HAVE_ZLIB)
+    if (compression_ == Compression::GZIP) inflateEnd(&zs_);
+#endif
+#if defined(ASS_HAVE_ZSTD)
+    if ((compression_ == Compression::ZSTD) && zds_) {
+      ZSTD_freeDStream(zds_);
+      zds_ = nullptr;
+    }
+#endif
+    compression_ = Compression::NONE;
+  }
+
+  // Whether the decoder holds no more output once the input is exhausted
+  bool Drained() const {
+#if defined(ASS_HAVE_ZLIB)
+    if (compression_ == Compression::GZIP) return zs_done_;
+#endif
+#if defined(ASS_HAVE_ZSTD)
+    if (compression_ == Compression::ZSTD) return zstd_drained_;
+#endif
+    return true;
+  }
+
+  // Decompress from the input block into out_, returns the bytes produced
+  std::size_t Decode() {
+#if defined(ASS_HAVE_ZLIB)
+    if (compression_ == Compression::GZIP) {
+      if (zs_done_) {
+        if (in_pos_ == in_size_) return 0;
+        // Concatenated gzip members
+        if (inflateReset(&zs_) != Z_OK) { error_ = true; return 0; }
+        zs_done_ = false;
+      }
+      zs_.next_in = reinterpret_cast<Bytef*>(in_.data() + in_pos_);
+      zs_.avail_in = static_cast<uInt>(in_size_ - in_pos_);
+      zs_.next_out = reinterpret_cast<Bytef*>(out_.data());
+      zs_.avail_out = static_cast<uInt>(out_.size());
+      const int ret = inflate(&zs_, Z_NO_FLUSH);
+      in_pos_ = in_size_ - zs_.avail_in;
+      if (ret == Z_STREAM_END) zs_done_ = true;
+      else if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) error_ = true;
+      else if ((ret == Z_BUF_ERROR) && eof_ && (in_pos_ == in_size_)) error_ = true; // Truncated
+      return out_.size() - zs_.avail_out;
+    }
+#endif
+#if defined(ASS_HAVE_ZSTD)
+    if (compression_ == Compression::ZSTD) {
+      ZSTD_inBuffer input = {in_.data(), in_size_, in_pos_};
+      ZSTD_outBuffer output = {out_.data(), out_.size(), 0};
+      const std::size_t ret = ZSTD_decompressStream(zds_, &output, &input);
+      in_pos_ = input.pos;
+      if (ZSTD_isError(ret)) error_ = true;
+      zstd_drained_ = (output.pos < output.size);
+      return output.pos;
+    }
+#endif
+    error_ = true;
+    return 0;
+  }
+
+  std::FILE* file_;
+  Compression compression_;
+  std::vector<char> in_;
+  std::vector<char> out_;
+  std::size_t in_pos_;
+  std::size_t in_size_;
+  bool eof_;
+  bool error_;
+
+  bool detected_;
+  Decoder decoder_;
+  std::string text_;  // Transcoded block, when not UTF-8
+
+#if defined(ASS_HAVE_ZLIB)
+  z_stream zs_;
+  bool zs_done_ = false;
+#endif
+#if defined(ASS_HAVE_ZSTD)
+  ZSTD_DStream* zds_ = nullptr;
+  bool zstd_drained_ = false;
+#endif
+};
+
+class compress_buf : public std::streambuf {
+public:
+
+  compress_buf()
+    : file_(nullptr), compression_(Compression::NONE), error_(false), comparing_(false), in_place_(false),
+      unchanged_(false), offset_(0) { }
+
+  ~compress_buf() { close(); }
+
+  bool open(const std::string& path, Compression compression, Encoding encoding = Encoding::UTF8,
+            bool skip_unchanged = false) {
+    close();
+    if (!compression_supported(compression)) return false;
+
+    path_ = path;
+    offset_ = 0;
+    unchanged_ = false;
+    in_place_ = false;
+    comparing_ = skip_unchanged && (file_ = std::fopen(path.c_str(), "rb"));
+    if (!comparing_) file_ = std::fopen(path.c_str(), "wb");
+    if (!file_) return false;
+
+    compression_ = compression;
+    encoder_ = Encoder(encoding);
+    if (!InitEncoder()) {
+      std::fclose(file_);
+      file_ = nullptr;
+      return false;
+    }
+
+    buffer_.resize(STREAM_BLOCK_SIZE);
+    if (compression_ != Compression::NONE) out_.resize(STREAM_BLOCK_SIZE);
+    if (comparing_) existing_.resize(STREAM_BLOCK_SIZE);
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    return true;
+  }
+
+  bool is_open() const { return file_ != nullptr; }
+
+  // Whether the last file closed was left untouched, its contents being
+  // the same output
+  bool unchanged() const { return unchanged_; }
+
+  // Start writing blocks at explicit offsets, possible for plain output
+  // only. Buffered data is written first; *offset is where it ends.
+  bool BeginPositional(off_t* offset) {
+    if (!file_ || (compression_ != Compression::NONE) || (encoder_.encoding() != Encoding::UTF8) || comparing_)
+      return false;
+    if (sync() != 0) return false;
+    *offset = offset_;
+    return true;
+  }
+
+  // Write a block at offset, safe to call from several threads at once
+  bool WriteAt(const char* data, std::size_t size, off_t offset) const {
+    const int fd = ::fileno(file_);
+    while (size > 0) {
+      const ssize_t written = ::pwrite(fd, data, size, offset);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      data += written;
+      size -= static_cast<std::size_t>(written);
+      offset += written;
+    }
+    return true;
+  }
+
+  // Go on writing sequentially after the blocks, which end at end
+  void EndPositional(off_t end, bool ok) {
+    if (!ok || (::fseeko(file_, end, SEEK_SET) != 0)) error_ = true;
+    offset_ = end;
+  }
+
+  // Flush and finish the compressed stream, false on write errors
+  bool close() {
+    if (!file_) return true;
+    bool ok = Encode(pbase(), static_cast<std::size_t>(pptr() - pbase()), true);
+    EndEncoder();
+    if (comparing_) {
+      // Same output so far, unless the existing file is longer
+      if ((std::fgetc(file_) == EOF) && !std::ferror(file_)) unchanged_ = true;
+      else ok &= Diverge();
+    }
+    if (in_place_ && !error_)
+      ok &= (std::fflush(file_) == 0) && (::ftruncate(::fileno(file_), offset_) == 0);
+    ok &= (std::fclose(file_) == 0) && !error_;
+    file_ = nullptr;
+    error_ = false;
+    setp(nullptr, nullptr);
+    return ok;
+  }
+
+protected:
+
+  int_type overflow(int_type ch) override {
+    if (!file_) return traits_type::eof();
+    if (!Encode(pbase(), static_cast<std::size_t>(pptr() - pbase()), false)) return traits_type::eof();
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  // Hands buffered data to the encoder, without forcing a compressed block
+  int sync() override {
+    if (!file_) return -1;
+    if (!Encode(pbase(), static_cast<std::size_t>(pptr() - pbase()), false)) return -1;
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    return ((compression_ == Compression::NONE) && !comparing_) ? std::fflush(file_) : 0;
+  }
+
+private:
+
+  compress_buf(const compress_buf&) = delete;
+  compress_buf& operator=(const compress_buf&) = delete;
+
+  bool InitEncoder() {
+#if defined(ASS_HAVE_ZLIB)
+    if (compression_ == Compression::GZIP) {
+      std::memset(&zs_, 0, sizeof(zs_));
+      return deflateInit2(&zs_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+#endif
+#if defined(ASS_HAVE_ZSTD)
+    if (compression_ == Compression::ZSTD) {
+      zcs_ = ZSTD_createCStream();
+      return zcs_ && !ZSTD_isError(ZSTD_initCStream(zcs_, 3));
+    }
+#endif
+    return compression_ == Compression::NONE;
+  }
+
+  void EndEncoder() {
+#if defined(ASS_HAVE_ZLIB)
+    if (compression_ == Compression::GZIP) deflateEnd(&zs_);
+#endif
+#if defined(ASS_HAVE_ZSTD)
+    if ((compression_ == Compression::ZSTD) && zcs_) {
+      ZSTD_freeCStream(zcs_);
+      zcs_ = nullptr;
+    }
+#endif
+    compression_ = Compression::NONE;
+  }
+
+  bool Write(const char* data, std::size_t size) {
+    if (comparing_ && !error_) {
+      const std::size_t same = Compare(data, size);
+      offset_ += same;
+      if (same == size) return true;
+      if (!Diverge()) return false;
+      data += same;
+      size -= same;
+    }
+    if (size && (std::fwrite(data, 1, size, file_) != size)) error_ = true;
+    offset_ += size;
+    return !error_;
+  }
+
+  // Length of the prefix of [data, data + size) the existing file holds next
+  std::size_t Compare(const char* data, std::size_t size) {
+    std::size_t same = 0;
+    while (same < size) {
+      const std::size_t wanted = std::min(size - same, existing_.size());
+      const std::size_t got = std::fread(existing_.data(), 1, wanted, file_);
+      if ((got == wanted) && (std::memcmp(existing_.data(), data + same, got) == 0)) {
+        same += got;
+        continue;
+      }
+      std::size_t k = 0;
+      while ((k < got) && (existing_[k] == data[same + k])) ++k;
+      return same + k;
+    }
+    return same;
+  }
+
+  // The output differs from offset_ on: write the rest over the existing file
+  bool Diverge() {
+    comparing_ = false;
+    std::FILE* file = std::fopen(path_.c_str(), "r+b");
+    if (!file) return !(error_ = true);
+    std::fclose(file_);
+    file_ = file;
+    in_place_ = true;
+    if (::fseeko(file_, offset_, SEEK_SET) != 0) return !(error_ = true);
+    return true;
+  }
+
+  bool Encode(const char* data, std::size_t size, bool finish) {
+    if (encoder_.encoding() == Encoding::UTF8) return Compress(data, size, finish);
+
+    encoded_.clear();
+    encoder_.Encode(data, size, &encoded_);
+    if (finish) encoder_.Finish(&encoded_);
+    return Compress(encoded_.data(), encoded_.size(), finish);
+  }
+
+  bool Compress(const char* data, std::size_t size, bool finish) {
+    if (error_) return false;
+
+#if defined(ASS_HAVE_ZLIB)
+    if (compression_ == Compression::GZIP) {
+      zs_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+      zs_.avail_in = static_cast<uInt>(size);
+      int ret;
+      do {
+        zs_.next_out = reinterpret_cast<Bytef*>(out_.data());
+        zs_.avail_out = static_cast<uInt>(out_.size());
+        ret = deflate(&zs_, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR) return !(error_ = true);
+        if (!Write(out_.data(), out_.size() - zs_.avail_out)) return false;
+      } while ((zs_.avail_out == 0) || (finish && (ret != Z_STREAM_END)));
+      return true;
+    }
+#endif
+#if defined(ASS_HAVE_ZSTD)
+    if (compression_ == Compression::ZSTD) {
+      ZSTD_inBuffer input = {data, size, 0};
+      for (;;) {
+        ZSTD_outBuffer output = {out_.data(), out_.size(), 0};
+        const std::size_t ret = finish && (input.pos == input.size) ? ZSTD_endStream(zcs_, &output)
+                                                                     : ZSTD_compressStream(zcs_, &output, &input);
+        if (ZSTD_isError(ret)) return !(error_ = true);
+        if (!Write(out_.data(), output.pos)) return false;
+        if (input.pos < input.size) continue;
+        if (!finish || (ret == 0)) return true;
+      }
+    }
+#endif
+    (void) finish;
+    return Write(data, size);
+  }
+
+  std::FILE* file_;
+  Compression compression_;
+  std::vector<char> buffer_;
+  std::vector<char> out_;
+  bool error_;
+
+  // Skipping unchanged output
+  std::string path_;
+  bool comparing_;           // Output matches the existing file so far
+  bool in_place_;            // Rewriting the existing file from a difference on
+  bool unchanged_;
+  off_t offset_;             // Output bytes produced
+  std::vector<char> existing_;
+
+  Encoder encoder_;
+  std::string encoded_;  // Encoded block, when not UTF-8
+
+#if defined(ASS_HAVE_ZLIB)
+  z_stream zs_;
+#endif
+#if defined(ASS_HAVE_ZSTD)
+  ZSTD_CStream* zcs_ = nullptr;
+#endif
+};
+
+} // namespace detail
+
+// Input file stream, decompressing gzip and zstd files and transcoding
+// UTF-16 and Windows-1252 text to UTF-8 transparently. Corrupt compressed
+// data throws std::ios_base::failure while reading.
+class ifstream : public std::istream {
+public:
+
+  ifstream()
+    : std::istream(nullptr) {
+    init(&buf_);
+    exceptions(std::ios_base::badbit);
+  }
+
+  explicit ifstream(const std::string& path)
+    : ifstream() {
+    open(path);
+  }
+
+  void open(const std::string& path) {
+    if (buf_.open(path)) clear();
+    else setstate(std::ios_base::failbit);
+  }
+
+  bool is_open() const { return buf_.is_open(); }
+
+  // Encoding the file was read in, known once reading started
+  Encoding encoding() const { return buf_.encoding(); }
+
+  void close() { buf_.close(); }
+
+private:
+
+  detail::decompress_buf buf_;
+};
+
+// Output file stream, compressing files named *.gz or *.zst. UTF-8 text
+// written to it is stored in the given encoding. With skip_unchanged, a file
+// whose contents are already the same output isn't written at all.
+class ofstream : public std::ostream {
+public:
+
+  ofstream()
+    : std::ostream(nullptr) {
+    init(&buf_);
+  }
+
+  explicit ofstream(const std::string& path, Encoding encoding = Encoding::UTF8, bool skip_unchanged = false)
+    : ofstream() {
+    open(path, encoding, skip_unchanged);
+  }
+
+  void open(const std::string& path, Encoding encoding = Encoding::UTF8, bool skip_unchanged = false) {
+    if (buf_.open(path, compression_for_path(path), encoding, skip_unchanged)) clear();
+    else setstate(std::ios_base::failbit);
+  }
+
+  bool is_open() const { return buf_.is_open(); }
+
+  // Whether the closed file was left untouched (see skip_unchanged)
+  bool unchanged() const { return buf_.unchanged(); }
+
+  // Positional writes: blocks may be written at offsets from begin_positional()
+  // on, concurrently, until end_positional() gives the offset they end at.
+  // begin_positional() is false when the output isn't a plain file.
+  bool begin_positional(off_t* offset) { return buf_.BeginPositional(offset); }
+
+  bool write_at(const char* data, std::size_t size, off_t offset) const { return buf_.WriteAt(data, size, offset); }
+
+  void end_positional(off_t end, bool ok) {
+    buf_.EndPositional(end, ok);
+    if (!ok) setstate(std::ios_base::badbit);
+  }
+
+  void close() {
+    if (!buf_.close()) setstate(std::ios_base::failbit);
+  }
+
+private:
+
+  detail::compress_buf buf_;
+};
+
+} // namespace ass
+
+#endif // FSTREAM_HPP_
@@ -0,0 +1,238 @@
+// Interned style and actor names
+// Copyright (c) 2019 Slek
+//
+// StringTable maps names to dense integer ids with a flat, open-addressing
+// (linear probing) hash table. Names are looked up by character range, so
+// fields are matched straight from the event lines without copying them.
+// IdSet is a bitset over those ids. EventNames interns the Style and Name
+// (actor) fields of every event, so later lookups are integer operations.
+
+#ifndef INTERN_HPP_
+#define INTERN_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "schema.hpp"
+#include "tags.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+const std::uint32_t NO_ID = std::numeric_limits<std::uint32_t>::max();
+
+// Range with the surrounding white space removed
+inline TextSpan trim_span(const char* begin, const char* end) {
+  while ((begin < end) && IsWhiteSpace(*begin)) ++begin;
+  while ((end > begin) && IsWhiteSpace(*(end - 1))) --end;
+  return TextSpan(begin, end);
+}
+
+// Trimmed field index of line_data, false when it can't be retrieved
+inline bool get_field_span(const std::string& line_data, std::size_t index, TextSpan* field) {
+  std::string::size_type begin, end;
+  if (!ass::get_field(line_data, index, &begin, &end)) {
+    // Empty last field
+    if (begin != line_data.size()) return false;
+  }
+  if (end == std::string::npos) end = line_data.size();
+  *field = trim_span(line_data.data() + begin, line_data.data() + std::max(begin, end));
+  return true;
+}
+
+class StringTable {
+public:
+
+  StringTable()
+    : slots_(16, 0), offsets_(1, 0) { }
+
+  std::size_t size() const { return hashes_.size(); }
+  bool empty() const { return hashes_.empty(); }
+
+  TextSpan name(std::uint32_t id) const {
+    return TextSpan(storage_.data() + offsets_[id], offsets_[id + 1] - offsets_[id]);
+  }
+
+  std::uint32_t find(const char* data, std::size_t size) const {
+    const std::uint64_t hash = Hash(data, size);
+    const std::size_t mask = slots_.size() - 1;
+    for (std::size_t slot = static_cast<std::size_t>(hash) & mask; ; slot = (slot + 1) & mask) {
+      const std::uint32_t entry = slots_[slot];
+      if (entry == 0) return NO_ID;
+      if (Matches(entry - 1, hash, data, size)) return entry - 1;
+    }
+  }
+
+  std::uint32_t find(const TextSpan& str) const { return find(str.data, str.size); }
+  std::uint32_t find(const std::string& str) const { return find(str.data(), str.size()); }
+
+  // Id of a name, adding it when new
+  std::uint32_t intern(const char* data, std::size_t size) {
+    const std::uint64_t hash = Hash(data, size);
+    std::size_t mask = slots_.size() - 1;
+    std::size_t slot = static_cast<std::size_t>(hash) & mask;
+    for (; slots_[slot] != 0; slot = (slot + 1) & mask)
+      if (Matches(slots_[slot] - 1, hash, data, size)) return slots_[slot] - 1;
+
+    const std::uint32_t id = static_cast<std::uint32_t>(hashes_.size());
+    hashes_.push_back(hash);
+    storage_.append(data, size);
+    offsets_.push_back(static_cast<std::uint32_t>(storage_.size()));
+
+    // Keep the load factor under 1/2
+    if (2 * hashes_.size() > slots_.size()) {
+      Rehash(slots_.size() * 2);
+    } else {
+      slots_[slot] = id + 1;
+    }
+    return id;
+  }
+
+  std::uint32_t intern(const TextSpan& str) { return intern(str.data, str.size); }
+  std::uint32_t intern(const std::string& str) { return intern(str.data(), str.size()); }
+
+private:
+
+  static std::uint64_t Hash(const char* data, std::size_t size) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (std::size_t i = 0; i < size; ++i) {
+      hash ^= static_cast<unsigned char>(data[i]);
+      hash *= 1099511628211ull;
+    }
+    return hash ^ (hash >> 29);
+  }
+
+  bool Matches(std::uint32_t id, std::uint64_t hash, const char* data, std::size_t size) const {
+    return (hashes_[id] == hash) && (offsets_[id + 1] - offsets_[id] == size) &&
+           (std::memcmp(storage_.data() + offsets_[id], data, size) == 0);
+  }
+
+  void Rehash(std::size_t capacity) {
+    slots_.assign(capacity, 0);
+    const std::size_t mask = capacity - 1;
+    for (std::uint32_t id = 0; id < hashes_.size(); ++id) {
+      std::size_t slot = static_cast<std::size_t>(hashes_[id]) & mask;
+      while (slots_[slot] != 0) slot = (slot + 1) & mask;
+      slots_[slot] = id + 1;
+    }
+  }
+
+  std::vector<std::uint32_t> slots_;   // id + 1, 0 when empty
+  std::vector<std::uint64_t> hashes_;  // By id
+  std::vector<std::uint32_t> offsets_; // Name id is storage_[offsets_[id], offsets_[id + 1])
+  std::string storage_;
+};
+
+// Bitset of ids
+class IdSet {
+public:
+
+  IdSet() { }
+
+  explicit IdSet(std::size_t size)
+    : words_((size + 63) / 64, 0) { }
+
+  void insert(std::uint32_t id) {
+    if (id / 64 >= words_.size()) words_.resize(id / 64 + 1, 0);
+    words_[id / 64] |= (1ull << (id % 64));
+  }
+
+  bool contains(std::uint32_t id) const {
+    return (id / 64 < words_.size()) && ((words_[id / 64] >> (id % 64)) & 1);
+  }
+
+  void clear() { words_.clear(); }
+
+private:
+  std::vector<std::uint64_t> words_;
+};
+
+// Style and Name (actor) ids of every event in [first, last), described by
+// format (the data of the Format line). Events without a Name field get
+// the id of the empty name; non-Dialogue events (comments) too short to hold
+// a Style get NO_ID.
+class EventNames {
+public:
+
+  typedef std::list<std::pair<std::string, std::string>>::const_iterator const_iterator;
+
+  EventNames(const std::string& format, const_iterator first, const_iterator last) {
+    TRACE_SPAN("names");
+
+    const EventSchema schema(format);
+    if (!schema.has(EventField::STYLE))
+      throw ass::io_error("'Style' field not found in format definition string");
+
+    const std::uint32_t no_name = actors.intern("", 0);
+
+    EventFields fields;
+    for (const_iterator it = first; it != last; ++it) {
+      const std::string& data = it->second;
+      schema.split(data, &fields);
+
+      const FieldRange& style_field = fields[EventField::STYLE];
+      if (!style_field.found()) {
+        if (it->first == ass::DIALOGUE_EVENT)
+          throw ass::io_error("'Style' field cannot be retrieved");
+        style.push_back(NO_ID);
+        actor.push_back(no_name);
+        continue;
+      }
+      style.push_back(styles.intern(trim_span(data.data() + style_field.begin, data.data() + style_field.end)));
+
+      const FieldRange& name_field = fields[EventField::NAME];
+      if (name_field.found()) actor.push_back(actors.intern(trim_span(data.data() + name_field.begin, data.data() + name_field.end)));
+      else actor.push_back(no_name);
+    }
+  }
+
+  std::size_t size() const { return style.size(); }
+
+  // Style of event i, empty for NO_ID
+  TextSpan style_name(std::size_t i) const {
+    return (style[i] == NO_ID) ? TextSpan("", std::size_t(0)) : styles.name(style[i]);
+  }
+
+  StringTable styles;
+  StringTable actors;
+  std::vector<std::uint32_t> style;
+  std::vector<std::uint32_t> actor;
+};
+
+// Names of the styles defined in the [V4+ Styles] section and, when given,
+// the line defining each id (the last one for duplicated names)
+inline void intern_styles(const ass::ASSFile& ass, StringTable* names, std::vector<const std::pair<std::string, std::string>*>* lines = nullptr) {
+  if (!ass.HasSection(ass::STYLES)) return;
+
+  const std::list<std::pair<std::string, std::string>>& section = ass.Section(ass::STYLES);
+  if (section.front().first != "Format")
+    throw ass::io_error("format line must appear first");
+
+  std::size_t name_idx = std::numeric_limits<std::size_t>::max();
+  if (!ass::get_field_index(section.front().second, "Name", &name_idx))
+    throw ass::io_error("'Name' field not found in format definition string");
+
+  for (std::list<std::pair<std::string, std::string>>::const_iterator it = std::next(section.cbegin()); it != section.cend(); ++it) {
+    TextSpan name;
+    if (!get_field_span(it->second, name_idx, &name))
+      throw ass::io_error("'Name' field cannot be retrieved");
+    const std::uint32_t id = names->intern(name);
+    if (!lines) continue;
+    if (id == lines->size()) lines->push_back(&(*it));
+    else (*lines)[id] = &(*it);
+  }
+}
+
+} // namespace ass
+
+#endif // INTERN_HPP_
@@ -0,0 +1,209 @@
+// Request/response framing between ass_toolsd and its client
+// Copyright (c) 2019 Slek
+//
+// Every message is a sequence of length-prefixed strings (32-bit little
+// endian length followed by the raw bytes) over a Unix stream socket.
+//
+//   Request:  cwd, argc, argv[0..argc), has_input, [input]
+//   Response: status, stdout, stderr, has_output, [output]
+//
+// argv[0] is the tool name (e.g. "ass_time"). An input or output argument
+// given as "-" is transferred inline instead of through the file system.
+
+#ifndef IPC_HPP_
+#define IPC_HPP_
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace ipc {
+
+const char SOCKET_ENV[] = "ASS_TOOLSD_SOCKET";
+const char SOCKET_NAME[] = "ass_toolsd.sock";
+
+const std::uint32_t MAX_STRING_SIZE = 1u << 30;
+
+struct Request {
+  std::string cwd;
+  std::vector<std::string> args;
+  bool has_input = false;
+  std::string input;
+};
+
+struct Response {
+  int status = 1;
+  std::string out;
+  std::string err;
+  bool has_output = false;
+  std::string output;
+};
+
+// $ASS_TOOLSD_SOCKET, else in the user's private $XDG_RUNTIME_DIR, else a
+// per-user name in /tmp
+inline std::string socket_path() {
+  const char* path = std::getenv(SOCKET_ENV);
+  if (path && *path) return path;
+  const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir && *runtime_dir) return std::string(runtime_dir) + "/" + SOCKET_NAME;
+  return "/tmp/ass_toolsd-" + std::to_string(::geteuid()) + ".sock";
+}
+
+inline bool write_all(int fd, const char* data, std::size_t size) {
+  while (size > 0) {
+    ssize_t written = ::write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    size -= static_cast<std::size_t>(written);
+  }
+  return true;
+}
+
+inline bool read_all(int fd, char* data, std::size_t size) {
+  while (size > 0) {
+    ssize_t nread = ::read(fd, data, size);
+    if (nread < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (nread == 0) return false; // peer closed
+    data += nread;
+    size -= static_cast<std::size_t>(nread);
+  }
+  return true;
+}
+
+inline bool write_u32(int fd, std::uint32_t value) {
+  const char bytes[4] = {static_cast<char>(value & 0xff), static_cast<char>((value >> 8) & 0xff),
+                         static_cast<char>((value >> 16) & 0xff), static_cast<char>((value >> 24) & 0xff)};
+  return write_all(fd, bytes, sizeof(bytes));
+}
+
+inline bool read_u32(int fd, std::uint32_t* value) {
+  unsigned char bytes[4];
+  if (!read_all(fd, reinterpret_cast<char*>(bytes), sizeof(bytes))) return false;
+  *value = static_cast<std::uint32_t>(bytes[0]) | (static_cast<std::uint32_t>(bytes[1]) << 8) |
+           (static_cast<std::uint32_t>(bytes[2]) << 16) | (static_cast<std::uint32_t>(bytes[3]) << 24);
+  return true;
+}
+
+inline bool write_string(int fd, const std::string& str) {
+  if (str.size() > MAX_STRING_SIZE) return false;
+  return write_u32(fd, static_cast<std::uint32_t>(str.size())) && write_all(fd, str.data(), str.size());
+}
+
+inline bool read_string(int fd, std::string* str) {
+  std::uint32_t size;
+  if (!read_u32(fd, &size) || size > MAX_STRING_SIZE) return false;
+  str->resize(size);
+  return (size == 0) || read_all(fd, &(*str)[0], size);
+}
+
+inline bool send_request(int fd, const Request& request) {
+  if (!write_string(fd, request.cwd)) return false;
+  if (!write_u32(fd, static_cast<std::uint32_t>(request.args.size()))) return false;
+  for (const std::string& arg : request.args)
+    if (!write_string(fd, arg)) return false;
+  if (!write_u32(fd, request.has_input ? 1 : 0)) return false;
+  return !request.has_input || write_string(fd, request.input);
+}
+
+inline bool recv_request(int fd, Request* request) {
+  std::uint32_t argc, has_input;
+  if (!read_string(fd, &request->cwd)) return false;
+  if (!read_u32(fd, &argc) || argc > 1024) return false;
+  request->args.resize(argc);
+  for (std::string& arg : request->args)
+    if (!read_string(fd, &arg)) return false;
+  if (!read_u32(fd, &has_input)) return false;
+  request->has_input = (has_input != 0);
+  return !request->has_input || read_string(fd, &request->input);
+}
+
+inline bool send_response(int fd, const Response& response) {
+  return write_u32(fd, static_cast<std::uint32_t>(response.status)) &&
+         write_string(fd, response.out) && write_string(fd, response.err) &&
+         write_u32(fd, response.has_output ? 1 : 0) &&
+         (!response.has_output || write_string(fd, response.output));
+}
+
+inline bool recv_response(int fd, Response* response) {
+  std::uint32_t status, has_output;
+  if (!read_u32(fd, &status)) return false;
+  response->status = static_cast<int>(status);
+  if (!read_string(fd, &response->out) || !read_string(fd, &response->err)) return false;
+  if (!read_u32(fd, &has_output)) return false;
+  response->has_output = (has_output != 0);
+  return !response->has_output || read_string(fd, &response->output);
+}
+
+// Returns -1 on failure (errno is set)
+inline int make_address(const std::string& path, sockaddr_un* address) {
+  std::memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  std::memcpy(address->sun_path, path.c_str(), path.size() + 1);
+  return 0;
+}
+
+inline int connect(const std::string& path) {
+  sockaddr_un address;
+  if (make_address(path, &address) < 0) return -1;
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+inline int listen(const std::string& path, int backlog = 64) {
+  sockaddr_un address;
+  if (make_address(path, &address) < 0) return -1;
+
+  // Only a stale socket of ours is replaced: never another kind of file, a
+  // socket of another user or one a server still answers on
+  struct stat st;
+  if (::lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode) || (st.st_uid != ::geteuid())) {
+      errno = EEXIST;
+      return -1;
+    }
+    const int live = connect(path);
+    if (live >= 0) {
+      ::close(live);
+      errno = EADDRINUSE;
+      return -1;
+    }
+    if ((errno != ECONNREFUSED) || (::unlink(path.c_str()) < 0)) return -1;
+  }
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if ((::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) ||
+      (::listen(fd, backlog) < 0)) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+} // namespace ipc
+
+#endif // IPC_HPP_
@@ -0,0 +1,773 @@
+// Matroska (MKV) subtitle track reader
+// Copyright (c) 2019 Slek
+//
+// Builds an ASSFile straight from an SSA/ASS track of a Matroska file: the
+// script header comes from the track's CodecPrivate, the events from its
+// blocks and the fonts from the segment attachments.
+//
+// Top level elements are located through the SeekHead. Every cluster is
+// walked, since Cues are only a seek index that needn't list each subtitle
+// block, but blocks of other tracks are skipped by their headers: their
+// frames are never read. Cued cluster positions locate the first cluster and
+// let the walk resume past a damaged one.
+
+#ifndef MKV_HPP_
+#define MKV_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <istream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(ASS_HAVE_ZLIB)
+  #include <zlib.h>
+#endif
+
+#include "ass.hpp"
+#include "trace.hpp"
+#include "uuencode.hpp"
+#include "util/string.h"
+
+namespace mkv {
+
+// EBML element IDs (marker bits included)
+namespace id {
+
+const std::uint32_t EBML = 0x1A45DFA3;
+const std::uint32_t DOC_TYPE = 0x4282;
+const std::uint32_t SEGMENT = 0x18538067;
+const std::uint32_t SEEK_HEAD = 0x114D9B74;
+const std::uint32_t SEEK = 0x4DBB;
+const std::uint32_t SEEK_ID = 0x53AB;
+const std::uint32_t SEEK_POSITION = 0x53AC;
+const std::uint32_t INFO = 0x1549A966;
+const std::uint32_t TIMESTAMP_SCALE = 0x2AD7B1;
+const std::uint32_t TRACKS = 0x1654AE6B;
+const std::uint32_t TRACK_ENTRY = 0xAE;
+const std::uint32_t TRACK_NUMBER = 0xD7;
+const std::uint32_t CODEC_ID = 0x86;
+const std::uint32_t CODEC_PRIVATE = 0x63A2;
+const std::uint32_t NAME = 0x536E;
+const std::uint32_t LANGUAGE = 0x22B59C;
+const std::uint32_t CONTENT_ENCODINGS = 0x6D80;
+const std::uint32_t CONTENT_ENCODING = 0x6240;
+const std::uint32_t CONTENT_ENCODING_SCOPE = 0x5032;
+const std::uint32_t CONTENT_ENCODING_TYPE = 0x5033;
+const std::uint32_t CONTENT_COMPRESSION = 0x5034;
+const std::uint32_t CONTENT_COMP_ALGO = 0x4254;
+const std::uint32_t CONTENT_COMP_SETTINGS = 0x4255;
+const std::uint32_t CLUSTER = 0x1F43B675;
+const std::uint32_t CLUSTER_TIMESTAMP = 0xE7;
+const std::uint32_t BLOCK_GROUP = 0xA0;
+const std::uint32_t BLOCK = 0xA1;
+const std::uint32_t BLOCK_DURATION = 0x9B;
+const std::uint32_t SIMPLE_BLOCK = 0xA3;
+const std::uint32_t CUES = 0x1C53BB6B;
+const std::uint32_t CUE_POINT = 0xBB;
+const std::uint32_t CUE_TRACK_POSITIONS = 0xB7;
+const std::uint32_t CUE_CLUSTER_POSITION = 0xF1;
+const std::uint32_t ATTACHMENTS = 0x1941A469;
+const std::uint32_t ATTACHED_FILE = 0x61A7;
+const std::uint32_t FILE_NAME = 0x466E;
+const std::uint32_t FILE_MIME_TYPE = 0x4660;
+const std::uint32_t FILE_DATA = 0x465C;
+
+} // namespace id
+
+const std::string ASS_CODEC = "S_TEXT/ASS";
+const std::string SSA_CODEC = "S_TEXT/SSA";
+
+const std::string ASS_EVENT_FORMAT = " Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text";
+const std::string SSA_EVENT_FORMAT = " Marked, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text";
+
+// Elements larger than this are never loaded in memory
+const std::uint64_t MAX_ELEMENT_SIZE = 1ull << 30;
+
+// ContentCompAlgo values
+const int COMPRESSION_ZLIB = 0;
+const int COMPRESSION_HEADER_STRIPPING = 3;
+
+struct Element {
+  std::uint32_t id = 0;
+  std::uint64_t pos = 0;  // Offset of the element header
+  std::uint64_t data = 0; // Offset of the payload
+  std::uint64_t end = 0;  // Offset past the payload (parent end when the size is unknown)
+  bool unknown_size = false;
+
+  std::uint64_t size() const { return end - data; }
+};
+
+struct Track {
+  std::uint64_t number = 0;
+  std::string codec;
+  std::string name;
+  std::string language = "eng";
+  std::string header;    // Decoded CodecPrivate
+  int compression = -1;  // ContentCompAlgo of the frames, -1 if they are stored as is
+  std::string stripped;  // Bytes removed by header stripping
+
+  bool ssa() const { return codec == SSA_CODEC; }
+};
+
+struct Attachment {
+  std::string name;
+  std::string mime_type;
+  Element data;
+};
+
+class File {
+public:
+
+  explicit File(const std::string& path)
+    : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC)), size_(0) {
+    struct stat st;
+    if ((fd_ >= 0) && (::fstat(fd_, &st) == 0)) size_ = static_cast<std::uint64_t>(st.st_size);
+  }
+
+  File(const File&) = delete;
+  File& operator=(const File&) = delete;
+
+  ~File() { if (fd_ >= 0) ::close(fd_); }
+
+  bool is_open() const { return fd_ >= 0; }
+  std::uint64_t size() const { return size_; }
+
+  bool Read(std::uint64_t pos, void* buffer, std::size_t count) const {
+    char* out = static_cast<char*>(buffer);
+    while (count > 0) {
+      ssize_t n = ::pread(fd_, out, count, static_cast<off_t>(pos));
+      if (n <= 0) return false;
+      out += n;
+      pos += static_cast<std::uint64_t>(n);
+      count -= static_cast<std::size_t>(n);
+    }
+    return true;
+  }
+
+private:
+  int fd_;
+  std::uint64_t size_;
+};
+
+namespace detail {
+
+// Length of a variable size integer from its first byte, 0 if invalid
+inline std::size_t vint_length(unsigned char first) {
+  for (std::size_t length = 1; length <= 8; ++length)
+    if (first & (0x80 >> (length - 1))) return length;
+  return 0;
+}
+
+// Decode a variable size integer, marker bit removed. Returns its length or 0
+inline std::size_t read_vint(const unsigned char* data, std::size_t size, std::uint64_t* value, bool* all_ones = nullptr) {
+  if (size == 0) return 0;
+  const std::size_t length = vint_length(data[0]);
+  if ((length == 0) || (length > size)) return 0;
+
+  std::uint64_t v = data[0] & (0xff >> length);
+  bool ones = (v == (0xffu >> length));
+  for (std::size_t i = 1; i < length; ++i) {
+    v = (v << 8) | data[i];
+    ones &= (data[i] == 0xff);
+  }
+  *value = v;
+  if (all_ones) *all_ones = ones;
+  return length;
+}
+
+inline std::uint64_t read_uint(const std::string& data) {
+  std::uint64_t value = 0;
+  for (char ch : data)
+    value = (value << 8) | static_cast<unsigned char>(ch);
+  return value;
+}
+
+inline std::string inflate(const std::string& data) {
+#if defined(ASS_HAVE_ZLIB)
+  z_stream stream = z_stream();
+  if (inflateInit(&stream) != Z_OK)
+    throw ass::io_error("can't initialize zlib");
+
+  std::string out;
+  char buffer[1 << 14];
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = static_cast<uInt>(data.size());
+  int status = Z_OK;
+  while (status == Z_OK) {
+    stream.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream.avail_out = sizeof(buffer);
+    status = ::inflate(&stream, Z_NO_FLUSH);
+    out.append(buffer, sizeof(buffer) - stream.avail_out);
+  }
+  inflateEnd(&stream);
+  if (status != Z_STREAM_END)
+    throw ass::io_error("corrupt zlib compressed track data");
+  return out;
+#else
+  (void)data;
+  throw ass::io_error("zlib compressed tracks aren't supported");
+#endif
+}
+
+inline std::string ticks_to_string(std::int64_t ticks, std::uint64_t scale) {
+  // Nanoseconds to centiseconds, rounded
+  std::int64_t ns = ticks * static_cast<std::int64_t>(scale);
+  if (ns < 0) ns = 0;
+  return ass::format_time(static_cast<ass::time_t>((ns + 5000000) / 10000000));
+}
+
+} // namespace detail
+
+class Reader {
+public:
+
+  explicit Reader(const std::string& path)
+    : file_(path), segment_(), timestamp_scale_(1000000) { }
+
+  // Parse the segment metadata (tracks, attachments and element positions)
+  void Open() {
+    TRACE_SPAN("mkv::Open");
+    if (!file_.is_open())
+      throw ass::io_error("can't open input file");
+
+    Element ebml;
+    if (!ReadElement(0, file_.size(), &ebml) || (ebml.id != id::EBML))
+      throw ass::io_error("input file isn't a Matroska file");
+    for (std::uint64_t pos = ebml.data; pos < ebml.end; ) {
+      Element child;
+      if (!ReadElement(pos, ebml.end, &child)) break;
+      if (child.id == id::DOC_TYPE) {
+        const std::string doc_type = ReadString(child);
+        if ((doc_type != "matroska") && (doc_type != "webm"))
+          throw ass::io_error("unsupported EBML document type");
+      }
+      pos = child.end;
+    }
+
+    if (!ReadElement(ebml.end, file_.size(), &segment_) || (segment_.id != id::SEGMENT))
+      throw ass::io_error("Matroska segment not found");
+
+    FindTopLevel();
+
+    std::map<std::uint32_t, std::uint64_t>::const_iterator it = positions_.find(id::INFO);
+    if (it != positions_.end()) ParseInfo(it->second);
+    it = positions_.find(id::TRACKS);
+    if (it == positions_.end())
+      throw ass::io_error("Matroska tracks not found");
+    ParseTracks(it->second);
+    it = positions_.find(id::ATTACHMENTS);
+    if (it != positions_.end()) ParseAttachments(it->second);
+  }
+
+  // SSA/ASS tracks in file order
+  const std::vector<Track>& tracks() const { return tracks_; }
+
+  const std::vector<Attachment>& attachments() const { return attachments_; }
+
+  // Build the script of a subtitle track
+  void Load(const Track& track, ass::ASSFile& script) {
+    TRACE_SPAN("mkv::Load");
+    {
+      std::istringstream header(track.header);
+      script.load(header);
+    }
+    script.BOM() = true;
+
+    // Event format
+    std::vector<std::string> format;
+    {
+      const std::string* format_line = nullptr;
+      if (script.HasSection(ass::EVENTS)) {
+        for (const std::pair<std::string, std::string>& line : script.Section(ass::EVENTS))
+          if (line.first == "Format") { format_line = &line.second; break; }
+      }
+      if (!format_line) {
+        script.add_line(ass::EVENTS, "Format", track.ssa() ? SSA_EVENT_FORMAT : ASS_EVENT_FORMAT);
+        format_line = &script.Section(ass::EVENTS).back().second;
+      }
+      format = StringSplit(*format_line, ass::FIELD_DELIMITER);
+      for (std::string& field : format) StringTrim(&field);
+    }
+
+    // Blocks by file offset, so those reached twice are kept once
+    std::map<std::uint64_t, Block> blocks;
+    ReadBlocks(track, &blocks);
+
+    std::vector<Event> events;
+    events.reserve(blocks.size());
+    for (std::pair<const std::uint64_t, Block>& entry : blocks)
+      events.push_back(MakeEvent(track, format, &entry.second));
+    std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) {
+      return a.read_order < b.read_order;
+    });
+    for (Event& event : events)
+      script.add_line(ass::EVENTS, ass::DIALOGUE_EVENT, std::move(event.data));
+
+    // Fonts
+    for (const Attachment& attachment : attachments_) {
+      if (!IsFont(attachment)) continue;
+      const std::string data = ReadBinary(attachment.data);
+      script.add_line(ass::FONTS, ass::FONT_LINE,
+                      " " + attachment.name + script.LineBreak() + ass::uuencode(data, script.LineBreak()));
+    }
+  }
+
+private:
+
+  struct Block {
+    std::int64_t time = 0;      // In timestamp ticks
+    std::uint64_t duration = 0; // In timestamp ticks
+    std::string frame;
+  };
+
+  struct Event {
+    std::int64_t read_order;
+    std::string data;
+  };
+
+  /* Element access */
+  bool ReadElement(std::uint64_t pos, std::uint64_t parent_end, Element* element) const {
+    const std::uint64_t limit = std::min(parent_end, file_.size());
+    if (pos >= limit) return false;
+
+    unsigned char header[12];
+    const std::size_t available = static_cast<std::size_t>(std::min<std::uint64_t>(sizeof(header), limit - pos));
+    if ((available < 2) || !file_.Read(pos, header, available)) return false;
+
+    // IDs keep their marker bits
+    const std::size_t id_length = detail::vint_length(header[0]);
+    if ((id_length == 0) || (id_length > 4) || (id_length >= available)) return false;
+    std::uint32_t element_id = 0;
+    for (std::size_t i = 0; i < id_length; ++i)
+      element_id = (element_id << 8) | header[i];
+
+    std::uint64_t size;
+    bool unknown;
+    const std::size_t size_length = detail::read_vint(header + id_length, available - id_length, &size, &unknown);
+    if (size_length == 0) return false;
+
+    element->id = element_id;
+    element->pos = pos;
+    element->data = pos + id_length + size_length;
+    element->unknown_size = unknown;
+    element->end = unknown ? parent_end : std::min(element->data + size, parent_end);
+    return element->data <= element->end;
+  }
+
+  std::string ReadBinary(const Element& element) const {
+    if (element.size() > MAX_ELEMENT_SIZE)
+      throw ass::io_error("Matroska element too large");
+    std::string data(static_cast<std::size_t>(element.size()), '\0');
+    if (!data.empty() && !file_.Read(element.data, &data[0], data.size()))
+      throw ass::io_error("can't read Matroska element");
+    return data;
+  }
+
+  std::string ReadString(const Element& element) const {
+    std::string str = ReadBinary(element);
+    std::string::size_type nul = str.find('\0');
+    if (nul != std::string::npos) str.resize(nul);
+    return str;
+  }
+
+  std::uint64_t ReadUInt(const Element& element) const {
+    if (element.size() > 8)
+      throw ass::io_error("invalid Matroska integer");
+    return detail::read_uint(ReadBinary(element));
+  }
+
+  // Call func(child) for every child of parent
+  template <typename Func>
+  void ForEachChild(const Element& parent, Func&& func) const {
+    for (std::uint64_t pos = parent.data; pos < parent.end; ) {
+      Element child;
+      if (!ReadElement(pos, parent.end, &child)) break;
+      func(child);
+      pos = child.end;
+    }
+  }
+
+  /* Segment metadata */
+  void FindTopLevel() {
+    std::set<std::uint64_t> seek_heads;
+    for (std::uint64_t pos = segment_.data; pos < segment_.end; ) {
+      Element element;
+      if (!ReadElement(pos, segment_.end, &element)) break;
+
+      if (element.id == id::CLUSTER) {
+        first_cluster_ = element.pos;
+        break;
+      }
+      if (element.id == id::SEEK_HEAD) ParseSeekHead(element, &seek_heads);
+      positions_.insert(std::make_pair(element.id, element.pos));
+
+      if (element.unknown_size) break;
+      pos = element.end;
+    }
+  }
+
+  void ParseSeekHead(const Element& seek_head, std::set<std::uint64_t>* visited) {
+    if (!visited->insert(seek_head.pos).second) return;
+
+    std::vector<std::uint64_t> nested;
+    ForEachChild(seek_head, [&](const Element& seek) {
+      if (seek.id != id::SEEK) return;
+      std::uint32_t element_id = 0;
+      std::uint64_t position = 0;
+      bool has_position = false;
+      ForEachChild(seek, [&](const Element& child) {
+        if (child.id == id::SEEK_ID) element_id = static_cast<std::uint32_t>(ReadUInt(child));
+        if (child.id == id::SEEK_POSITION) { position = segment_.data + ReadUInt(child); has_position = true; }
+      });
+      if (!has_position) return;
+      if (element_id == id::SEEK_HEAD) nested.push_back(position);
+      else positions_.insert(std::make_pair(element_id, position));
+    });
+
+    for (std::uint64_t pos : nested) {
+      Element element;
+      if (ReadElement(pos, segment_.end, &element) && (element.id == id::SEEK_HEAD))
+        ParseSeekHead(element, visited);
+    }
+  }
+
+  bool ReadTopLevel(std::uint64_t pos, std::uint32_t expected, Element* element) const {
+    return ReadElement(pos, segment_.end, element) && (element->id == expected);
+  }
+
+  void ParseInfo(std::uint64_t pos) {
+    Element info;
+    if (!ReadTopLevel(pos, id::INFO, &info)) return;
+    ForEachChild(info, [&](const Element& child) {
+      if (child.id == id::TIMESTAMP_SCALE) timestamp_scale_ = ReadUInt(child);
+    });
+    if (timestamp_scale_ == 0) timestamp_scale_ = 1000000;
+  }
+
+  void ParseTracks(std::uint64_t pos) {
+    Element tracks;
+    if (!ReadTopLevel(pos, id::TRACKS, &tracks))
+      throw ass::io_error("Matroska tracks not found");
+
+    ForEachChild(tracks, [&](const Element& entry) {
+      if (entry.id != id::TRACK_ENTRY) return;
+      Track track;
+      int private_compression = -1;
+      ForEachChild(entry, [&](const Element& child) {
+        switch (child.id) {
+          case id::TRACK_NUMBER: track.number = ReadUInt(child); break;
+          case id::CODEC_ID: track.codec = ReadString(child); break;
+          case id::CODEC_PRIVATE: track.header = ReadBinary(child); break;
+          case id::NAME: track.name = ReadString(child); break;
+          case id::LANGUAGE: track.language = ReadString(child); break;
+          case id::CONTENT_ENCODINGS: ParseEncodings(child, &track, &private_compression); break;
+        }
+      });
+      if ((track.codec != ASS_CODEC) && (track.codec != SSA_CODEC)) return;
+
+      if (private_compression == COMPRESSION_ZLIB)
+        track.header = detail::inflate(track.header);
+      else if (private_compression == COMPRESSION_HEADER_STRIPPING)
+        track.header = track.stripped + track.header;
+      tracks_.push_back(track);
+    });
+  }
+
+  void ParseEncodings(const Element& encodings, Track* track, int* private_compression) const {
+    ForEachChild(encodings, [&](const Element& encoding) {
+      if (encoding.id != id::CONTENT_ENCODING) return;
+      std::uint64_t scope = 1, type = 0;
+      int algo = -1;
+      std::string settings;
+      ForEachChild(encoding, [&](const Element& child) {
+        if (child.id == id::CONTENT_ENCODING_SCOPE) scope = ReadUInt(child);
+        if (child.id == id::CONTENT_ENCODING_TYPE) type = ReadUInt(child);
+        if (child.id == id::CONTENT_COMPRESSION) {
+          algo = COMPRESSION_ZLIB;
+          ForEachChild(child, [&](const Element& compression) {
+            if (compression.id == id::CONTENT_COMP_ALGO) algo = static_cast<int>(ReadUInt(compression));
+            if (compression.id == id::CONTENT_COMP_SETTINGS) settings = ReadBinary(compression);
+          });
+        }
+      });
+      if (type != 0)
+        throw ass::io_error("encrypted Matroska tracks aren't supported");
+      if ((algo != -1) && (algo != COMPRESSION_ZLIB) && (algo != COMPRESSION_HEADER_STRIPPING))
+        throw ass::io_error("unsupported Matroska track compression");
+
+      track->stripped = settings;
+      if (scope & 1) track->compression = algo;
+      if (scope & 2) *private_compression = algo;
+    });
+  }
+
+  void ParseAttachments(std::uint64_t pos) {
+    Element attachments;
+    if (!ReadTopLevel(pos, id::ATTACHMENTS, &attachments)) return;
+
+    ForEachChild(attachments, [&](const Element& file) {
+      if (file.id != id::ATTACHED_FILE) return;
+      Attachment attachment;
+      bool has_data = false;
+      ForEachChild(file, [&](const Element& child) {
+        if (child.id == id::FILE_NAME) attachment.name = ReadString(child);
+        if (child.id == id::FILE_MIME_TYPE) attachment.mime_type = ReadString(child);
+        if (child.id == id::FILE_DATA) { attachment.data = child; has_data = true; }
+      });
+      if (has_data) attachments_.push_back(attachment);
+    });
+  }
+
+  static bool IsFont(const Attachment& attachment) {
+    std::string mime_type = attachment.mime_type, name = attachment.name;
+    StringToLower(&mime_type);
+    StringToLower(&name);
+    return StringStartsWith(mime_type, "font/") || StringContains(mime_type, "truetype") ||
+           StringContains(mime_type, "opentype") || StringContains(mime_type, "font-ttf") ||
+           StringContains(mime_type, "font-otf") || StringEndsWith(name, ".ttf") ||
+           StringEndsWith(name, ".otf") || StringEndsWith(name, ".ttc");
+  }
+
+  /* Blocks */
+  void ReadBlocks(const Track& track, std::map<std::uint64_t, Block>* blocks) {
+    TRACE_SPAN("mkv::ReadBlocks");
+    std::set<std::uint64_t> cued;
+    std::map<std::uint32_t, std::uint64_t>::const_iterator it = positions_.find(id::CUES);
+    if (it != positions_.end()) ParseCues(it->second, &cued);
+
+    std::uint64_t pos = first_cluster_ ? first_cluster_ : (cued.empty() ? segment_.data : *cued.begin());
+    while (pos < segment_.end) {
+      Element element;
+      std::uint64_t end = pos;
+      if (ReadElement(pos, segment_.end, &element))
+        end = (element.id == id::CLUSTER) ? ReadCluster(pos, track.number, blocks) : element.end;
+      if (end <= pos) {
+        // Unreadable element, resume at the next cued cluster
+        const std::set<std::uint64_t>::const_iterator next = cued.upper_bound(pos);
+        if (next == cued.end()) break;
+        end = *next;
+      }
+      pos = end;
+    }
+  }
+
+  // Positions of the clusters indexed by the Cues, for any track
+  void ParseCues(std::uint64_t pos, std::set<std::uint64_t>* clusters) const {
+    Element cues;
+    if (!ReadTopLevel(pos, id::CUES, &cues)) return;
+
+    // The whole index is small next to the clusters, read it at once
+    const std::string data = ReadBinary(cues);
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data.data());
+    const std::size_t size = data.size();
+
+    struct Range { std::size_t data, end; std::uint32_t id; };
+    auto next = [&](std::size_t p, std::size_t end, Range* child) -> bool {
+      if (p >= end) return false;
+      const std::size_t id_length = detail::vint_length(bytes[p]);
+      if ((id_length == 0) || (id_length > 4) || (p + id_length >= end)) return false;
+      std::uint32_t element_id = 0;
+      for (std::size_t i = 0; i < id_length; ++i) element_id = (element_id << 8) | bytes[p + i];
+      std::uint64_t length;
+      const std::size_t size_length = detail::read_vint(bytes + p + id_length, end - p - id_length, &length);
+      if (size_length == 0) return false;
+      child->id = element_id;
+      child->data = p + id_length + size_length;
+      if (length > end - child->data) return false;
+      child->end = child->data + static_cast<std::size_t>(length);
+      return true;
+    };
+    auto uint = [&](const Range& range) {
+      return detail::read_uint(data.substr(range.data, range.end - range.data));
+    };
+
+    Range point;
+    for (std::size_t p = 0; next(p, size, &point); p = point.end) {
+      if (point.id != id::CUE_POINT) continue;
+      Range positions;
+      for (std::size_t q = point.data; next(q, point.end, &positions); q = positions.end) {
+        if (positions.id != id::CUE_TRACK_POSITIONS) continue;
+        Range child;
+        for (std::size_t r = positions.data; next(r, positions.end, &child); r = child.end)
+          if (child.id == id::CUE_CLUSTER_POSITION) clusters->insert(segment_.data + uint(child));
+      }
+    }
+  }
+
+  // Read the track blocks of the cluster at pos. Returns the end of the
+  // cluster
+  std::uint64_t ReadCluster(std::uint64_t pos, std::uint64_t track, std::map<std::uint64_t, Block>* blocks) const {
+    Element cluster;
+    if (!ReadTopLevel(pos, id::CLUSTER, &cluster)) return pos;
+
+    // The timestamp comes first in practice, stop at the first block
+    std::uint64_t timestamp = 0;
+    for (std::uint64_t p = cluster.data; p < cluster.end; ) {
+      Element child;
+      if (!ReadElement(p, cluster.end, &child)) break;
+      if (child.id == id::CLUSTER_TIMESTAMP) { timestamp = ReadUInt(child); break; }
+      if ((child.id == id::SIMPLE_BLOCK) || (child.id == id::BLOCK_GROUP)) break;
+      p = child.end;
+    }
+
+    for (std::uint64_t p = cluster.data; p < cluster.end; ) {
+      Element child;
+      if (!ReadElement(p, cluster.end, &child)) break;
+      // A cluster of unknown size ends where the next top level element starts
+      if (cluster.unknown_size && (child.id == id::CLUSTER || child.id == id::CUES || child.id == id::ATTACHMENTS ||
+                                   child.id == id::SEEK_HEAD || child.id == id::TRACKS || child.id == id::INFO))
+        return p;
+      ReadBlock(child, track, timestamp, blocks);
+      p = child.end;
+    }
+    return cluster.end;
+  }
+
+  void ReadBlock(const Element& element, std::uint64_t track, std::uint64_t cluster_timestamp, std::map<std::uint64_t, Block>* blocks) const {
+    Element block;
+    std::uint64_t duration = 0;
+    if (element.id == id::SIMPLE_BLOCK) {
+      block = element;
+    } else if (element.id == id::BLOCK_GROUP) {
+      bool found = false;
+      for (std::uint64_t p = element.data; p < element.end; ) {
+        Element child;
+        if (!ReadElement(p, element.end, &child)) break;
+        if (child.id == id::BLOCK) {
+          // Skip the group early when the block belongs to another track
+          if (BlockTrack(child) != track) return;
+          block = child;
+          found = true;
+        } else if (child.id == id::BLOCK_DURATION) {
+          duration = ReadUInt(child);
+        }
+        p = child.end;
+      }
+      if (!found) return;
+    } else {
+      return;
+    }
+
+    // Block header: track number, 16-bit relative timestamp and flags
+    unsigned char header[11];
+    const std::size_t available = static_cast<std::size_t>(std::min<std::uint64_t>(sizeof(header), block.size()));
+    if (!file_.Read(block.data, header, available)) return;
+    std::uint64_t number;
+    const std::size_t length = detail::read_vint(header, available, &number);
+    if ((length == 0) || (number != track) || (length + 3 > available)) return;
+    if (header[length + 2] & 0x06) return; // Laced frames aren't used by text tracks
+
+    const std::int16_t relative = static_cast<std::int16_t>((header[length] << 8) | header[length + 1]);
+    Block& out = (*blocks)[block.pos];
+    out.time = static_cast<std::int64_t>(cluster_timestamp) + relative;
+    out.duration = duration;
+
+    Element frame = block;
+    frame.data += length + 3;
+    out.frame = ReadBinary(frame);
+  }
+
+  // Track number of a block, reading only its first bytes
+  std::uint64_t BlockTrack(const Element& block) const {
+    unsigned char header[8];
+    const std::size_t available = static_cast<std::size_t>(std::min<std::uint64_t>(sizeof(header), block.size()));
+    std::uint64_t number = 0;
+    if (!file_.Read(block.data, header, available) || !detail::read_vint(header, available, &number)) return 0;
+    return number;
+  }
+
+  /* Events */
+  Event MakeEvent(const Track& track, const std::vector<std::string>& format, Block* block) const {
+    if (track.compression == COMPRESSION_ZLIB) block->frame = detail::inflate(block->frame);
+    else if (track.compression == COMPRESSION_HEADER_STRIPPING) block->frame = track.stripped + block->frame;
+
+    // ReadOrder, Layer (Marked for SSA), Style, Name, MarginL, MarginR, MarginV, Effect, Text
+    std::vector<std::string> fields;
+    std::string::size_type begin = 0;
+    while (fields.size() < 8) {
+      std::string::size_type comma = block->frame.find(',', begin);
+      if (comma == std::string::npos) break;
+      fields.push_back(block->frame.substr(begin, comma - begin));
+      begin = comma + 1;
+    }
+    fields.resize(8);
+    std::string text = block->frame.substr(std::min(begin, block->frame.size()));
+    while (!text.empty() && ((text.back() == '\n') || (text.back() == '\r') || (text.back() == '\0'))) text.pop_back();
+
+    Event event;
+    char* end;
+    event.read_order = std::strtoll(fields[0].c_str(), &end, 10);
+    if (end == fields[0].c_str()) event.read_order = block->time;
+
+    for (std::size_t i = 0; i < format.size(); ++i) {
+      const std::string& name = format[i];
+      event.data += (i == 0) ? " " : ass::FIELD_DELIMITER;
+      if ((name == "Layer") || (name == "Marked")) event.data += fields[1];
+      else if (name == "Start") event.data += detail::ticks_to_string(block->time, timestamp_scale_);
+      else if (name == "End") event.data += detail::ticks_to_string(block->time + static_cast<std::int64_t>(block->duration), timestamp_scale_);
+      else if (name == "Style") event.data += fields[2];
+      else if (name == "Name") event.data += fields[3];
+      else if (name == "MarginL") event.data += fields[4];
+      else if (name == "MarginR") event.data += fields[5];
+      else if (name == "MarginV") event.data += fields[6];
+      else if (name == "Effect") event.data += fields[7];
+      else if (name == "Text") event.data += text;
+    }
+    return event;
+  }
+
+  File file_;
+  Element segment_;
+  std::uint64_t first_cluster_ = 0;
+  std::uint64_t timestamp_scale_;
+  std::map<std::uint32_t, std::uint64_t> positions_;
+  std::vector<Track> tracks_;
+  std::vector<Attachment> attachments_;
+};
+
+// Whether path starts with an EBML header
+inline bool is_matroska(const std::string& path) {
+  File file(path);
+  unsigned char magic[4];
+  return file.is_open() && (file.size() >= sizeof(magic)) && file.Read(0, magic, sizeof(magic)) &&
+         (magic[0] == 0x1a) && (magic[1] == 0x45) && (magic[2] == 0xdf) && (magic[3] == 0xa3);
+}
+
+// Load the track-th SSA/ASS track of a Matroska file
+inline void load(const std::string& path, ass::ASSFile& script, std::size_t track = 0) {
+  Reader reader(path);
+  reader.Open();
+  if (track >= reader.tracks().size())
+    throw ass::io_error("no SSA/ASS subtitle track found");
+  reader.Load(reader.tracks()[track], script);
+}
+
+// Load a script from input, or from the first SSA/ASS track when path is a
+// Matroska file. Malformed script lines are reported in result, when given
+// (see ASSFile::load).
+inline void load_script(const std::string& path, std::istream& input, ass::ASSFile& script, ass::ParseResult* result = nullptr) {
+  if (is_matroska(path)) load(path, script);
+  else script.load(input, result);
+}
+
+// Encoding of the script read from input (Matroska tracks are UTF-8)
+inline ass::Encoding script_encoding(const std::string& path, ass::ifstream& input) {
+  if (is_matroska(path)) return ass::Encoding::UTF8;
+  input.peek();
+  return input.encoding();
+}
+
+} // namespace mkv
+
+#endif // MKV_HPP_
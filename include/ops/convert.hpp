@@ -0,0 +1,671 @@
+// Convert subtitles between ASS, SRT and WebVTT
+// Copyright (c) 2019 Slek
+//
+// SRT and WebVTT are read and written one cue at a time, so converting
+// between them (or from them to ASS) runs in constant memory. ASS is the
+// pivot for the text: cue markup (<i>, <b>, <font color>, ...) is mapped to
+// override tags and back. Going to SRT/WebVTT, style attributes (bold,
+// italic, underline, strike out and alignment) are resolved from the
+// [V4+ Styles] section and \r resets; tags without an equivalent are
+// stripped and drawings are dropped.
+
+#ifndef OPS_CONVERT_HPP_
+#define OPS_CONVERT_HPP_
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <list>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "encoding.hpp"
+#include "schema.hpp"
+#include "tags.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+enum class SubtitleFormat {
+  ASS,
+  SRT,
+  VTT
+};
+
+// Subtitle format of a file name (by extension, compression suffix ignored)
+inline bool subtitle_format_for_path(const std::string& path, SubtitleFormat* format) {
+  std::string name = path;
+  StringToLower(&name);
+  for (const char* suffix : {".gz", ".zst", ".zstd"})
+    if (StringEndsWith(name, suffix)) { name.resize(name.size() - std::strlen(suffix)); break; }
+
+  if (StringEndsWith(name, ".ass") || StringEndsWith(name, ".ssa") || StringEndsWith(name, ".mkv") ||
+      StringEndsWith(name, ".mks")) *format = SubtitleFormat::ASS;
+  else if (StringEndsWith(name, ".srt")) *format = SubtitleFormat::SRT;
+  else if (StringEndsWith(name, ".vtt")) *format = SubtitleFormat::VTT;
+  else return false;
+  return true;
+}
+
+inline const char* subtitle_format_extension(SubtitleFormat format) {
+  switch (format) {
+    case SubtitleFormat::ASS: return ".ass";
+    case SubtitleFormat::SRT: return ".srt";
+    case SubtitleFormat::VTT: return ".vtt";
+  }
+  return "";
+}
+
+// SRT/WebVTT cue, times in milliseconds
+struct Cue {
+  std::uint64_t start = 0;
+  std::uint64_t end = 0;
+  std::string settings; // WebVTT cue settings
+  std::string text;     // Markup, lines separated by '\n'
+};
+
+namespace detail {
+
+constexpr char DEFAULT_STYLE_FORMAT[] = " Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, OutlineColour, BackColour, Bold, Italic, Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, BorderStyle, Outline, Shadow, Alignment, MarginL, MarginR, MarginV, Encoding";
+constexpr char DEFAULT_STYLE[] = " Default,Arial,16,&H00FFFFFF,&H000000FF,&H00000000,&H00000000,0,0,0,0,100,100,0,0,1,1,0,2,10,10,10,1";
+constexpr char DEFAULT_EVENT_FORMAT[] = " Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text";
+
+inline bool parse_digits(const char*& it, const char* end, std::uint64_t* value, std::size_t* digits) {
+  *value = 0;
+  *digits = 0;
+  while ((it < end) && (*it >= '0') && (*it <= '9')) {
+    *value = *value * 10 + static_cast<std::uint64_t>(*it - '0');
+    ++it;
+    ++*digits;
+  }
+  return *digits > 0;
+}
+
+// [HH:]MM:SS[,.]mmm, returns the position past the timestamp or nullptr
+inline const char* parse_cue_time(const char* it, const char* end, std::uint64_t* ms) {
+  std::uint64_t parts[3];
+  std::size_t count = 0, digits;
+  for (;;) {
+    if ((count == 3) || !parse_digits(it, end, &parts[count], &digits)) return nullptr;
+    count++;
+    if ((it < end) && (*it == ':')) { ++it; continue; }
+    break;
+  }
+  if ((count < 2) || (it == end) || ((*it != ',') && (*it != '.'))) return nullptr;
+  ++it;
+
+  std::uint64_t fraction;
+  if (!parse_digits(it, end, &fraction, &digits)) return nullptr;
+  for (; digits < 3; ++digits) fraction *= 10;
+  for (; digits > 3; --digits) fraction /= 10;
+
+  const std::uint64_t hours = (count == 3) ? parts[0] : 0;
+  const std::uint64_t minutes = parts[count - 2], seconds = parts[count - 1];
+  *ms = ((hours * 60 + minutes) * 60 + seconds) * 1000 + fraction;
+  return it;
+}
+
+inline void append_cue_time(std::uint64_t ms, char separator, std::string* out) {
+  *out += StringPrintf("%02llu:%02llu:%02llu%c%03llu", static_cast<unsigned long long>(ms / 3600000),
+                       static_cast<unsigned long long>((ms / 60000) % 60), static_cast<unsigned long long>((ms / 1000) % 60),
+                       separator, static_cast<unsigned long long>(ms % 1000));
+}
+
+// Text attributes with a markup equivalent
+struct TextState {
+  bool bold = false;
+  bool italic = false;
+  bool underline = false;
+  bool strikeout = false;
+  std::string color;  // "#rrggbb", SRT only
+  int alignment = 2;  // Numpad layout (\an)
+};
+
+inline bool style_flag(const std::string& value) {
+  return !value.empty() && (value != "0");
+}
+
+// &HBBGGRR& (or &HAABBGGRR&) to #rrggbb, empty when invalid
+inline std::string html_color(const TextSpan& value) {
+  const char* it = value.begin();
+  const char* end = value.end();
+  while ((it < end) && ((*it == '&') || (*it == 'H') || (*it == 'h'))) ++it;
+  char* parsed;
+  std::string hex(it, end);
+  const unsigned long bgr = std::strtoul(hex.c_str(), &parsed, 16);
+  if (parsed == hex.c_str()) return std::string();
+  return StringPrintf("#%02lx%02lx%02lx", bgr & 0xff, (bgr >> 8) & 0xff, (bgr >> 16) & 0xff);
+}
+
+// Markup writer keeping the open tags properly nested
+class MarkupBuilder {
+public:
+
+  MarkupBuilder(SubtitleFormat format, std::string* out)
+    : format_(format), out_(out) { }
+
+  void Text(const char* begin, const char* end, const TextState& state) {
+    Sync(state);
+    for (const char* it = begin; it < end; ++it) {
+      if ((*it == '\\') && (it + 1 < end)) {
+        if (it[1] == 'N') { out_->push_back('\n'); ++it; continue; }
+        if (it[1] == 'n') { out_->push_back(' '); ++it; continue; }
+        if (it[1] == 'h') { out_->append("\xc2\xa0"); ++it; continue; }
+      }
+      if (format_ == SubtitleFormat::VTT) {
+        if (*it == '&') { out_->append("&amp;"); continue; }
+        if (*it == '<') { out_->append("&lt;"); continue; }
+        if (*it == '>') { out_->append("&gt;"); continue; }
+      }
+      out_->push_back(*it);
+    }
+  }
+
+  void Finish() {
+    while (!open_.empty()) Close();
+  }
+
+private:
+
+  // Close tags down to the first unwanted one, then open the missing ones
+  void Sync(const TextState& state) {
+    std::size_t keep = 0;
+    while ((keep < open_.size()) && Wanted(open_[keep], state)) ++keep;
+    while (open_.size() > keep) Close();
+
+    if (state.bold && !IsOpen("b")) Open("b", "<b>");
+    if (state.italic && !IsOpen("i")) Open("i", "<i>");
+    if (state.underline && !IsOpen("u")) Open("u", "<u>");
+    if (state.strikeout && (format_ == SubtitleFormat::SRT) && !IsOpen("s")) Open("s", "<s>");
+    if (!state.color.empty() && (format_ == SubtitleFormat::SRT) && !IsOpen("font")) {
+      Open("font", "<font color=\"" + state.color + "\">");
+      color_ = state.color;
+    }
+  }
+
+  bool Wanted(const std::string& tag, const TextState& state) const {
+    if (tag == "b") return state.bold;
+    if (tag == "i") return state.italic;
+    if (tag == "u") return state.underline;
+    if (tag == "s") return state.strikeout;
+    return state.color == color_;
+  }
+
+  bool IsOpen(const char* tag) const {
+    return std::find(open_.begin(), open_.end(), tag) != open_.end();
+  }
+
+  void Open(const char* tag, const std::string& markup) {
+    open_.push_back(tag);
+    out_->append(markup);
+  }
+
+  void Close() {
+    out_->append("</" + open_.back() + ">");
+    open_.pop_back();
+  }
+
+  SubtitleFormat format_;
+  std::string* out_;
+  std::vector<std::string> open_;
+  std::string color_;
+};
+
+// Whether the text between '<' and '>' is cue markup: a tag that is converted
+// or dropped on purpose, or a WebVTT timestamp. Anything else is plain text.
+inline bool is_markup_tag(const std::string& tag, const std::string& tag_name, SubtitleFormat format) {
+  static const char* const TAGS[] = {"b", "i", "u", "s", "font", "v", "c", "lang", "ruby", "rt"};
+  if (!tag_name.empty() && std::isalpha(static_cast<unsigned char>(tag[(tag[0] == '/') ? 1 : 0]))) {
+    for (const char* name : TAGS)
+      if (tag_name == name) return true;
+    return false;
+  }
+  return (format == SubtitleFormat::VTT) && !tag.empty() && std::isdigit(static_cast<unsigned char>(tag[0])) &&
+         (tag.find_first_not_of("0123456789:.") == std::string::npos);
+}
+
+} // namespace detail
+
+// Styles of a script, by name
+inline std::unordered_map<std::string, detail::TextState> style_states(const ass::ASSFile& ass) {
+  std::unordered_map<std::string, detail::TextState> styles;
+  if (!ass.HasSection(ass::STYLES)) return styles;
+
+  std::vector<std::string> format;
+  for (const std::pair<std::string, std::string>& line : ass.Section(ass::STYLES)) {
+    if (line.first == "Format") {
+      format = StringSplit(line.second, ass::FIELD_DELIMITER);
+      for (std::string& field : format) StringTrim(&field);
+      continue;
+    }
+    if (line.first != "Style") continue;
+
+    std::vector<std::string> values = StringSplit(line.second, ass::FIELD_DELIMITER);
+    detail::TextState state;
+    std::string name;
+    for (std::size_t i = 0; (i < format.size()) && (i < values.size()); ++i) {
+      std::string value = values[i];
+      StringTrim(&value);
+      if (format[i] == "Name") name = value;
+      else if (format[i] == "Bold") state.bold = detail::style_flag(value);
+      else if (format[i] == "Italic") state.italic = detail::style_flag(value);
+      else if (format[i] == "Underline") state.underline = detail::style_flag(value);
+      else if (format[i] == "StrikeOut") state.strikeout = detail::style_flag(value);
+      else if (format[i] == "Alignment") state.alignment = std::atoi(value.c_str());
+    }
+    if ((state.alignment < 1) || (state.alignment > 9)) state.alignment = 2;
+    styles[name] = state;
+  }
+  return styles;
+}
+
+// Markup of an ASS Text field rendered with style, returns the alignment
+inline int ass_text_to_markup(const TextSpan& text, const detail::TextState& style,
+                              const std::unordered_map<std::string, detail::TextState>& styles,
+                              SubtitleFormat format, std::string* out) {
+  out->clear();
+  detail::TextState state = style;
+  detail::MarkupBuilder builder(format, out);
+  bool drawing = false;
+
+  TagTokenizer tokenizer(text);
+  TextToken token;
+  while (tokenizer.next(&token)) {
+    if (token.type == TokenType::TEXT) {
+      if (!drawing) builder.Text(token.text.begin(), token.text.end(), state);
+      continue;
+    }
+    if (token.type != TokenType::TAG) continue;
+
+    const TextSpan& name = token.name;
+    std::string args = token.args.str();
+    StringTrim(&args);
+    if (name.equals("b")) state.bold = args.empty() ? style.bold : ((args == "1") || (std::atoi(args.c_str()) >= 700));
+    else if (name.equals("i")) state.italic = args.empty() ? style.italic : (args == "1");
+    else if (name.equals("u")) state.underline = args.empty() ? style.underline : (args == "1");
+    else if (name.equals("s")) state.strikeout = args.empty() ? style.strikeout : (args == "1");
+    else if (name.equals("c") || name.equals("1c")) state.color = args.empty() ? style.color : detail::html_color(token.args);
+    else if (name.equals("an")) { int an = std::atoi(args.c_str()); if ((an >= 1) && (an <= 9)) state.alignment = an; }
+    else if (name.equals("a")) {
+      // Legacy SSA alignment: 1-3 bottom, 5-7 top, 9-11 middle
+      int a = std::atoi(args.c_str());
+      if ((a >= 1) && (a <= 11)) state.alignment = (a & 3) + ((a & 4) ? 6 : ((a & 8) ? 3 : 0));
+    }
+    else if (name.equals("p")) drawing = (std::atoi(args.c_str()) > 0);
+    else if (name.equals("r")) {
+      const int alignment = state.alignment;
+      std::unordered_map<std::string, detail::TextState>::const_iterator it = styles.find(args);
+      state = (args.empty() || (it == styles.end())) ? style : it->second;
+      state.alignment = alignment;
+    }
+  }
+
+  builder.Finish();
+  return state.alignment;
+}
+
+// ASS Text field from cue markup. Sets name from a WebVTT voice span
+inline void markup_to_ass_text(const std::string& markup, SubtitleFormat format, std::string* out, std::string* name = nullptr) {
+  out->clear();
+  const char* it = markup.data();
+  const char* end = it + markup.size();
+  while (it < end) {
+    const char ch = *it;
+    if (ch == '\r') { ++it; continue; }
+    if (ch == '\n') { out->append("\\N"); ++it; continue; }
+
+    // A '<' that doesn't open known markup is kept as text
+    const char* close = (ch == '<') ? std::find(it + 1, end, '>') : end;
+    std::string tag, tag_name;
+    if ((close != end) && (std::find(it + 1, close, '<') == close)) {
+      tag.assign(it + 1, close);
+      const std::size_t name_begin = (!tag.empty() && (tag[0] == '/')) ? 1 : 0;
+      tag_name = tag.substr(name_begin, tag.find_first_of(" \t.=", name_begin) - name_begin);
+      StringToLower(&tag_name);
+    }
+
+    if ((close != end) && detail::is_markup_tag(tag, tag_name, format)) {
+      it = close + 1;
+
+      const bool closing = (tag[0] == '/');
+      if (closing) tag.erase(0, 1);
+
+      if ((tag_name == "b") || (tag_name == "i") || (tag_name == "u") || (tag_name == "s")) {
+        out->append("{\\" + tag_name + (closing ? "0}" : "1}"));
+      } else if (tag_name == "font") {
+        if (closing) { out->append("{\\c}"); continue; }
+        std::string::size_type pos = tag.find("color");
+        if (pos == std::string::npos) continue;
+        pos = tag.find('#', pos);
+        if ((pos == std::string::npos) || (pos + 7 > tag.size())) continue;
+        const unsigned long rgb = std::strtoul(tag.substr(pos + 1, 6).c_str(), nullptr, 16);
+        out->append(StringPrintf("{\\c&H%02lX%02lX%02lX&}", rgb & 0xff, (rgb >> 8) & 0xff, (rgb >> 16) & 0xff));
+      } else if ((tag_name == "v") && !closing && name && name->empty()) {
+        *name = tag.size() > 2 ? tag.substr(2) : std::string();
+        StringTrim(name);
+      }
+      // Other tags (classes, voices, ruby, timestamps) have no ASS equivalent
+      continue;
+    }
+
+    if ((ch == '&') && (format == SubtitleFormat::VTT)) {
+      const char* limit = it + std::min<std::ptrdiff_t>(10, end - it);
+      const char* semicolon = std::find(it, limit, ';');
+      if ((semicolon != limit) && (*semicolon == ';')) {
+        const std::string entity(it + 1, semicolon);
+        const char* replacement = nullptr;
+        if (entity == "amp") replacement = "&";
+        else if (entity == "lt") replacement = "<";
+        else if (entity == "gt") replacement = ">";
+        else if (entity == "nbsp") replacement = "\\h";
+        else if (entity == "lrm") replacement = "\xe2\x80\x8e";
+        else if (entity == "rlm") replacement = "\xe2\x80\x8f";
+        else if ((entity.size() > 1) && (entity[0] == '#')) {
+          const bool hex = (entity[1] == 'x') || (entity[1] == 'X');
+          detail::append_utf8(static_cast<std::uint32_t>(std::strtoul(entity.c_str() + (hex ? 2 : 1), nullptr, hex ? 16 : 10)), out);
+          it = semicolon + 1;
+          continue;
+        }
+        if (replacement) {
+          out->append(replacement);
+          it = semicolon + 1;
+          continue;
+        }
+      }
+    }
+
+    out->push_back(ch);
+    ++it;
+  }
+}
+
+// Alignment from WebVTT cue settings (line and align)
+inline int vtt_alignment(const std::string& settings) {
+  int row = 0, column = 2; // Bottom center
+  for (const std::string& setting : StringSplit(settings, " ")) {
+    if (StringStartsWith(setting, "line:")) {
+      const std::string value = setting.substr(5, setting.find(',') - 5);
+      const double number = std::atof(value.c_str());
+      if (StringEndsWith(value, "%")) row = (number < 33.) ? 6 : ((number < 66.) ? 3 : 0);
+      else row = (number >= 0.) ? ((number < 3.) ? 6 : 0) : 0;
+    } else if (StringStartsWith(setting, "align:")) {
+      const std::string value = setting.substr(6);
+      if ((value == "left") || (value == "start")) column = 1;
+      else if ((value == "right") || (value == "end")) column = 3;
+    }
+  }
+  return row + column;
+}
+
+inline std::string vtt_settings(int alignment) {
+  std::string settings;
+  if (alignment >= 7) settings = "line:0";
+  else if (alignment >= 4) settings = "line:50%";
+  const int column = (alignment - 1) % 3;
+  if (column != 1) settings += std::string(settings.empty() ? "" : " ") + ((column == 0) ? "align:left" : "align:right");
+  return settings;
+}
+
+// Streaming SRT/WebVTT reader
+class CueReader {
+public:
+
+  CueReader(std::istream& input, SubtitleFormat format)
+    : input_(input), format_(format), line_number_(0) {
+    if (!input_)
+      throw io_error("can't read input file");
+
+    if (format_ == SubtitleFormat::VTT) {
+      std::string line;
+      if (!ReadLine(&line) || !StringStartsWith(line, "WEBVTT"))
+        throw io_error("input file isn't a valid WebVTT file");
+      // Header lines up to the first blank line
+      while (ReadLine(&line) && !line.empty()) { }
+    }
+  }
+
+  bool Next(Cue* cue) {
+    std::string line, previous;
+    for (;;) {
+      if (!ReadLine(&line)) return false;
+      if (line.find("-->") != std::string::npos) break;
+      // WebVTT NOTE, STYLE and REGION blocks are skipped whole
+      if ((format_ == SubtitleFormat::VTT) &&
+          (StringStartsWith(line, "NOTE") || StringStartsWith(line, "STYLE") || StringStartsWith(line, "REGION"))) {
+        while (ReadLine(&line) && !line.empty()) { }
+      }
+      previous = line;
+    }
+
+    const char* it = line.data();
+    const char* end = it + line.size();
+    while ((it < end) && IsWhiteSpace(*it)) ++it;
+    it = detail::parse_cue_time(it, end, &cue->start);
+    if (it) {
+      while ((it < end) && IsWhiteSpace(*it)) ++it;
+      it = ((end - it >= 3) && (std::string(it, it + 3) == "-->")) ? it + 3 : nullptr;
+    }
+    if (it) {
+      while ((it < end) && IsWhiteSpace(*it)) ++it;
+      it = detail::parse_cue_time(it, end, &cue->end);
+    }
+    if (!it)
+      throw io_error(StringPrintf("invalid cue timing at line %zu", line_number_).c_str());
+
+    cue->settings.assign(it, end);
+    StringTrim(&cue->settings);
+
+    cue->text.clear();
+    while (ReadLine(&line) && !line.empty()) {
+      if (!cue->text.empty()) cue->text.push_back('\n');
+      cue->text += line;
+    }
+    return true;
+  }
+
+private:
+
+  bool ReadLine(std::string* line) {
+    if (!std::getline(input_, *line)) return false;
+    if (line_number_++ == 0 && StringStartsWith(*line, ass::BOM)) line->erase(0, ass::length(ass::BOM));
+    if (!line->empty() && (line->back() == '\r')) line->pop_back();
+    return true;
+  }
+
+  std::istream& input_;
+  SubtitleFormat format_;
+  std::size_t line_number_;
+};
+
+// Streaming SRT/WebVTT writer
+class CueWriter {
+public:
+
+  // WebVTT header_lines, each ending with a line break, follow the WEBVTT line
+  CueWriter(std::ostream& output, SubtitleFormat format, const std::string& header_lines = std::string())
+    : output_(output), format_(format), count_(0) {
+    if (format_ == SubtitleFormat::VTT) output_ << "WEBVTT\n" << header_lines << "\n";
+  }
+
+  void Write(const Cue& cue) {
+    if (cue.text.empty()) return;
+
+    buffer_.clear();
+    const char separator = (format_ == SubtitleFormat::SRT) ? ',' : '.';
+    if (format_ == SubtitleFormat::SRT) buffer_ += StringPrintf("%zu\n", ++count_);
+    detail::append_cue_time(cue.start, separator, &buffer_);
+    buffer_ += " --> ";
+    detail::append_cue_time(std::max(cue.start, cue.end), separator, &buffer_);
+    if ((format_ == SubtitleFormat::VTT) && !cue.settings.empty()) buffer_ += " " + cue.settings;
+    buffer_ += "\n";
+    buffer_ += cue.text;
+    buffer_ += "\n\n";
+    output_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+  }
+
+private:
+  std::ostream& output_;
+  SubtitleFormat format_;
+  std::size_t count_;
+  std::string buffer_;
+};
+
+// Script header used for SRT/WebVTT input
+inline ASSFile cue_script_header() {
+  ASSFile header;
+  header.add_line(ass::SCRIPT_INFO, "ScriptType", " v4.00+");
+  header.add_line(ass::SCRIPT_INFO, "PlayResX", " 384");
+  header.add_line(ass::SCRIPT_INFO, "PlayResY", " 288");
+  header.add_line(ass::SCRIPT_INFO, "ScaledBorderAndShadow", " yes");
+  header.add_line(ass::STYLES, "Format", detail::DEFAULT_STYLE_FORMAT);
+  header.add_line(ass::STYLES, "Style", detail::DEFAULT_STYLE);
+  header.add_line(ass::EVENTS, "Format", detail::DEFAULT_EVENT_FORMAT);
+  return header;
+}
+
+// Converts the dialogue events of a script into cues, with its styles. The
+// script needs the Format line of its [Events] section.
+class CueConverter {
+public:
+
+  CueConverter(const ASSFile& ass, SubtitleFormat format)
+    : styles_(style_states(ass)), schema_(EventsFormat(ass)), format_(format) {
+    if (!schema_.has(EventField::START) || !schema_.has(EventField::END) || !schema_.has(EventField::STYLE))
+      throw ass::io_error("'Start', 'End' and 'Style' fields are required");
+    if (!schema_.text_last())
+      throw ass::io_error("'Text' field must appear in last place");
+  }
+
+  // Cue of an event line, false when it isn't a dialogue event
+  bool Convert(const std::pair<std::string, std::string>& line, Cue* cue) {
+    if (line.first != ass::DIALOGUE_EVENT) return false;
+    const std::string& data = line.second;
+    schema_.split(data, &fields_);
+
+    const FieldRange& start = fields_[EventField::START];
+    if (!start.found()) throw ass::io_error("'Start' field cannot be retrieved");
+    cue->start = ass::parse_time(data.data() + start.begin, data.data() + start.end) * 10ull;
+    const FieldRange& end = fields_[EventField::END];
+    if (!end.found()) throw ass::io_error("'End' field cannot be retrieved");
+    cue->end = ass::parse_time(data.data() + end.begin, data.data() + end.end) * 10ull;
+    style_name_.clear();
+    const FieldRange& style_field = fields_[EventField::STYLE];
+    if (style_field.found()) style_name_.assign(data, style_field.begin, style_field.end - style_field.begin);
+    StringTrim(&style_name_);
+    if (!style_name_.empty() && (style_name_[0] == '*')) style_name_.erase(0, 1);
+
+    const FieldRange& text_field = fields_[EventField::TEXT];
+    if (!text_field.found()) throw ass::io_error("'Text' field cannot be retrieved");
+    const TextSpan text(data.data() + text_field.begin, data.data() + text_field.end);
+
+    std::unordered_map<std::string, detail::TextState>::const_iterator style = styles_.find(style_name_);
+    const int alignment = ass_text_to_markup(text, (style != styles_.end()) ? style->second : detail::TextState(),
+                                             styles_, format_, &cue->text);
+    cue->settings.clear();
+    if (format_ == SubtitleFormat::VTT) cue->settings = vtt_settings(alignment);
+    else if (alignment != 2) cue->text = StringPrintf("{\\an%d}", alignment) + cue->text;
+    return true;
+  }
+
+private:
+
+  static const std::string& EventsFormat(const ASSFile& ass) {
+    if (!ass.HasSection(ass::EVENTS) || (ass.Section(ass::EVENTS).front().first != "Format"))
+      throw ass::io_error("first line of 'Events' section must be 'Format'");
+    return ass.Section(ass::EVENTS).front().second;
+  }
+
+  const std::unordered_map<std::string, detail::TextState> styles_;
+  const EventSchema schema_;
+  const SubtitleFormat format_;
+
+  EventFields fields_;
+  std::string style_name_;
+};
+
+// Cues in start time order, ties in input order
+inline void sort_cues(std::vector<std::pair<Cue, std::size_t>>* cues) {
+  std::sort(cues->begin(), cues->end(), [](const std::pair<Cue, std::size_t>& a, const std::pair<Cue, std::size_t>& b) {
+    return (a.first.start != b.first.start) ? (a.first.start < b.first.start) : (a.second < b.second);
+  });
+}
+
+// Write the dialogue events of a script as cues, ordered by start time
+inline void ass_to_cues(const ASSFile& ass, CueWriter& writer, SubtitleFormat format) {
+  TRACE_SPAN("ass_to_cues");
+  if (!ass.HasSection(ass::EVENTS)) return;
+
+  CueConverter converter(ass, format);
+  std::vector<std::pair<Cue, std::size_t>> cues;
+  Cue cue;
+  for (const std::pair<std::string, std::string>& line : ass.Section(ass::EVENTS)) {
+    if (converter.Convert(line, &cue))
+      cues.push_back(std::make_pair(std::move(cue), cues.size()));
+  }
+
+  sort_cues(&cues);
+  for (const std::pair<Cue, std::size_t>& cue : cues)
+    writer.Write(cue.first);
+}
+
+// Stream cues as the dialogue events of a script with the given header
+inline void cues_to_ass(CueReader& reader, SubtitleFormat format, const ASSFile& header, std::ostream& output) {
+  TRACE_SPAN("cues_to_ass");
+  output << header;
+
+  const std::string& line_break = header.LineBreak();
+  Cue cue;
+  std::string text, name, line;
+  while (reader.Next(&cue)) {
+    name.clear();
+    markup_to_ass_text(cue.text, format, &text, &name);
+    // A comma would end the Name field early and shift the rest of the event
+    std::replace(name.begin(), name.end(), ',', ';');
+    const int alignment = (format == SubtitleFormat::VTT) ? vtt_alignment(cue.settings) : 2;
+    if (alignment != 2) text = StringPrintf("{\\an%d}", alignment) + text;
+
+    line = std::string(ass::DIALOGUE_EVENT) + ": 0," + ass::format_time(static_cast<ass::time_t>((cue.start + 5) / 10)) + "," +
+           ass::format_time(static_cast<ass::time_t>((cue.end + 5) / 10)) + ",Default," + name + ",0,0,0,," + text + line_break;
+    output.write(line.data(), static_cast<std::streamsize>(line.size()));
+  }
+}
+
+// Stream cues from one SRT/WebVTT format to another
+inline void cues_to_cues(CueReader& reader, SubtitleFormat from, CueWriter& writer, SubtitleFormat to) {
+  TRACE_SPAN("cues_to_cues");
+  const std::unordered_map<std::string, detail::TextState> styles;
+  Cue cue;
+  std::string text, name;
+  while (reader.Next(&cue)) {
+    name.clear();
+    markup_to_ass_text(cue.text, from, &text, &name);
+
+    // SRT \an tags go through the ASS text and override the cue settings
+    detail::TextState style;
+    const int cue_alignment = (from == SubtitleFormat::VTT) ? vtt_alignment(cue.settings) : 2;
+    style.alignment = cue_alignment;
+    const int alignment = ass_text_to_markup(TextSpan(text.data(), text.size()), style, styles, to, &cue.text);
+
+    if (to == SubtitleFormat::VTT) {
+      if ((from != SubtitleFormat::VTT) || (alignment != cue_alignment)) cue.settings = vtt_settings(alignment);
+      if (!name.empty()) cue.text = "<v " + name + ">" + cue.text;
+    } else if (alignment != 2) {
+      cue.text = StringPrintf("{\\an%d}", alignment) + cue.text;
+    }
+    writer.Write(cue);
+  }
+}
+
+} // namespace ass
+
+#endif // OPS_CONVERT_HPP_
@@ -0,0 +1,377 @@
+// Compare the events of two ASS subtitles
+// Copyright (c) 2019 Slek
+
+#ifndef OPS_DIFF_HPP_
+#define OPS_DIFF_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "columns.hpp"
+#include "tags.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+struct EventChange {
+  enum Kind {
+    RETIMED,  // Same content, different Start/End
+    RETEXTED, // Same Start/End, different content
+    MODIFIED, // Both changed, aligned by time overlap and text similarity
+    REMOVED,  // Only in the first script
+    ADDED     // Only in the second script
+  };
+
+  Kind kind;
+  std::size_t event1; // 1-based index in [Events] of each script, 0 if none
+  std::size_t event2;
+  const std::pair<std::string, std::string>* line1; // Event lines, valid while the scripts live
+  const std::pair<std::string, std::string>* line2;
+  ass::time_signed_t start1, end1;
+  ass::time_signed_t start2, end2;
+};
+
+inline const char* change_kind_name(EventChange::Kind kind) {
+  switch (kind) {
+    case EventChange::RETIMED: return "retimed";
+    case EventChange::RETEXTED: return "retexted";
+    case EventChange::MODIFIED: return "modified";
+    case EventChange::REMOVED: return "removed";
+    case EventChange::ADDED: return "added";
+  }
+  return "unknown";
+}
+
+// Events of one script reduced to normalized, hashed fields
+class DiffEvents {
+public:
+
+  explicit DiffEvents(const ass::ASSFile& ass) {
+    if (!ass.HasSection(ass::EVENTS)) return;
+
+    const std::list<std::pair<std::string, std::string>>& lines = ass.Section(ass::EVENTS);
+    const std::string& format = lines.front().second;
+    if (lines.front().first != "Format")
+      throw ass::io_error("format line must appear first in events");
+
+    std::vector<std::string> names = StringSplit(format, ass::FIELD_DELIMITER);
+    for (std::string& name : names) StringTrim(&name);
+    if (names.empty() || (names.back() != "Text"))
+      throw ass::io_error("'Text' field must appear in last place");
+
+    // Fields other than Start and End, by name, so that scripts with
+    // differently ordered Format lines compare equal
+    std::vector<std::size_t> content;
+    for (std::size_t i = 0; i < names.size(); ++i)
+      if ((names[i] != "Start") && (names[i] != "End")) content.push_back(i);
+    std::sort(content.begin(), content.end(), [&names](std::size_t a, std::size_t b) { return names[a] < names[b]; });
+
+    columns_.reset(new ass::EventColumns(format, std::next(lines.cbegin()), lines.cend()));
+    const std::size_t n = columns_->size();
+    content_.resize(n);
+    content_hash_.resize(n);
+    text_.resize(n);
+
+    std::vector<ass::TextSpan> fields(names.size());
+    for (std::size_t i = 0; i < n; ++i) {
+      const std::string& line_data = columns_->data(i);
+      SplitFields(line_data, &fields);
+
+      std::string& key = content_[i];
+      key = columns_->type(i);
+      for (std::size_t idx : content) {
+        key.push_back('\0');
+        AppendTrimmed(fields[idx], &key);
+      }
+      content_hash_[i] = Hash(key);
+
+      ass::strip_tags(fields.back().data, fields.back().size, &text_[i]);
+    }
+  }
+
+  std::size_t size() const { return content_.size(); }
+
+  const std::pair<std::string, std::string>& line(std::size_t i) const { return columns_->line(i); }
+
+  const std::string& content(std::size_t i) const { return content_[i]; }
+  std::uint64_t content_hash(std::size_t i) const { return content_hash_[i]; }
+  const std::string& text(std::size_t i) const { return text_[i]; }
+
+  ass::time_signed_t start(std::size_t i) const { return columns_->start[i]; }
+  ass::time_signed_t end(std::size_t i) const { return columns_->end_defined(i) ? columns_->end[i] : columns_->start[i]; }
+  std::uint64_t time_key(std::size_t i) const {
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(start(i))) << 32) |
+            static_cast<std::uint32_t>(end(i));
+  }
+
+  static std::uint64_t Hash(const std::string& str) {
+    std::uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (char ch : str) {
+      hash ^= static_cast<unsigned char>(ch);
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+private:
+
+  static void SplitFields(const std::string& line_data, std::vector<ass::TextSpan>* fields) {
+    const char* it = line_data.data();
+    const char* end = it + line_data.size();
+    for (std::size_t f = 0; f + 1 < fields->size(); ++f) {
+      const char* comma = ass::detail::find(it, end, ass::FIELD_DELIMITER[0]);
+      (*fields)[f] = ass::TextSpan(it, comma);
+      it = (comma < end) ? comma + 1 : end;
+    }
+    fields->back() = ass::TextSpan(it, end);
+  }
+
+  static void AppendTrimmed(const ass::TextSpan& field, std::string* out) {
+    const char* begin = field.begin();
+    const char* end = field.end();
+    while ((begin < end) && IsWhiteSpace(*begin)) ++begin;
+    while ((end > begin) && IsWhiteSpace(*(end - 1))) --end;
+    out->append(begin, end);
+  }
+
+  std::unique_ptr<ass::EventColumns> columns_;
+  std::vector<std::string> content_;
+  std::vector<std::uint64_t> content_hash_;
+  std::vector<std::string> text_;
+};
+
+namespace detail {
+
+// Dice coefficient of the character bigrams of two texts, in [0, 1]
+inline double text_similarity(const std::string& a, const std::string& b) {
+  if (a == b) return 1.0;
+  if ((a.size() < 2) || (b.size() < 2)) return 0.0;
+
+  auto bigrams = [](const std::string& str) {
+    std::vector<std::uint16_t> v;
+    v.reserve(str.size() - 1);
+    for (std::size_t i = 0; i + 1 < str.size(); ++i)
+      v.push_back(static_cast<std::uint16_t>((static_cast<unsigned char>(str[i]) << 8) | static_cast<unsigned char>(str[i + 1])));
+    std::sort(v.begin(), v.end());
+    return v;
+  };
+
+  const std::vector<std::uint16_t> va = bigrams(a), vb = bigrams(b);
+  std::size_t common = 0;
+  for (std::size_t i = 0, j = 0; (i < va.size()) && (j < vb.size()); ) {
+    if (va[i] < vb[j]) ++i;
+    else if (vb[j] < va[i]) ++j;
+    else { ++common; ++i; ++j; }
+  }
+  return 2.0 * static_cast<double>(common) / static_cast<double>(va.size() + vb.size());
+}
+
+// Pair unmatched events whose key is equal, in order of appearance. Keys are
+// sorted on both sides and merged, so no per-key containers are allocated.
+template <typename KeyFunc1, typename KeyFunc2, typename EqualFunc>
+void match_by_key(std::size_t n1, std::size_t n2, KeyFunc1&& key1, KeyFunc2&& key2, EqualFunc&& equal,
+                  std::vector<std::size_t>* match1, std::vector<std::size_t>* match2, bool unique_only = false) {
+  const std::size_t none = std::numeric_limits<std::size_t>::max();
+
+  typedef std::pair<std::uint64_t, std::size_t> Entry;
+  std::vector<Entry> keys1, keys2;
+  keys1.reserve(n1);
+  keys2.reserve(n2);
+  for (std::size_t i = 0; i < n1; ++i)
+    if ((*match1)[i] == none) keys1.emplace_back(key1(i), i);
+  for (std::size_t j = 0; j < n2; ++j)
+    if ((*match2)[j] == none) keys2.emplace_back(key2(j), j);
+  std::sort(keys1.begin(), keys1.end());
+  std::sort(keys2.begin(), keys2.end());
+
+  std::size_t a = 0, b = 0;
+  while ((a < keys1.size()) && (b < keys2.size())) {
+    if (keys1[a].first < keys2[b].first) { ++a; continue; }
+    if (keys2[b].first < keys1[a].first) { ++b; continue; }
+
+    const std::uint64_t key = keys1[a].first;
+    std::size_t a_end = a, b_end = b;
+    while ((a_end < keys1.size()) && (keys1[a_end].first == key)) ++a_end;
+    while ((b_end < keys2.size()) && (keys2[b_end].first == key)) ++b_end;
+
+    if (!unique_only || ((a_end - a == 1) && (b_end - b == 1))) {
+      std::size_t first_free = b;
+      for (std::size_t k1 = a; k1 < a_end; ++k1) {
+        const std::size_t i = keys1[k1].second;
+        while ((first_free < b_end) && ((*match2)[keys2[first_free].second] != none)) ++first_free;
+        for (std::size_t k2 = first_free; k2 < b_end; ++k2) {
+          const std::size_t j = keys2[k2].second;
+          if (((*match2)[j] != none) || !equal(i, j)) continue; // Taken or hash collision
+          (*match1)[i] = j;
+          (*match2)[j] = i;
+          break;
+        }
+      }
+    }
+
+    a = a_end;
+    b = b_end;
+  }
+}
+
+} // namespace detail
+
+// Classify the events of two scripts. Events are first paired by the hash of
+// their normalized content plus times (unchanged), then by content alone
+// (retimed) and by times alone when unambiguous (retexted). The remaining
+// events are aligned greedily by time overlap and text similarity, and
+// whatever is left over is reported as removed or added. Changes are sorted
+// by start time.
+inline void diff(const ass::ASSFile& ass1, const ass::ASSFile& ass2, std::vector<EventChange>* changes) {
+  TRACE_SPAN("diff");
+  changes->clear();
+
+  // Both scripts are normalized concurrently
+  std::unique_ptr<DiffEvents> events1_ptr, events2_ptr;
+  std::exception_ptr error;
+  std::thread worker([&ass2, &events2_ptr, &error]() {
+    try {
+      events2_ptr.reset(new DiffEvents(ass2));
+    } catch (...) {
+      error = std::current_exception();
+    }
+  });
+  try {
+    events1_ptr.reset(new DiffEvents(ass1));
+  } catch (...) {
+    worker.join();
+    throw;
+  }
+  worker.join();
+  if (error) std::rethrow_exception(error);
+  const DiffEvents& events1 = *events1_ptr;
+  const DiffEvents& events2 = *events2_ptr;
+  const std::size_t n1 = events1.size(), n2 = events2.size();
+  const std::size_t none = std::numeric_limits<std::size_t>::max();
+  std::vector<std::size_t> match1(n1, none), match2(n2, none);
+
+  const auto change = [&](EventChange::Kind kind, std::size_t i, std::size_t j) {
+    EventChange c = {kind, 0, 0, nullptr, nullptr, 0, 0, 0, 0};
+    if (i != none) { c.event1 = i + 1; c.line1 = &events1.line(i); c.start1 = events1.start(i); c.end1 = events1.end(i); }
+    if (j != none) { c.event2 = j + 1; c.line2 = &events2.line(j); c.start2 = events2.start(j); c.end2 = events2.end(j); }
+    changes->push_back(c);
+  };
+
+  const auto content_equal = [&](std::size_t i, std::size_t j) { return events1.content(i) == events2.content(j); };
+
+  {
+    TRACE_SPAN("hash match");
+    const auto full1 = [&](std::size_t i) { return events1.content_hash(i) ^ (events1.time_key(i) * 0x9e3779b97f4a7c15ull); };
+    const auto full2 = [&](std::size_t j) { return events2.content_hash(j) ^ (events2.time_key(j) * 0x9e3779b97f4a7c15ull); };
+    detail::match_by_key(n1, n2, full1, full2, [&](std::size_t i, std::size_t j) {
+      return (events1.time_key(i) == events2.time_key(j)) && content_equal(i, j);
+    }, &match1, &match2);
+  }
+
+  const std::vector<std::size_t> unchanged1(match1);
+
+  {
+    TRACE_SPAN("retimed");
+    const auto content1 = [&](std::size_t i) { return events1.content_hash(i); };
+    const auto content2 = [&](std::size_t j) { return events2.content_hash(j); };
+    detail::match_by_key(n1, n2, content1, content2, content_equal, &match1, &match2);
+    for (std::size_t i = 0; i < n1; ++i)
+      if ((unchanged1[i] == none) && (match1[i] != none))
+        change(EventChange::RETIMED, i, match1[i]);
+  }
+
+  {
+    TRACE_SPAN("retexted");
+    const auto time1 = [&](std::size_t i) { return events1.time_key(i); };
+    const auto time2 = [&](std::size_t j) { return events2.time_key(j); };
+    std::vector<std::size_t> before(match1);
+    detail::match_by_key(n1, n2, time1, time2, [&](std::size_t i, std::size_t j) {
+      return events1.time_key(i) == events2.time_key(j);
+    }, &match1, &match2, true);
+    for (std::size_t i = 0; i < n1; ++i)
+      if ((before[i] == none) && (match1[i] != none))
+        change(EventChange::RETEXTED, i, match1[i]);
+  }
+
+  {
+    TRACE_SPAN("align");
+
+    std::vector<std::size_t> rest1, rest2;
+    for (std::size_t i = 0; i < n1; ++i) if (match1[i] == none) rest1.push_back(i);
+    for (std::size_t j = 0; j < n2; ++j) if (match2[j] == none) rest2.push_back(j);
+    std::sort(rest1.begin(), rest1.end(), [&](std::size_t a, std::size_t b) { return events1.start(a) < events1.start(b); });
+    std::sort(rest2.begin(), rest2.end(), [&](std::size_t a, std::size_t b) { return events2.start(a) < events2.start(b); });
+
+    // Candidate pairs overlapping in time, a bounded number per event
+    const std::size_t max_candidates = 16;
+    struct Candidate {
+      double score;
+      std::size_t i, j;
+    };
+    std::vector<Candidate> candidates;
+
+    // Events of rest2 starting before start - max_length can't overlap
+    ass::time_signed_t max_length = 0;
+    for (std::size_t j : rest2) max_length = std::max(max_length, events2.end(j) - events2.start(j));
+
+    std::size_t first = 0;
+    for (std::size_t i : rest1) {
+      const ass::time_signed_t s1 = events1.start(i), e1 = events1.end(i);
+      while ((first < rest2.size()) && (static_cast<std::int64_t>(events2.start(rest2[first])) + max_length < s1)) ++first;
+
+      std::size_t found = 0;
+      for (std::size_t k = first; (k < rest2.size()) && (found < max_candidates); ++k) {
+        const std::size_t j = rest2[k];
+        const ass::time_signed_t s2 = events2.start(j), e2 = events2.end(j);
+        if (s2 > e1) break;
+
+        const ass::time_signed_t overlap = std::min(e1, e2) - std::max(s1, s2);
+        const ass::time_signed_t span = std::max(e1, e2) - std::min(s1, s2);
+        if ((overlap <= 0) && !((s1 == s2) && (e1 == e2))) continue;
+        ++found;
+
+        const double time_score = (span > 0) ? static_cast<double>(overlap) / static_cast<double>(span) : 1.0;
+        const double text_score = detail::text_similarity(events1.text(i), events2.text(j));
+        if ((time_score >= 0.5) || (text_score >= 0.5))
+          candidates.push_back(Candidate{time_score + text_score, i, j});
+      }
+    }
+
+    std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+    for (const Candidate& c : candidates) {
+      if ((match1[c.i] != none) || (match2[c.j] != none)) continue;
+      match1[c.i] = c.j;
+      match2[c.j] = c.i;
+      const EventChange::Kind kind = (events1.time_key(c.i) == events2.time_key(c.j)) ? EventChange::RETEXTED : EventChange::MODIFIED;
+      change(kind, c.i, c.j);
+    }
+  }
+
+  for (std::size_t i = 0; i < n1; ++i)
+    if (match1[i] == none) change(EventChange::REMOVED, i, none);
+  for (std::size_t j = 0; j < n2; ++j)
+    if (match2[j] == none) change(EventChange::ADDED, none, j);
+
+  const auto start_of = [](const EventChange& c) { return c.event2 ? c.start2 : c.start1; };
+  std::stable_sort(changes->begin(), changes->end(), [&](const EventChange& a, const EventChange& b) {
+    const ass::time_signed_t ta = start_of(a), tb = start_of(b);
+    if (ta != tb) return ta < tb;
+    return (a.event2 ? a.event2 : a.event1) < (b.event2 ? b.event2 : b.event1);
+  });
+}
+
+} // namespace ass
+
+#endif // OPS_DIFF_HPP_
@@ -0,0 +1,168 @@
+// Extract ASS subtitles by styles
+// Copyright (c) 2019 Slek
+
+#ifndef OPS_EXTRACT_HPP_
+#define OPS_EXTRACT_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "intern.hpp"
+#include "tags.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+// Styles to extract, given as a comma separated list of names. Matching is
+// done once per distinct event style and yields a bitset over its ids.
+class StyleSet {
+public:
+
+  explicit StyleSet(const std::string& list, bool except = false)
+    : except_(except) {
+    for (std::string& style : StringSplit(list, ass::FIELD_DELIMITER)) {
+      StringTrim(&style);
+      names_.intern(style);
+    }
+  }
+
+  bool selected(const TextSpan& style) const {
+    return (names_.find(style) != ass::NO_ID) != except_;
+  }
+
+  IdSet resolve(const StringTable& styles) const {
+    IdSet ids(styles.size());
+    for (std::uint32_t id = 0; id < styles.size(); ++id)
+      if (selected(styles.name(id))) ids.insert(id);
+    return ids;
+  }
+
+private:
+  StringTable names_;
+  bool except_;
+};
+
+// Append the dialogue events in [first, last) whose style is selected to
+// out. format is the data of the Format line. When given, selected gets one
+// flag per event telling whether it was kept.
+inline void extract_events(const std::string& format, std::list<std::pair<std::string, std::string>>::const_iterator first,
+                           std::list<std::pair<std::string, std::string>>::const_iterator last,
+                           const StyleSet& styles, std::list<std::pair<std::string, std::string>>& out,
+                           std::vector<std::uint8_t>* selected = nullptr) {
+  std::size_t text_idx = std::numeric_limits<std::size_t>::max();
+  if (!ass::get_field_index(format, "Text", &text_idx) ||
+       (text_idx != (StringSplit(format, ass::FIELD_DELIMITER).size()-1)))
+    throw ass::io_error("'Text' field must appear in last place");
+
+  const EventNames names(format, first, last);
+  const IdSet chosen = styles.resolve(names.styles);
+
+  TRACE_SPAN("styles");
+  std::size_t i = 0;
+  for (std::list<std::pair<std::string, std::string>>::const_iterator it = first; it != last; ++it, ++i) {
+    if (selected) selected->push_back(0);
+    if (it->first != ass::DIALOGUE_EVENT) continue;
+
+    if (chosen.contains(names.style[i])) {
+      out.push_back(std::make_pair(ass::DIALOGUE_EVENT, it->second));
+      if (selected) selected->back() = 1;
+    }
+  }
+}
+
+// Same, in place: the events from first to the end of lines that would not
+// be extracted are erased, the others stay as they are
+inline void extract_events_in_place(const std::string& format, std::list<std::pair<std::string, std::string>>& lines,
+                                    std::list<std::pair<std::string, std::string>>::iterator first,
+                                    const StyleSet& styles, std::vector<std::uint8_t>* selected = nullptr) {
+  std::size_t text_idx = std::numeric_limits<std::size_t>::max();
+  if (!ass::get_field_index(format, "Text", &text_idx) ||
+       (text_idx != (StringSplit(format, ass::FIELD_DELIMITER).size()-1)))
+    throw ass::io_error("'Text' field must appear in last place");
+
+  const EventNames names(format, first, lines.end());
+  const IdSet chosen = styles.resolve(names.styles);
+
+  TRACE_SPAN("styles");
+  std::size_t i = 0;
+  for (std::list<std::pair<std::string, std::string>>::iterator it = first; it != lines.end(); ++i) {
+    const bool keep = (it->first == ass::DIALOGUE_EVENT) && chosen.contains(names.style[i]);
+    if (selected) selected->push_back(keep ? 1 : 0);
+
+    if (keep) ++it;
+    else it = lines.erase(it);
+  }
+}
+
+inline void extract(const ass::ASSFile& ass, const StyleSet& styles, ass::ASSFile& out, std::vector<std::uint8_t>* selected = nullptr) {
+  TRACE_SPAN("extract");
+  out.clear();
+
+  out.BOM() = ass.BOM();
+
+  out.ScriptComment() = ass.ScriptComment();
+  out.copy_layout(ass);
+
+  bool has_events = false;
+  for (const std::string& section : ass.Sections()) {
+    TRACE_SPAN_DETAIL("section", section);
+    if (section == ass::EVENTS) {
+      has_events = true;
+
+      const std::list<std::pair<std::string, std::string>>& lines = ass.Section(ass::EVENTS);
+
+      std::list<std::pair<std::string, std::string>>::const_iterator it = lines.cbegin();
+      if (it == lines.cend()) continue;
+
+      const std::pair<std::string, std::string>& format_line = *it;
+      out.add_line(ass::EVENTS, format_line.first, format_line.second);
+      ++it;
+
+      if (format_line.first != "Format")
+        throw ass::io_error("format line must appear first in events");
+
+      extract_events(format_line.second, it, lines.cend(), styles, out.Section(ass::EVENTS), selected);
+    } else {
+      out.share(section, ass);
+    }
+  }
+
+  if (!has_events)
+    std::cerr << "[WARNING] Events section not found!" << std::endl;
+}
+
+// Same, consuming ass: its lines are moved to out and the events left out
+// are erased, so no line is copied
+inline void extract(ass::ASSFile&& ass, const StyleSet& styles, ass::ASSFile& out, std::vector<std::uint8_t>* selected = nullptr) {
+  TRACE_SPAN("extract");
+  out = std::move(ass);
+  ass.clear();
+
+  if (out.Sections().find(ass::EVENTS) == out.Sections().end()) {
+    std::cerr << "[WARNING] Events section not found!" << std::endl;
+    return;
+  }
+  if (!out.HasSection(ass::EVENTS)) return;
+
+  std::list<std::pair<std::string, std::string>>& lines = out.Section(ass::EVENTS);
+  const std::pair<std::string, std::string>& format_line = lines.front();
+  if (format_line.first != "Format")
+    throw ass::io_error("format line must appear first in events");
+
+  extract_events_in_place(format_line.second, lines, std::next(lines.begin()), styles, selected);
+}
+
+} // namespace ass
+
+#endif // OPS_EXTRACT_HPP_
@@ -0,0 +1,155 @@
+// Embedded fonts of ASS subtitles
+// Copyright (c) 2019 Slek
+//
+// Fonts live in the [Fonts] section as a "fontname: <name>" line followed by
+// the uuencoded file. Encoding and decoding stream in blocks, so multi-MB
+// fonts are never held twice in memory in both forms.
+
+#ifndef OPS_FONTS_HPP_
+#define OPS_FONTS_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <istream>
+#include <list>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "trace.hpp"
+#include "uuencode.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+const std::size_t FONT_BLOCK_SIZE = 1 << 16;
+
+struct FontInfo {
+  std::string name;
+  std::size_t size; // Decoded size, in bytes
+};
+
+// Name and start of the encoded data of a font line
+inline std::string font_name(const std::string& line_data, std::string::size_type* data_pos = nullptr) {
+  std::string::size_type end = line_data.find_first_of("\r\n");
+  if (end == std::string::npos) end = line_data.size();
+  if (data_pos) *data_pos = end;
+
+  std::string name = line_data.substr(0, end);
+  StringTrim(&name);
+  return name;
+}
+
+// Name a font file is attached as: its base name, with the "_0" suffix SSA
+// expects before the extension
+inline std::string font_attachment_name(const std::string& path) {
+  const std::string::size_type slash = path.find_last_of("/\\");
+  std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+  std::string::size_type dot = name.rfind('.');
+  if (dot == std::string::npos) dot = name.size();
+  return name.insert(dot, "_0");
+}
+
+inline void list_fonts(const ass::ASSFile& ass, std::vector<FontInfo>* fonts) {
+  fonts->clear();
+  if (!ass.HasSection(ass::FONTS)) return;
+
+  for (const std::pair<std::string, std::string>& line : ass.Section(ass::FONTS)) {
+    if (line.first != ass::FONT_LINE) continue;
+    std::string::size_type data_pos;
+    FontInfo font;
+    font.name = font_name(line.second, &data_pos);
+    font.size = uudecoded_size(line.second.data() + data_pos, line.second.size() - data_pos);
+    fonts->push_back(font);
+  }
+}
+
+// Decode the font of a font line into out
+inline void extract_font(const std::string& line_data, std::ostream& out) {
+  TRACE_SPAN("extract_font");
+  std::string::size_type pos;
+  font_name(line_data, &pos);
+
+  UUDecoder decoder;
+  std::string block;
+  while (pos < line_data.size()) {
+    const std::size_t size = std::min(FONT_BLOCK_SIZE, line_data.size() - pos);
+    block.clear();
+    if (!decoder.Decode(line_data.data() + pos, size, &block))
+      throw ass::io_error("invalid character in embedded font");
+    out.write(block.data(), static_cast<std::streamsize>(block.size()));
+    pos += size;
+  }
+
+  block.clear();
+  if (!decoder.Finish(&block))
+    throw ass::io_error("truncated embedded font");
+  out.write(block.data(), static_cast<std::streamsize>(block.size()));
+}
+
+// Attach the font read from input as name, replacing a font with the same
+// name
+inline void attach_font(ass::ASSFile& ass, const std::string& name, std::istream& input) {
+  TRACE_SPAN("attach_font");
+  const std::string header = " " + name + ass.LineBreak();
+  std::string data = header;
+
+  // Encoded straight after the name line
+  UUEncoder encoder(ass.LineBreak());
+  std::vector<char> block(FONT_BLOCK_SIZE);
+  while (input) {
+    input.read(block.data(), static_cast<std::streamsize>(block.size()));
+    const std::size_t size = static_cast<std::size_t>(input.gcount());
+    if (size == 0) break;
+    encoder.Encode(block.data(), size, &data);
+  }
+  if (input.bad())
+    throw ass::io_error("can't read font file");
+  encoder.Finish(&data);
+
+  if (data.size() == header.size()) data.resize(header.size() - ass.LineBreak().size());
+
+  if (ass.HasSection(ass::FONTS)) {
+    for (std::pair<std::string, std::string>& line : ass.Section(ass::FONTS)) {
+      if ((line.first == ass::FONT_LINE) && (font_name(line.second) == name)) {
+        line.second.swap(data);
+        return;
+      }
+    }
+  }
+  ass.add_line(ass::FONTS, ass::FONT_LINE, data);
+}
+
+// Remove the fonts named in names (all of them when empty), returns how
+// many were removed
+inline std::size_t detach_fonts(ass::ASSFile& ass, const std::vector<std::string>& names) {
+  if (!ass.HasSection(ass::FONTS)) return 0;
+
+  std::list<std::pair<std::string, std::string>>& section = ass.Section(ass::FONTS);
+  std::size_t removed = 0;
+  for (std::list<std::pair<std::string, std::string>>::iterator it = section.begin(); it != section.end(); ) {
+    bool selected = (it->first == ass::FONT_LINE);
+    if (selected && !names.empty()) {
+      const std::string name = font_name(it->second);
+      selected = false;
+      for (const std::string& selected_name : names)
+        selected |= (selected_name == name);
+    }
+
+    if (selected) {
+      it = section.erase(it);
+      removed++;
+    } else {
+      ++it;
+    }
+  }
+
+  if (section.empty()) ass.remove_section(ass::FONTS);
+  return removed;
+}
+
+} // namespace ass
+
+#endif // OPS_FONTS_HPP_
@@ -0,0 +1,203 @@
+// Check ASS subtitles events for timing and style problems
+// Copyright (c) 2019 Slek
+
+#ifndef OPS_LINT_HPP_
+#define OPS_LINT_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "columns.hpp"
+#include "intern.hpp"
+#include "tags.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+struct LintIssue {
+  enum Kind {
+    OVERLAP,         // Two dialogue events of the same group are shown at once
+    INVALID_TIMING,  // End < Start
+    ZERO_DURATION,   // End == Start
+    UNDEFINED_STYLE  // Style not defined in [V4+ Styles]
+  };
+
+  Kind kind;
+  std::size_t event;  // 1-based index in [Events], Format line excluded
+  std::size_t other;  // OVERLAP only: the earlier event
+  std::string style;
+  std::int32_t layer;
+  std::string position; // OVERLAP only: \pos/\move arguments, empty for default placement
+  ass::time_signed_t start;
+  ass::time_signed_t end;
+};
+
+inline const char* lint_kind_name(LintIssue::Kind kind) {
+  switch (kind) {
+    case LintIssue::OVERLAP: return "overlap";
+    case LintIssue::INVALID_TIMING: return "invalid_timing";
+    case LintIssue::ZERO_DURATION: return "zero_duration";
+    case LintIssue::UNDEFINED_STYLE: return "undefined_style";
+  }
+  return "unknown";
+}
+
+namespace detail {
+
+// Explicit position of an event (\pos or \move arguments), empty if none
+inline std::string lint_position(const ass::TextSpan& text) {
+  std::string position;
+  if (!ass::has_override_blocks(text.data, text.size)) return position;
+
+  ass::for_each_tag(text, [&position](const ass::TextToken& tag) {
+    if (position.empty() && tag.parenthesized && (tag.name.equals("pos") || tag.name.equals("move"))) {
+      position = tag.name.str() + "(";
+      for (const char* it = tag.args.begin(); it != tag.args.end(); ++it)
+        if (!IsWhiteSpace(*it)) position.push_back(*it);
+      position += ")";
+    }
+  });
+  return position;
+}
+
+} // namespace detail
+
+// Report overlapping dialogue events per style, layer and position group,
+// events ending before they start or lasting zero time and references to
+// undefined styles. Overlaps are found with a single sort of the events by
+// (group, start) followed by a sweep line over each group, O(n log n) plus
+// the number of overlaps reported. Issues are sorted by event.
+inline void lint(const ass::ASSFile& ass, std::vector<LintIssue>* issues) {
+  TRACE_SPAN("lint");
+  issues->clear();
+
+  // Defined styles
+  StringTable defined;
+  intern_styles(ass, &defined);
+
+  if (!ass.HasSection(ass::EVENTS)) return;
+
+  const std::list<std::pair<std::string, std::string>>& lines = ass.Section(ass::EVENTS);
+  const std::pair<std::string, std::string>& format_line = lines.front();
+  if (format_line.first != "Format")
+    throw ass::io_error("format line must appear first in events");
+
+  std::size_t text_idx = std::numeric_limits<std::size_t>::max();
+  if (!ass::get_field_index(format_line.second, "Text", &text_idx) ||
+       (text_idx != (StringSplit(format_line.second, ass::FIELD_DELIMITER).size()-1)))
+    throw ass::io_error("'Text' field must appear in last place");
+
+  ass::EventColumns columns(format_line.second, std::next(lines.cbegin()), lines.cend());
+  const std::size_t n = columns.size();
+
+  const EventNames names(format_line.second, std::next(lines.cbegin()), lines.cend());
+
+  // Whether each event style is defined. A leading '*' is tolerated by
+  // renderers
+  IdSet undefined;
+  for (std::uint32_t id = 0; id < names.styles.size(); ++id) {
+    const TextSpan style = names.styles.name(id);
+    if ((defined.find(style) != NO_ID) ||
+        (!style.empty() && (style.data[0] == '*') && (defined.find(style.data + 1, style.size - 1) != NO_ID))) continue;
+    undefined.insert(id);
+  }
+
+  // Group of every dialogue event with a positive duration, interned from
+  // its (layer, style id, position id) bytes
+  struct Group {
+    std::uint32_t style;
+    std::int32_t layer;
+    std::uint32_t position;
+  };
+  StringTable positions, group_ids;
+  std::vector<Group> groups;
+  std::vector<std::uint32_t> group_of(n, std::numeric_limits<std::uint32_t>::max());
+
+  {
+    TRACE_SPAN("groups");
+    std::string position;
+    for (std::size_t i = 0; i < n; ++i) {
+      const std::uint32_t style = names.style[i];
+      if (undefined.contains(style))
+        issues->push_back(LintIssue{LintIssue::UNDEFINED_STYLE, i + 1, 0, names.styles.name(style).str(), columns.layer[i], "", columns.start[i], columns.end[i]});
+
+      if (!columns.start_defined(i) || !columns.end_defined(i)) continue;
+      if (columns.end[i] < columns.start[i]) {
+        issues->push_back(LintIssue{LintIssue::INVALID_TIMING, i + 1, 0, names.style_name(i).str(), columns.layer[i], "", columns.start[i], columns.end[i]});
+        continue;
+      }
+      if (columns.end[i] == columns.start[i]) {
+        issues->push_back(LintIssue{LintIssue::ZERO_DURATION, i + 1, 0, names.style_name(i).str(), columns.layer[i], "", columns.start[i], columns.end[i]});
+        continue;
+      }
+
+      if (columns.type(i) != ass::DIALOGUE_EVENT) continue;
+
+      ass::TextSpan text;
+      position.clear();
+      if (ass::get_text(columns.data(i), text_idx, &text))
+        position = detail::lint_position(text);
+
+      const Group group = {style, columns.layer[i], positions.intern(position)};
+      const std::uint32_t id = group_ids.intern(reinterpret_cast<const char*>(&group), sizeof(group));
+      if (id == groups.size()) groups.push_back(group);
+      group_of[i] = id;
+    }
+  }
+
+  {
+    TRACE_SPAN("sweep");
+
+    std::vector<std::uint32_t> order;
+    order.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+      if (group_of[i] != std::numeric_limits<std::uint32_t>::max()) order.push_back(static_cast<std::uint32_t>(i));
+
+    std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+      if (group_of[a] != group_of[b]) return group_of[a] < group_of[b];
+      if (columns.start[a] != columns.start[b]) return columns.start[a] < columns.start[b];
+      return a < b;
+    });
+
+    // Active events of the current group, as a min-heap on End
+    typedef std::pair<ass::time_signed_t, std::uint32_t> Active;
+    std::vector<Active> active;
+    const std::greater<Active> later;
+
+    std::uint32_t current_group = std::numeric_limits<std::uint32_t>::max();
+    for (std::uint32_t i : order) {
+      if (group_of[i] != current_group) {
+        current_group = group_of[i];
+        active.clear();
+      }
+
+      while (!active.empty() && (active.front().first <= columns.start[i])) {
+        std::pop_heap(active.begin(), active.end(), later);
+        active.pop_back();
+      }
+
+      const Group& group = groups[current_group];
+      for (const Active& other : active)
+        issues->push_back(LintIssue{LintIssue::OVERLAP, i + 1, other.second + 1u, names.styles.name(group.style).str(), group.layer,
+                                    positions.name(group.position).str(), columns.start[i], std::min(columns.end[i], other.first)});
+
+      active.push_back(Active(columns.end[i], i));
+      std::push_heap(active.begin(), active.end(), later);
+    }
+  }
+
+  std::stable_sort(issues->begin(), issues->end(), [](const LintIssue& a, const LintIssue& b) {
+    return (a.event != b.event) ? (a.event < b.event) : (a.other < b.other);
+  });
+}
+
+} // namespace ass
+
+#endif // OPS_LINT_HPP_
@@ -0,0 +1,224 @@
+// Merge ASS subtitles
+// Copyright (c) 2019 Slek
+
+#ifndef OPS_MERGE_HPP_
+#define OPS_MERGE_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "ass.hpp"
+#include "columns.hpp"
+#include "intern.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+#include "util/version.h"
+
+namespace ass {
+
+inline void merge(const ass::ASSFile& ass1, const ass::ASSFile& ass2, const ass::time_t t, ass::ASSFile& merged) {
+  TRACE_SPAN("merge");
+  merged.clear();
+
+  // BOM
+  if (ass1.BOM() || ass2.BOM()) merged.BOM() = true;
+  else merged.BOM() = false;
+
+  // Line break, section order and unknown sections of the first input
+  merged.copy_layout(ass1);
+  if (ass1.LineBreak() != ass2.LineBreak()) merged.LineBreak() = ass::LINE_SEPARATOR;
+
+  // Script comment
+  const std::string build = StringPrintf("; Script generated by ASSTools (%s)", GetBuildInfo().c_str());
+  const std::string url = "; http://github.com/Slek-Z/ass_tools";
+  merged.ScriptComment() = build + merged.LineBreak() + url;
+
+  { // [ScriptInfo]
+    TRACE_SPAN_DETAIL("section", ass::SCRIPT_INFO);
+    const std::unordered_set<std::string> strict = {"ScriptType"};
+    const std::unordered_set<std::string> whitelist = {"Title", "Original Script"};
+    const std::unordered_set<std::string> optional = {"Original Translation", "Original Editing", "Original Timing", "Synch Point", "Script Updated By", "Update Details"};
+
+    std::unordered_map<std::string, std::string> type_map2;
+    for (const std::pair<std::string, std::string>& entry : ass2.Section(ass::SCRIPT_INFO))
+      type_map2[entry.first] = entry.second;
+
+    std::unordered_set<std::string> types1;
+    for (const std::pair<std::string, std::string>& entry : ass1.Section(ass::SCRIPT_INFO)) {
+      const std::string& line_type = entry.first;
+      const std::string& line_data = entry.second;
+
+      types1.insert(line_type);
+      if (type_map2.find(line_type) != type_map2.end()) {
+        if (line_data != type_map2.at(line_type)) {
+          if (strict.find(line_type) != strict.end()) throw ass::io_error(StringPrintf("'%s' lines must have the same value", line_type.c_str()).c_str());
+          if (optional.find(line_type) != optional.end()) continue;
+          if (whitelist.find(line_type) != whitelist.end()) {
+            merged.add_line(ass::SCRIPT_INFO, line_type, StringPrintf("%s /%s", line_data.c_str(), type_map2.at(line_type).c_str()));
+            continue;
+          }
+          std::cerr << "[WARNING] Couldn't merge '" << line_type << "' line. Keeping only data from first input..." << std::endl;
+        }
+      }
+      merged.add_line(ass::SCRIPT_INFO, line_type, line_data);
+    }
+
+    for (const std::pair<std::string, std::string>& entry : ass2.Section(ass::SCRIPT_INFO)) {
+      if (types1.find(entry.first) == types1.end())
+        merged.add_line(ass::SCRIPT_INFO, entry.first, entry.second);
+    }
+  }
+
+  // [V4+ Styles]
+  if (ass1.HasSection(ass::STYLES) && ass2.HasSection(ass::STYLES)) {
+    TRACE_SPAN_DETAIL("section", ass::STYLES);
+    const std::list<std::pair<std::string, std::string>>& lines1 = ass1.Section(ass::STYLES);
+    const std::list<std::pair<std::string, std::string>>& lines2 = ass2.Section(ass::STYLES);
+
+    if (lines1.front().first != "Format" || lines2.front().first != "Format")
+      throw ass::io_error("format line must appear first");
+
+    std::vector<std::size_t> permutation;
+    const std::string& format1 = lines1.front().second, format2 = lines2.front().second;
+    if (format1 != format2)
+      permutation = ass::compute_permutation(format1, format2);
+
+    // Format
+    merged.add_line(ass::STYLES, "Format", format1);
+
+    std::size_t name_idx = std::numeric_limits<std::size_t>::max();
+    if (!ass::get_field_index(format1, "Name", &name_idx))
+      throw ass::io_error("'Name' field not found in format definition string");
+
+    for (std::list<std::pair<std::string, std::string>>::const_iterator it = std::next(lines1.cbegin()); it != lines1.cend(); ++it)
+      merged.add_line(ass::STYLES, it->first, it->second);
+
+    // Style names of the first input, pointing to their lines
+    ass::StringTable names1;
+    std::vector<const std::pair<std::string, std::string>*> styles1;
+    ass::intern_styles(ass1, &names1, &styles1);
+
+    // Merge
+    for (std::list<std::pair<std::string, std::string>>::const_iterator it = std::next(lines2.cbegin()); it != lines2.cend(); ++it) {
+      const std::string& line_type = it->first;
+      const std::string* line_data = &it->second;
+
+      std::string permuted_data;
+      if (!permutation.empty()) {
+        std::vector<std::string> permuted;
+        if (!ass::apply_permutation(StringSplit(*line_data, ass::FIELD_DELIMITER), permutation, permuted))
+          throw ass::io_error("can't perform field permutation");
+        for (const std::string& str : permuted)
+          permuted_data += str;
+        line_data = &permuted_data;
+      }
+
+      // Check for collisions
+      ass::TextSpan name;
+      if (!ass::get_field_span(*line_data, name_idx, &name))
+        throw ass::io_error("'Name' field cannot be retrieved");
+
+      const std::uint32_t id = names1.find(name);
+      if (id != ass::NO_ID) {
+        if (styles1[id]->second != *line_data)
+          throw ass::io_error(StringPrintf("'%s' colliding style", name.str().c_str()).c_str());
+      } else merged.add_line(ass::STYLES, line_type, *line_data);
+    }
+  } else if (ass1.HasSection(ass::STYLES)) {
+    merged.share(ass::STYLES, ass1);
+  } else if (ass2.HasSection(ass::STYLES)) {
+    merged.share(ass::STYLES, ass2);
+  }
+
+  // [Fonts] & [Graphics]
+  for (const char* const section_name : {ass::FONTS, ass::GRAPHICS}) {
+    const std::string section(section_name);
+    if (ass1.HasSection(section) && ass2.HasSection(section)) {
+      TRACE_SPAN_DETAIL("section", section);
+      // File names of the first input, pointing to their data (big, never copied)
+      ass::StringTable names1;
+      std::vector<const std::string*> files1;
+      std::vector<const std::pair<std::string, std::string>*> kept1, added2;
+      for (const std::pair<std::string, std::string>& entry : ass1.Section(section)) {
+        const std::string& line_data = entry.second;
+        std::string::size_type pos = line_data.find(ass1.LineBreak());
+        if (pos == std::string::npos) continue; // No data? Useless line...
+        kept1.push_back(&entry);
+        const std::uint32_t id = names1.intern(ass::trim_span(line_data.data(), line_data.data() + pos));
+        if (id == files1.size()) files1.push_back(&line_data);
+        else files1[id] = &line_data;
+      }
+
+      for (const std::pair<std::string, std::string>& entry : ass2.Section(section)) {
+        const std::string& line_data = entry.second;
+        std::string::size_type pos = line_data.find(ass2.LineBreak());
+        if (pos == std::string::npos) continue; // No data? Useless line...
+        const ass::TextSpan name = ass::trim_span(line_data.data(), line_data.data() + pos);
+        const std::uint32_t id = names1.find(name);
+        if (id != ass::NO_ID) {
+          if (line_data.compare(*files1[id]) != 0)
+            throw ass::io_error(StringPrintf("'%s' colliding file", name.str().c_str()).c_str());
+        } else added2.push_back(&entry);
+      }
+
+      // Shared with the first input when all its files are kept, copied
+      // only if the second one adds any
+      if (kept1.size() == ass1.Section(section).size()) merged.share(section, ass1);
+      else for (const std::pair<std::string, std::string>* entry : kept1) merged.add_line(section, entry->first, entry->second);
+      for (const std::pair<std::string, std::string>* entry : added2)
+        merged.add_line(section, entry->first, entry->second);
+    } else if (ass1.HasSection(section)) {
+      merged.share(section, ass1);
+    } else if (ass2.HasSection(section)) {
+      merged.share(section, ass2);
+    }
+  }
+
+  // [Events]
+  if (ass1.HasSection(ass::EVENTS) && ass2.HasSection(ass::EVENTS)) {
+    TRACE_SPAN_DETAIL("section", ass::EVENTS);
+    const std::list<std::pair<std::string, std::string>>& lines1 = ass1.Section(ass::EVENTS);
+    const std::list<std::pair<std::string, std::string>>& lines2 = ass2.Section(ass::EVENTS);
+
+    if (lines1.front().first != "Format" || lines2.front().first != "Format")
+      throw ass::io_error("format line must appear first");
+
+    std::vector<std::size_t> permutation;
+    const std::string& format1 = lines1.front().second, format2 = lines2.front().second;
+    if (format1 != format2)
+      permutation = ass::compute_permutation(format1, format2);
+
+    std::size_t text_idx = std::numeric_limits<std::size_t>::max();
+    if (!ass::get_field_index(format1, "Text", &text_idx) ||
+         (text_idx != (StringSplit(format1, ass::FIELD_DELIMITER).size()-1)))
+      throw ass::io_error("'Text' field must appear in last place");
+
+    merged.share(ass::EVENTS, ass1);
+
+    ass::EventColumns columns(format1, std::next(lines2.cbegin()), lines2.cend());
+    if (!columns.shift(static_cast<std::int64_t>(t)))
+      throw ass::io_error("invalid timestamp value");
+
+    TRACE_SPAN("render");
+    ALLOC_EVENTS(columns.size());
+    for (std::size_t i = 0; i < columns.size(); ++i)
+      merged.add_line(ass::EVENTS, columns.type(i), columns.render(i));
+  } else if (ass1.HasSection(ass::EVENTS)) {
+    merged.share(ass::EVENTS, ass1);
+  } else if (ass2.HasSection(ass::EVENTS)) {
+    merged.share(ass::EVENTS, ass2);
+  }
+}
+
+} // namespace ass
+
+#endif // OPS_MERGE_HPP_
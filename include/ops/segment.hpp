@@ -0,0 +1,155 @@
+// Cut subtitles into WebVTT segments with an HLS playlist
+// Copyright (c) 2019 Slek
+//
+// Segmenter splits cues into segments of a fixed duration, aligned with the
+// video segments. A cue goes into every segment it overlaps, so one crossing
+// a boundary is repeated, with its original times, in each of them. Every
+// segment maps cue time zero to an MPEG-TS time in its X-TIMESTAMP-MAP
+// header, so players line it up with the video.
+//
+// A segment is written as soon as the time it covers has passed, and the
+// playlist is rewritten after it; both are replaced through a rename, so
+// readers never see partial files. Fed with events while the input grows,
+// a segment is published at most one segment duration after its first cue.
+
+#ifndef OPS_SEGMENT_HPP_
+#define OPS_SEGMENT_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <sstream>
+#include <string>
+
+#include "ass.hpp"
+#include "ops/convert.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+// MPEG-TS times count a 90 kHz clock on 33 bits
+const std::uint64_t MPEGTS_WRAP = 1ull << 33;
+
+class Segmenter {
+public:
+
+  // Segments of duration ms, named after the playlist path and written next
+  // to it (subs.m3u8 gives subs_00000.vtt, subs_00001.vtt, ...). mpegts is
+  // the MPEG-TS time of cue time zero. A live playlist is written with every
+  // segment, a VOD one by Finish only.
+  Segmenter(const std::string& playlist, std::uint64_t duration, std::uint64_t mpegts, bool live)
+    : playlist_(playlist), duration_(duration), mpegts_(mpegts), live_(live), next_(0), last_end_(0) {
+    const std::string::size_type slash = playlist_.rfind('/');
+    const std::string::size_type name = (slash == std::string::npos) ? 0 : slash + 1;
+    std::string::size_type dot = playlist_.rfind('.');
+    if ((dot == std::string::npos) || (dot < name)) dot = playlist_.size();
+    directory_ = playlist_.substr(0, name);
+    stem_ = playlist_.substr(name, dot - name);
+  }
+
+  // Add a cue to the segments it overlaps, false when they are all written
+  // already. Cues are kept in start time order (ties in arrival order) and
+  // are expected to arrive mostly in order.
+  bool Add(const Cue& cue) {
+    if (End(cue) <= next_ * duration_) return false;
+
+    std::list<Cue>::iterator pos = pending_.end();
+    while ((pos != pending_.begin()) && (std::prev(pos)->start > cue.start)) --pos;
+    pending_.insert(pos, cue);
+    last_end_ = std::max(last_end_, End(cue));
+    return true;
+  }
+
+  // Write the segments ending at or before time (ms)
+  void Close(std::uint64_t time) {
+    const std::size_t written = next_;
+    while ((next_ + 1) * duration_ <= time) WriteSegment();
+    if (live_ && (next_ > written)) WritePlaylist(false);
+  }
+
+  // Write the segments left, up to the end of the last cue, and end the
+  // playlist
+  void Finish() {
+    while ((next_ == 0) || (next_ * duration_ < last_end_)) WriteSegment();
+    WritePlaylist(true);
+  }
+
+  // Segments written
+  std::size_t segments() const { return next_; }
+
+private:
+
+  // Cues last at least 1 ms, so empty ones still land in a segment
+  static std::uint64_t End(const Cue& cue) {
+    return std::max(cue.end, cue.start + 1);
+  }
+
+  std::string SegmentName(std::size_t index) const {
+    return stem_ + StringPrintf("_%05zu.vtt", index);
+  }
+
+  // Replace path with data through a temporary file
+  static void Publish(const std::string& path, const std::string& data) {
+    const std::string temporary = path + ".tmp";
+    std::ofstream output(temporary, std::ios::binary);
+    output.write(data.data(), static_cast<std::streamsize>(data.size()));
+    output.close();
+    if (!output.good() || (std::rename(temporary.c_str(), path.c_str()) != 0)) {
+      std::remove(temporary.c_str());
+      throw ass::io_error("can't write segment or playlist");
+    }
+  }
+
+  void WriteSegment() {
+    TRACE_SPAN("write_segment");
+    const std::uint64_t begin = next_ * duration_, end = begin + duration_;
+
+    std::ostringstream data;
+    CueWriter writer(data, SubtitleFormat::VTT,
+                     StringPrintf("X-TIMESTAMP-MAP=MPEGTS:%llu,LOCAL:00:00:00.000\n",
+                                  static_cast<unsigned long long>(mpegts_)));
+    std::list<Cue>::iterator it = pending_.begin();
+    while ((it != pending_.end()) && (it->start < end)) {
+      if (End(*it) > begin) writer.Write(*it);
+      if (End(*it) <= end) it = pending_.erase(it);
+      else ++it;
+    }
+
+    Publish(directory_ + SegmentName(next_), data.str());
+    next_++;
+  }
+
+  void WritePlaylist(bool ended) {
+    std::string data = "#EXTM3U\n#EXT-X-VERSION:3\n";
+    data += StringPrintf("#EXT-X-TARGETDURATION:%llu\n", static_cast<unsigned long long>((duration_ + 999) / 1000));
+    data += "#EXT-X-MEDIA-SEQUENCE:0\n";
+    data += live_ ? "#EXT-X-PLAYLIST-TYPE:EVENT\n" : "#EXT-X-PLAYLIST-TYPE:VOD\n";
+    for (std::size_t i = 0; i < next_; ++i) {
+      data += StringPrintf("#EXTINF:%llu.%03llu,\n", static_cast<unsigned long long>(duration_ / 1000),
+                           static_cast<unsigned long long>(duration_ % 1000));
+      data += SegmentName(i) + "\n";
+    }
+    if (ended) data += "#EXT-X-ENDLIST\n";
+    Publish(playlist_, data);
+  }
+
+  std::string playlist_;
+  std::string directory_;  // Including the final slash, if any
+  std::string stem_;
+  std::uint64_t duration_; // ms
+  std::uint64_t mpegts_;
+  bool live_;
+
+  std::list<Cue> pending_; // Cues of the open segments
+  std::size_t next_;       // First open segment
+  std::uint64_t last_end_;
+};
+
+} // namespace ass
+
+#endif // OPS_SEGMENT_HPP_
@@ -0,0 +1,158 @@
+// Sort ASS subtitles events
+// Copyright (c) 2019 Slek
+
+#ifndef OPS_SORT_HPP_
+#define OPS_SORT_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "schema.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+// Start of an event, false when the field is empty. fields is scratch space
+// for the split line.
+inline bool event_start(const EventSchema& schema, const std::string& line_data, EventFields* fields, ass::time_t* start_ts) {
+  schema.split(line_data, fields);
+  const FieldRange& start = (*fields)[EventField::START];
+  if (!start.found())
+    throw ass::io_error("'Start' field cannot be retrieved");
+  if (start.empty()) return false;
+
+  *start_ts = ass::parse_time(line_data.data() + start.begin, line_data.data() + start.end);
+  return true;
+}
+
+inline void sort(const ass::ASSFile& ass, ass::ASSFile& out) {
+  TRACE_SPAN("sort");
+  out.clear();
+
+  out.BOM() = ass.BOM();
+  out.ScriptComment() = ass.ScriptComment();
+  out.copy_layout(ass);
+
+  bool has_events = false;
+  std::map<ass::time_t, std::list<std::pair<std::string, std::string>>> event_lines;
+  for (const std::string& section : ass.Sections()) {
+    TRACE_SPAN_DETAIL("section", section);
+    if (section == ass::EVENTS) {
+      has_events = true;
+
+      const std::list<std::pair<std::string, std::string>>& lines = ass.Section(ass::EVENTS);
+
+      std::list<std::pair<std::string, std::string>>::const_iterator it = lines.cbegin();
+      if (it == lines.cend()) continue;
+
+      const std::pair<std::string, std::string>& format_line = *it;
+      out.add_line(ass::EVENTS, format_line.first, format_line.second);
+      ++it;
+
+      if (format_line.first != "Format")
+        throw ass::io_error("format line must appear first in events");
+
+      const EventSchema schema(format_line.second);
+      if (!schema.text_last())
+        throw ass::io_error("'Text' field must appear in last place");
+
+      if (!schema.has(EventField::START))
+        throw ass::io_error("'Start' field not found in format definition string");
+
+      TRACE_SPAN("timestamps");
+      ALLOC_EVENTS(std::distance(it, lines.cend()));
+      EventFields fields;
+      for (; it != lines.cend(); ++it) {
+        const std::string& line_type = it->first;
+        const std::string& line_data = it->second;
+
+        ass::time_t start_ts = std::numeric_limits<ass::time_t>::max();
+        const bool start_defined = event_start(schema, line_data, &fields, &start_ts);
+
+        if (!start_defined) {
+          out.add_line(ass::EVENTS, line_type, line_data);
+          continue;
+        }
+
+        event_lines[start_ts].push_back(std::make_pair(line_type, line_data));
+      }
+    } else {
+      out.share(section, ass);
+    }
+  }
+
+  if (!has_events)
+    std::cerr << "[WARNING] Events section not found!" << std::endl;
+  else {
+    for (const std::pair<const ass::time_t, std::list<std::pair<std::string, std::string>>>& entry : event_lines) {
+      for (const std::pair<std::string, std::string>& line : entry.second)
+        out.add_line(ass::EVENTS, line.first, line.second);
+    }
+  }
+}
+
+// Same, consuming ass: its lines are moved to out and the events relinked in
+// order, so no line is copied
+inline void sort(ass::ASSFile&& ass, ass::ASSFile& out) {
+  TRACE_SPAN("sort");
+  out = std::move(ass);
+  ass.clear();
+
+  if (out.Sections().find(ass::EVENTS) == out.Sections().end()) {
+    std::cerr << "[WARNING] Events section not found!" << std::endl;
+    return;
+  }
+  if (!out.HasSection(ass::EVENTS)) return;
+
+  std::list<std::pair<std::string, std::string>>& lines = out.Section(ass::EVENTS);
+  const std::pair<std::string, std::string>& format_line = lines.front();
+  if (format_line.first != "Format")
+    throw ass::io_error("format line must appear first in events");
+
+  const EventSchema schema(format_line.second);
+  if (!schema.text_last())
+    throw ass::io_error("'Text' field must appear in last place");
+
+  if (!schema.has(EventField::START))
+    throw ass::io_error("'Start' field not found in format definition string");
+
+  // Events without Start stay in place, right after the Format line
+  std::map<ass::time_t, std::list<std::pair<std::string, std::string>>> event_lines;
+  {
+    TRACE_SPAN("timestamps");
+    ALLOC_EVENTS(lines.size() - 1);
+    EventFields fields;
+    std::list<std::pair<std::string, std::string>>::iterator it = std::next(lines.begin());
+    while (it != lines.end()) {
+      std::list<std::pair<std::string, std::string>>::iterator next = std::next(it);
+
+      ass::time_t start_ts = std::numeric_limits<ass::time_t>::max();
+      if (event_start(schema, it->second, &fields, &start_ts)) {
+        std::list<std::pair<std::string, std::string>>& bucket = event_lines[start_ts];
+        bucket.splice(bucket.end(), lines, it);
+      }
+      it = next;
+    }
+  }
+
+  for (std::pair<const ass::time_t, std::list<std::pair<std::string, std::string>>>& entry : event_lines)
+    lines.splice(lines.end(), entry.second);
+}
+
+} // namespace ass
+
+#endif // OPS_SORT_HPP_
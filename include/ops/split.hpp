@@ -0,0 +1,184 @@
+// Split ASS subtitles
+// Copyright (c) 2019 Slek
+
+#ifndef OPS_SPLIT_HPP_
+#define OPS_SPLIT_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "columns.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+// Append the events in [first, last) starting before t to out1, and the ones
+// starting at or after t, moved back by t, to out2. Events without start go
+// to both. format is the data of the Format line.
+inline void split_events(const std::string& format, std::list<std::pair<std::string, std::string>>::const_iterator first,
+                         std::list<std::pair<std::string, std::string>>::const_iterator last, const ass::time_t t,
+                         std::list<std::pair<std::string, std::string>>& out1,
+                         std::list<std::pair<std::string, std::string>>& out2) {
+  std::size_t text_idx = std::numeric_limits<std::size_t>::max();
+  if (!ass::get_field_index(format, "Text", &text_idx) ||
+       (text_idx != (StringSplit(format, ass::FIELD_DELIMITER).size()-1)))
+    throw ass::io_error("'Text' field must appear in last place");
+
+  ass::EventColumns columns(format, first, last);
+  columns.drop_end_without_start();
+
+  std::vector<std::uint8_t> after;
+  columns.rebase(static_cast<ass::time_signed_t>(t), &after);
+
+  TRACE_SPAN("render");
+  ALLOC_EVENTS(columns.size());
+  for (std::size_t i = 0; i < columns.size(); ++i) {
+    bool add1 = true, add2 = true;
+    if (columns.start_defined(i)) {
+      if (after[i]) {
+        add1 = false;
+      } else {
+        add2 = false;
+        if (columns.end_defined(i) && (columns.end[i] > static_cast<ass::time_signed_t>(t)))
+          std::cerr << "[WARNING] Lossy split!" << std::endl;
+      }
+    }
+
+    const std::string event_data = columns.render(i);
+    if (add1)
+      out1.push_back(std::make_pair(columns.type(i), event_data));
+    if (add2)
+      out2.push_back(std::make_pair(columns.type(i), event_data));
+  }
+}
+
+// Same, in place: the events from first to the end of lines starting at or
+// after t are moved back by t and relinked to out2, the others stay. Only the
+// events without start, which go to both, are copied.
+inline void split_events_in_place(const std::string& format, std::list<std::pair<std::string, std::string>>& lines,
+                                  std::list<std::pair<std::string, std::string>>::iterator first, const ass::time_t t,
+                                  std::list<std::pair<std::string, std::string>>& out2) {
+  std::size_t text_idx = std::numeric_limits<std::size_t>::max();
+  if (!ass::get_field_index(format, "Text", &text_idx) ||
+       (text_idx != (StringSplit(format, ass::FIELD_DELIMITER).size()-1)))
+    throw ass::io_error("'Text' field must appear in last place");
+
+  ass::EventColumns columns(format, first, lines.end());
+  columns.drop_end_without_start();
+
+  std::vector<std::uint8_t> after;
+  columns.rebase(static_cast<ass::time_signed_t>(t), &after);
+
+  TRACE_SPAN("update");
+  ALLOC_EVENTS(columns.size());
+  std::size_t i = 0;
+  for (std::list<std::pair<std::string, std::string>>::iterator it = first; it != lines.end(); ++i) {
+    std::list<std::pair<std::string, std::string>>::iterator next = std::next(it);
+    columns.update(i, &it->second);
+
+    if (!columns.start_defined(i)) {
+      out2.push_back(*it);
+    } else if (after[i]) {
+      out2.splice(out2.end(), lines, it);
+    } else if (columns.end_defined(i) && (columns.end[i] > static_cast<ass::time_signed_t>(t))) {
+      std::cerr << "[WARNING] Lossy split!" << std::endl;
+    }
+    it = next;
+  }
+}
+
+inline void split(const ass::ASSFile& ass, const ass::time_t t, ass::ASSFile& first, ass::ASSFile& second) {
+  TRACE_SPAN("split");
+  first.clear();
+  second.clear();
+
+  first.BOM() = ass.BOM();
+  second.BOM() = ass.BOM();
+
+  first.ScriptComment() = ass.ScriptComment();
+  second.ScriptComment() = ass.ScriptComment();
+
+  first.copy_layout(ass);
+  second.copy_layout(ass);
+
+  bool has_events = false;
+  for (const std::string& section : ass.Sections()) {
+    TRACE_SPAN_DETAIL("section", section);
+    if (section == ass::EVENTS) {
+      has_events = true;
+
+      const std::list<std::pair<std::string, std::string>>& lines = ass.Section(ass::EVENTS);
+
+      std::list<std::pair<std::string, std::string>>::const_iterator it = lines.cbegin();
+      if (it == lines.cend()) continue;
+
+      const std::pair<std::string, std::string>& format_line = *it;
+      first.add_line(ass::EVENTS, format_line.first, format_line.second);
+      second.add_line(ass::EVENTS, format_line.first, format_line.second);
+      ++it;
+
+      if (format_line.first != "Format")
+        throw ass::io_error("format line must appear first in events");
+
+      split_events(format_line.second, it, lines.cend(), t, first.Section(ass::EVENTS), second.Section(ass::EVENTS));
+    } else {
+      first.share(section, ass);
+      second.share(section, ass);
+    }
+  }
+
+  if (!has_events)
+    std::cerr << "[WARNING] Events section not found!" << std::endl;
+}
+
+// Same, consuming ass: first takes over its lines, and the events of the
+// second part are moved from them to second
+inline void split(ass::ASSFile&& ass, const ass::time_t t, ass::ASSFile& first, ass::ASSFile& second) {
+  TRACE_SPAN("split");
+  first = std::move(ass);
+  ass.clear();
+  second.clear();
+
+  second.BOM() = first.BOM();
+  second.ScriptComment() = first.ScriptComment();
+  second.copy_layout(first);
+
+  bool has_events = false;
+  for (const std::string& section : first.Sections()) {
+    TRACE_SPAN_DETAIL("section", section);
+    if (section == ass::EVENTS) {
+      has_events = true;
+      if (!first.HasSection(ass::EVENTS)) continue;
+
+      std::list<std::pair<std::string, std::string>>& lines = first.Section(ass::EVENTS);
+      const std::pair<std::string, std::string>& format_line = lines.front();
+      second.add_line(ass::EVENTS, format_line.first, format_line.second);
+
+      if (format_line.first != "Format")
+        throw ass::io_error("format line must appear first in events");
+
+      split_events_in_place(format_line.second, lines, std::next(lines.begin()), t, second.Section(ass::EVENTS));
+    } else {
+      second.share(section, first);
+    }
+  }
+
+  if (!has_events)
+    std::cerr << "[WARNING] Events section not found!" << std::endl;
+}
+
+} // namespace ass
+
+#endif // OPS_SPLIT_HPP_
@@ -0,0 +1,274 @@
+// Linear transformation of ASS subtitles events
+// Copyright (c) 2019 Slek
+
+#ifndef OPS_TIME_HPP_
+#define OPS_TIME_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "columns.hpp"
+#include "intern.hpp"
+#include "tags.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+namespace detail {
+
+// Numeric value of a tag argument, surrounding spaces allowed. Parsed from a
+// copy on the stack, as the span isn't null terminated.
+inline bool parse_tag_number(const ass::TextSpan& arg, double* value) {
+  const ass::TextSpan number = ass::trim_span(arg.begin(), arg.end());
+  char buffer[64];
+  if ((number.size == 0) || (number.size >= sizeof(buffer))) return false;
+  std::memcpy(buffer, number.data, number.size);
+  buffer[number.size] = '\0';
+
+  char* end = nullptr;
+  *value = std::strtod(buffer, &end);
+  return (end == buffer + number.size) && std::isfinite(*value);
+}
+
+inline void append_scaled_args(const ass::TextSpan* args, std::size_t num_args, std::size_t first_time, std::size_t num_times, double scale, std::string* out) {
+  for (std::size_t i = 0; i < num_args; ++i) {
+    if (i) out->push_back(',');
+    double value;
+    if ((i >= first_time) && (i < first_time + num_times) && parse_tag_number(args[i], &value))
+      *out += std::to_string(std::llround(value * scale));
+    else
+      out->append(args[i].data, args[i].size);
+  }
+}
+
+} // namespace detail
+
+// Quick test for \k, \K, \t(...), \move(...) and \fad(e)(...) tags
+inline bool has_timed_tags(const ass::TextSpan& text) {
+  if (!ass::has_override_blocks(text.data, text.size)) return false;
+
+  const char* end = text.end();
+  for (const char* it = text.begin(); (it = ass::detail::find(it, end, '\\')) < end; ++it) {
+    const std::size_t left = static_cast<std::size_t>(end - it);
+    if (left < 2) break;
+    switch (it[1]) {
+      case 'k': case 'K': return true;
+      case 't': if ((left > 2) && (it[2] == '(')) return true; break;
+      case 'm': if ((left > 5) && (std::memcmp(it + 1, "move", 4) == 0)) return true; break;
+      case 'f': if ((left > 4) && (std::memcmp(it + 1, "fad", 3) == 0)) return true; break;
+      default: break;
+    }
+  }
+
+  return false;
+}
+
+// Scale the relative times carried by tags inside an event text: karaoke
+// durations (\k, \K, \kf, \ko, in centiseconds), \t(t1,t2,...),
+// \move(...,t1,t2) and \fad(t1,t2) / \fade(...,t1,t2,t3,t4) (milliseconds).
+// Karaoke syllables are scaled on their cumulative start so rounding doesn't
+// drift along the line. Returns false (leaving out untouched) when nothing
+// changes.
+inline bool scale_tag_times(const ass::TextSpan& text, double scale, std::string* out) {
+  if (!has_timed_tags(text)) return false;
+
+  double karaoke_sum = 0.;
+  long long karaoke_scaled = 0;
+
+  return ass::rewrite_tags(text.data, text.size, [&](const ass::TextToken& tag, std::string* dst) {
+    const ass::TextSpan& name = tag.name;
+    double value;
+
+    if (name.equals("k") || name.equals("K") || name.equals("kf") || name.equals("ko")) {
+      if (tag.parenthesized || !detail::parse_tag_number(tag.args, &value)) return false;
+      karaoke_sum += value;
+      const long long end = std::llround(karaoke_sum * scale);
+      dst->push_back('\\');
+      dst->append(name.data, name.size);
+      *dst += std::to_string(end - karaoke_scaled);
+      karaoke_scaled = end;
+      return true;
+    }
+
+    if (!tag.parenthesized) return false;
+
+    ass::TextSpan args[8];
+    const std::size_t num_args = ass::split_tag_args(tag.args, args, 8);
+    if (num_args > 8) return false;
+
+    std::size_t first_time = 0, num_times = 0;
+    if (name.equals("t")) {
+      // \t([t1,t2,][accel,]tags)
+      if ((num_args >= 3) && detail::parse_tag_number(args[0], &value) && detail::parse_tag_number(args[1], &value)) num_times = 2;
+    } else if (name.equals("move")) {
+      if (num_args == 6) { first_time = 4; num_times = 2; }
+    } else if (name.equals("fad")) {
+      if (num_args == 2) num_times = 2;
+    } else if (name.equals("fade")) {
+      if (num_args == 7) { first_time = 3; num_times = 4; }
+    }
+    if (num_times == 0) return false;
+
+    dst->push_back('\\');
+    dst->append(name.data, name.size);
+    dst->push_back('(');
+    detail::append_scaled_args(args, num_args, first_time, num_times, scale, dst);
+    dst->push_back(')');
+    return true;
+  }, out);
+}
+
+namespace detail {
+
+// Index of the Text field of format, which must be the last one
+inline std::size_t text_field_index(const std::string& format) {
+  std::size_t text_idx = std::numeric_limits<std::size_t>::max();
+  if (!ass::get_field_index(format, "Text", &text_idx) ||
+       (text_idx != (StringSplit(format, ass::FIELD_DELIMITER).size()-1)))
+    throw ass::io_error("'Text' field must appear in last place");
+  return text_idx;
+}
+
+inline void transform_columns(ass::EventColumns& columns, const ass::time_signed_t offset, const ass::Ratio& scale) {
+  columns.drop_end_without_start();
+
+  if (!columns.scale(scale) || !columns.shift(offset))
+    throw std::runtime_error("Transformation overflows timestamps!");
+  if (!columns.check(0, static_cast<ass::time_signed_t>(ass::MAX_TIMESTAMP)))
+    throw std::runtime_error("Transformation yields negative or too long timestamps!");
+}
+
+} // namespace detail
+
+// Transform the events in [first, last), described by format (the data of
+// the Format line), appending them to out
+inline void transform_events(const std::string& format, std::list<std::pair<std::string, std::string>>::const_iterator first,
+                             std::list<std::pair<std::string, std::string>>::const_iterator last,
+                             const ass::time_signed_t offset, const ass::Ratio& scale,
+                             std::list<std::pair<std::string, std::string>>& out, bool scale_tags = false) {
+  const std::size_t text_idx = detail::text_field_index(format);
+
+  ass::EventColumns columns(format, first, last);
+  detail::transform_columns(columns, offset, scale);
+
+  scale_tags = scale_tags && !scale.is_one();
+  std::string scaled_text;
+
+  TRACE_SPAN("render");
+  ALLOC_EVENTS(columns.size());
+  for (std::size_t i = 0; i < columns.size(); ++i) {
+    std::string event_data = columns.render(i);
+
+    // Text comes last, so it sits at the very end of the rebuilt line
+    ass::TextSpan text;
+    if (scale_tags && ass::get_text(columns.data(i), text_idx, &text) && scale_tag_times(text, scale.value(), &scaled_text))
+      event_data.replace(event_data.size() - text.size, text.size, scaled_text);
+
+    out.push_back(std::make_pair(columns.type(i), std::move(event_data)));
+  }
+}
+
+// Transform the events in [first, last), described by format, in place: only
+// the fields whose values change are rewritten, the rest of every line stays
+// where it is
+inline void transform_events_in_place(const std::string& format, std::list<std::pair<std::string, std::string>>::iterator first,
+                                      std::list<std::pair<std::string, std::string>>::iterator last,
+                                      const ass::time_signed_t offset, const ass::Ratio& scale, bool scale_tags = false) {
+  const std::size_t text_idx = detail::text_field_index(format);
+
+  ass::EventColumns columns(format, first, last);
+  detail::transform_columns(columns, offset, scale);
+
+  scale_tags = scale_tags && !scale.is_one();
+  std::string scaled_text;
+
+  TRACE_SPAN("update");
+  ALLOC_EVENTS(columns.size());
+  std::size_t i = 0;
+  for (std::list<std::pair<std::string, std::string>>::iterator it = first; it != last; ++it, ++i) {
+    std::string& event_data = it->second;
+    columns.update(i, &event_data);
+
+    ass::TextSpan text;
+    if (scale_tags && ass::get_text(event_data, text_idx, &text) && scale_tag_times(text, scale.value(), &scaled_text))
+      event_data.replace(event_data.size() - text.size, text.size, scaled_text);
+  }
+}
+
+inline void transform(const ass::ASSFile& ass_in, const ass::time_signed_t offset, const ass::Ratio& scale, ass::ASSFile& ass_out, bool scale_tags = false) {
+  TRACE_SPAN("transform");
+  ass_out.clear();
+
+  ass_out.BOM() = ass_in.BOM();
+
+  ass_out.ScriptComment() = ass_in.ScriptComment();
+  ass_out.copy_layout(ass_in);
+
+  bool has_events = false;
+  for (const std::string& section : ass_in.Sections()) {
+    TRACE_SPAN_DETAIL("section", section);
+    if (section == ass::EVENTS) {
+      has_events = true;
+
+      const std::list<std::pair<std::string, std::string>>& lines = ass_in.Section(ass::EVENTS);
+
+      std::list<std::pair<std::string, std::string>>::const_iterator it = lines.cbegin();
+      if (it == lines.cend()) continue;
+
+      const std::pair<std::string, std::string>& format_line = *it;
+      if (format_line.first != "Format")
+        throw ass::io_error("format line must appear first in events");
+
+      ass_out.add_line(ass::EVENTS, format_line.first, format_line.second);
+      ++it;
+
+      transform_events(format_line.second, it, lines.cend(), offset, scale, ass_out.Section(ass::EVENTS), scale_tags);
+    } else {
+      ass_out.share(section, ass_in);
+    }
+  }
+
+  if (!has_events)
+    std::cerr << "[WARNING] Events section not found!" << std::endl;
+}
+
+// Same, consuming ass_in: its lines are moved to ass_out and the events are
+// transformed in place, so only the fields that change are reallocated
+inline void transform(ass::ASSFile&& ass_in, const ass::time_signed_t offset, const ass::Ratio& scale, ass::ASSFile& ass_out, bool scale_tags = false) {
+  TRACE_SPAN("transform");
+  ass_out = std::move(ass_in);
+  ass_in.clear();
+
+  if (ass_out.Sections().find(ass::EVENTS) == ass_out.Sections().end()) {
+    std::cerr << "[WARNING] Events section not found!" << std::endl;
+    return;
+  }
+  if (!ass_out.HasSection(ass::EVENTS)) return;
+
+  std::list<std::pair<std::string, std::string>>& lines = ass_out.Section(ass::EVENTS);
+  const std::pair<std::string, std::string>& format_line = lines.front();
+  if (format_line.first != "Format")
+    throw ass::io_error("format line must appear first in events");
+
+  transform_events_in_place(format_line.second, std::next(lines.begin()), lines.end(), offset, scale, scale_tags);
+}
+
+} // namespace ass
+
+#endif // OPS_TIME_HPP_
@@ -0,0 +1,215 @@
+// Event line schemas
+// Copyright (c) 2019 Slek
+//
+// EventSchema describes the fields of the event lines from the data of the
+// [Events] Format line, and splits event lines into field ranges in one
+// pass. The standard V4+ and V4 layouts are StaticSchema instances: their
+// field order is a template parameter pack, so splitting them unrolls into
+// a fixed sequence of comma searches. Any other Format line uses the
+// generic, table driven split.
+
+#ifndef SCHEMA_HPP_
+#define SCHEMA_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ass.hpp"
+#include "util/string.h"
+
+namespace ass {
+
+enum class EventField : std::uint8_t {
+  LAYER,
+  MARKED,
+  START,
+  END,
+  STYLE,
+  NAME,
+  MARGIN_L,
+  MARGIN_R,
+  MARGIN_V,
+  EFFECT,
+  TEXT,
+  UNKNOWN
+};
+
+const std::size_t EVENT_FIELD_COUNT = static_cast<std::size_t>(EventField::UNKNOWN);
+
+// Name of a field in the Format line
+inline const char* event_field_name(EventField field) {
+  switch (field) {
+    case EventField::LAYER: return "Layer";
+    case EventField::MARKED: return "Marked";
+    case EventField::START: return "Start";
+    case EventField::END: return "End";
+    case EventField::STYLE: return "Style";
+    case EventField::NAME: return "Name";
+    case EventField::MARGIN_L: return "MarginL";
+    case EventField::MARGIN_R: return "MarginR";
+    case EventField::MARGIN_V: return "MarginV";
+    case EventField::EFFECT: return "Effect";
+    case EventField::TEXT: return "Text";
+    case EventField::UNKNOWN: break;
+  }
+  return "";
+}
+
+// Range [begin, end) of a field in the line data, untrimmed
+struct FieldRange {
+  std::string::size_type begin = std::string::npos;
+  std::string::size_type end = std::string::npos;
+
+  bool found() const { return begin != std::string::npos; }
+  bool empty() const { return begin >= end; }
+};
+
+// Ranges of the known fields of an event line
+struct EventFields {
+  FieldRange field[EVENT_FIELD_COUNT];
+
+  const FieldRange& operator[](EventField f) const { return field[static_cast<std::size_t>(f)]; }
+  FieldRange& operator[](EventField f) { return field[static_cast<std::size_t>(f)]; }
+
+  void clear() {
+    for (FieldRange& range : field) range = FieldRange();
+  }
+};
+
+namespace detail {
+
+// The last field takes the rest of the line, commas included
+template <EventField Last>
+inline bool split_fields(const char*, std::size_t size, std::size_t pos, EventFields* fields) {
+  (*fields)[Last].begin = pos;
+  (*fields)[Last].end = size;
+  return true;
+}
+
+template <EventField First, EventField Next, EventField... Rest>
+inline bool split_fields(const char* data, std::size_t size, std::size_t pos, EventFields* fields) {
+  const char* comma = static_cast<const char*>(std::memchr(data + pos, ',', size - pos));
+  (*fields)[First].begin = pos;
+  if (!comma) {
+    (*fields)[First].end = size;
+    return false;
+  }
+  (*fields)[First].end = static_cast<std::size_t>(comma - data);
+  return split_fields<Next, Rest...>(data, size, (*fields)[First].end + 1, fields);
+}
+
+} // namespace detail
+
+template <EventField... Fields>
+struct StaticSchema {
+  static const std::size_t SIZE = sizeof...(Fields);
+
+  // Whether format (split into trimmed names) is this layout
+  static bool Matches(const std::vector<std::string>& names) {
+    static const EventField FIELDS[] = {Fields...};
+    if (names.size() != SIZE) return false;
+    for (std::size_t i = 0; i < SIZE; ++i)
+      if (names[i] != event_field_name(FIELDS[i])) return false;
+    return true;
+  }
+
+  static bool Split(const std::string& data, EventFields* fields) {
+    return detail::split_fields<Fields...>(data.data(), data.size(), 0, fields);
+  }
+};
+
+typedef StaticSchema<EventField::LAYER, EventField::START, EventField::END, EventField::STYLE, EventField::NAME,
+                     EventField::MARGIN_L, EventField::MARGIN_R, EventField::MARGIN_V, EventField::EFFECT,
+                     EventField::TEXT> V4PlusSchema;
+
+typedef StaticSchema<EventField::MARKED, EventField::START, EventField::END, EventField::STYLE, EventField::NAME,
+                     EventField::MARGIN_L, EventField::MARGIN_R, EventField::MARGIN_V, EventField::EFFECT,
+                     EventField::TEXT> V4Schema;
+
+class EventSchema {
+public:
+
+  enum Layout { GENERIC, V4PLUS, V4 };
+
+  // Schema of the data of a Format line
+  explicit EventSchema(const std::string& format) {
+    std::vector<std::string> names = StringSplit(format, ass::FIELD_DELIMITER);
+    for (std::string& name : names) StringTrim(&name);
+
+    if (V4PlusSchema::Matches(names)) layout_ = V4PLUS;
+    else if (V4Schema::Matches(names)) layout_ = V4;
+    else layout_ = GENERIC;
+
+    for (std::size_t i = 0; i < EVENT_FIELD_COUNT; ++i) index_[i] = NO_INDEX;
+    fields_.resize(names.size(), EventField::UNKNOWN);
+    for (std::size_t i = 0; i < names.size(); ++i) {
+      // The first of duplicated names is used, as get_field_index does
+      for (std::size_t f = 0; f < EVENT_FIELD_COUNT; ++f) {
+        if ((names[i] != event_field_name(static_cast<EventField>(f))) || (index_[f] != NO_INDEX)) continue;
+        index_[f] = i;
+        fields_[i] = static_cast<EventField>(f);
+      }
+    }
+  }
+
+  Layout layout() const { return layout_; }
+
+  // Number of fields
+  std::size_t size() const { return fields_.size(); }
+
+  bool has(EventField field) const { return index_[static_cast<std::size_t>(field)] != NO_INDEX; }
+
+  std::size_t index(EventField field) const { return index_[static_cast<std::size_t>(field)]; }
+
+  // Whether Text is the last field, as required to keep commas in it
+  bool text_last() const { return has(EventField::TEXT) && (index(EventField::TEXT) + 1 == size()); }
+
+  // Split an event line into *fields. Fields missing from the line (too few
+  // commas) are not found; returns false in that case.
+  bool split(const std::string& data, EventFields* fields) const {
+    fields->clear();
+    switch (layout_) {
+      case V4PLUS: return V4PlusSchema::Split(data, fields);
+      case V4: return V4Schema::Split(data, fields);
+      case GENERIC: break;
+    }
+    return SplitGeneric(data, fields);
+  }
+
+private:
+
+  static const std::size_t NO_INDEX = static_cast<std::size_t>(-1);
+
+  bool SplitGeneric(const std::string& data, EventFields* fields) const {
+    std::size_t pos = 0;
+    for (std::size_t i = 0; i < fields_.size(); ++i) {
+      std::size_t end = data.size();
+      bool last = (i + 1 == fields_.size());
+      if (!last) {
+        end = data.find(',', pos);
+        if (end == std::string::npos) {
+          end = data.size();
+          last = true;
+        }
+      }
+      if (fields_[i] != EventField::UNKNOWN) {
+        (*fields)[fields_[i]].begin = pos;
+        (*fields)[fields_[i]].end = end;
+      }
+      if (last) return i + 1 == fields_.size();
+      pos = end + 1;
+    }
+    return true;
+  }
+
+  Layout layout_;
+  std::size_t index_[EVENT_FIELD_COUNT];
+  std::vector<EventField> fields_;
+};
+
+} // namespace ass
+
+#endif // SCHEMA_HPP_
@@ -0,0 +1,328 @@
+// Override tags tokenizer for the Text field of ASS events
+// Copyright (c) 2019 Slek
+//
+// The tokenizer walks a Text field and yields text runs, override block
+// boundaries, tags (name and argument spans) and block comments, e.g.
+//
+//   {\pos(10,20)\k50}Hello  ->  BLOCK_BEGIN, TAG pos(10,20), TAG k 50,
+//                               BLOCK_END, TEXT "Hello"
+//
+// Tokens are views into the original buffer, so tokenizing never allocates.
+// Boundaries ('{', '}', '\\', parentheses) are located 16 bytes at a time
+// with SSE2 when available.
+
+#ifndef TAGS_HPP_
+#define TAGS_HPP_
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#include "ass.hpp"
+
+namespace ass {
+
+// Non-owning view of a character range
+struct TextSpan {
+  const char* data;
+  std::size_t size;
+
+  TextSpan()
+    : data(nullptr), size(0) { }
+
+  TextSpan(const char* data, std::size_t size)
+    : data(data), size(size) { }
+
+  TextSpan(const char* begin, const char* end)
+    : data(begin), size(static_cast<std::size_t>(end - begin)) { }
+
+  const char* begin() const { return data; }
+  const char* end() const { return data + size; }
+  bool empty() const { return size == 0; }
+
+  bool equals(const char* str) const {
+    return (std::strlen(str) == size) && (std::memcmp(data, str, size) == 0);
+  }
+
+  std::string str() const { return std::string(data, size); }
+};
+
+enum class TokenType {
+  TEXT,        // Plain text outside override blocks
+  BLOCK_BEGIN, // '{'
+  BLOCK_END,   // '}'
+  TAG,         // '\name args' or '\name(args)'
+  COMMENT      // Anything else inside an override block
+};
+
+struct TextToken {
+  TokenType type;
+  TextSpan text;       // Whole source range of the token
+  TextSpan name;       // TAG only: tag name, e.g. "pos", "k", "1c"
+  TextSpan args;       // TAG only: arguments, without parentheses
+  bool parenthesized;  // TAG only: arguments were given as (...)
+};
+
+namespace detail {
+
+// First position in [begin, end) holding c0, c1 or c2 (end if none)
+inline const char* find_first_of(const char* begin, const char* end, char c0, char c1, char c2) {
+#if defined(__SSE2__)
+  const __m128i v0 = _mm_set1_epi8(c0);
+  const __m128i v1 = _mm_set1_epi8(c1);
+  const __m128i v2 = _mm_set1_epi8(c2);
+  while (end - begin >= 16) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    const __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, v0), _mm_cmpeq_epi8(chunk, v1)),
+                                      _mm_cmpeq_epi8(chunk, v2));
+    const int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) return begin + __builtin_ctz(static_cast<unsigned>(mask));
+    begin += 16;
+  }
+#endif
+  for (; begin < end; ++begin)
+    if ((*begin == c0) || (*begin == c1) || (*begin == c2)) return begin;
+  return end;
+}
+
+inline const char* find(const char* begin, const char* end, char c) {
+  return find_first_of(begin, end, c, c, c);
+}
+
+inline bool is_lower(char c) { return (c >= 'a') && (c <= 'z'); }
+inline bool is_digit(char c) { return (c >= '0') && (c <= '9'); }
+
+// End of the tag name starting at begin (just after the backslash)
+inline const char* tag_name_end(const char* begin, const char* end) {
+  if (begin == end) return begin;
+
+  // \1c, \2a, ... (colour and alpha of a given component)
+  if (is_digit(*begin)) {
+    const char* it = begin + 1;
+    while ((it < end) && is_lower(*it)) ++it;
+    return it;
+  }
+
+  // \K (karaoke) is the only upper case tag name
+  if (*begin == 'K') return begin + 1;
+
+  // \r and \fn take free-form names as arguments
+  if (*begin == 'r') return begin + 1;
+  if ((*begin == 'f') && (end - begin >= 2) && (begin[1] == 'n')) return begin + 2;
+
+  const char* it = begin;
+  while ((it < end) && is_lower(*it)) ++it;
+  return it;
+}
+
+// Matching closing parenthesis for the one just before begin (end if unbalanced)
+inline const char* closing_parenthesis(const char* begin, const char* end) {
+  unsigned depth = 1;
+  const char* it = begin;
+  while ((it = find_first_of(it, end, '(', ')', ')')) < end) {
+    if (*it == '(') depth++;
+    else if (--depth == 0) return it;
+    ++it;
+  }
+  return end;
+}
+
+} // namespace detail
+
+// Quick test for override blocks, meant to skip tokenizing plain lines
+inline bool has_override_blocks(const char* data, std::size_t size) {
+  return detail::find(data, data + size, '{') != data + size;
+}
+
+inline bool has_override_blocks(const std::string& text) {
+  return has_override_blocks(text.data(), text.size());
+}
+
+class TagTokenizer {
+public:
+
+  TagTokenizer(const char* data, std::size_t size)
+    : pos_(data), end_(data + size), block_end_(nullptr), in_block_(false), embedded_(false) { }
+
+  explicit TagTokenizer(const std::string& text)
+    : TagTokenizer(text.data(), text.size()) { }
+
+  explicit TagTokenizer(const TextSpan& text)
+    : TagTokenizer(text.data, text.size) { }
+
+  // Tokenizer for the inside of an override block, without braces. Useful
+  // to walk the tags nested in the arguments of \t(...).
+  static TagTokenizer Block(const TextSpan& inner) {
+    TagTokenizer tokenizer(inner);
+    tokenizer.in_block_ = true;
+    tokenizer.embedded_ = true;
+    tokenizer.block_end_ = tokenizer.end_;
+    return tokenizer;
+  }
+
+  bool next(TextToken* token) {
+    token->name = TextSpan();
+    token->args = TextSpan();
+    token->parenthesized = false;
+
+    if (!in_block_) {
+      if (pos_ >= end_) return false;
+
+      const char* brace = detail::find(pos_, end_, '{');
+      if (brace != pos_) {
+        return emit(token, TokenType::TEXT, brace);
+      }
+
+      const char* close = detail::find(brace + 1, end_, '}');
+      if (close == end_) {
+        // Unterminated block, rendered as text
+        return emit(token, TokenType::TEXT, end_);
+      }
+
+      block_end_ = close;
+      in_block_ = true;
+      return emit(token, TokenType::BLOCK_BEGIN, brace + 1);
+    }
+
+    if (pos_ >= block_end_) {
+      if (embedded_) return false;
+      in_block_ = false;
+      return emit(token, TokenType::BLOCK_END, block_end_ + 1);
+    }
+
+    if (*pos_ != '\\') {
+      return emit(token, TokenType::COMMENT, detail::find(pos_, block_end_, '\\'));
+    }
+
+    const char* name_begin = pos_ + 1;
+    const char* name_end = detail::tag_name_end(name_begin, block_end_);
+    token->name = TextSpan(name_begin, name_end);
+
+    const char* tag_end;
+    if ((name_end < block_end_) && (*name_end == '(')) {
+      const char* close = detail::closing_parenthesis(name_end + 1, block_end_);
+      token->args = TextSpan(name_end + 1, close);
+      token->parenthesized = true;
+      tag_end = (close < block_end_) ? close + 1 : close;
+    } else {
+      tag_end = detail::find(name_end, block_end_, '\\');
+      token->args = TextSpan(name_end, tag_end);
+    }
+
+    return emit(token, TokenType::TAG, tag_end);
+  }
+
+private:
+
+  bool emit(TextToken* token, TokenType type, const char* token_end) {
+    token->type = type;
+    token->text = TextSpan(pos_, token_end);
+    pos_ = token_end;
+    return true;
+  }
+
+  const char* pos_;
+  const char* end_;
+  const char* block_end_;
+  bool in_block_;
+  bool embedded_;
+};
+
+// Split tag arguments on commas into at most max_args spans, returns the
+// number of arguments found (which may exceed max_args)
+inline std::size_t split_tag_args(const TextSpan& args, TextSpan* out, std::size_t max_args) {
+  if (args.empty()) return 0;
+
+  std::size_t count = 0;
+  const char* begin = args.begin();
+  for (;;) {
+    // Commas inside nested parentheses, as in \t(0,100,\clip(0,0,1,1)), don't split
+    const char* it = begin;
+    unsigned depth = 0;
+    for (; it < args.end(); ++it) {
+      if (*it == '(') depth++;
+      else if ((*it == ')') && depth) depth--;
+      else if ((*it == ',') && !depth) break;
+    }
+
+    if (count < max_args) out[count] = TextSpan(begin, it);
+    count++;
+    if (it == args.end()) return count;
+    begin = it + 1;
+  }
+}
+
+// Text field of an event line, given the index of 'Text' in the format line
+// (always the last field)
+inline bool get_text(const std::string& line_data, std::size_t text_idx, TextSpan* text) {
+  std::string::size_type text_begin, text_end;
+  if (!ass::get_field(line_data, text_idx, &text_begin, &text_end)) {
+    // Empty text at the end of the line
+    if (text_begin != line_data.size()) return false;
+  }
+  *text = TextSpan(line_data.data() + text_begin, line_data.data() + line_data.size());
+  return true;
+}
+
+// Text with every override block removed
+inline void strip_tags(const char* data, std::size_t size, std::string* out) {
+  out->clear();
+  TagTokenizer tokenizer(data, size);
+  TextToken token;
+  while (tokenizer.next(&token))
+    if (token.type == TokenType::TEXT) out->append(token.text.data, token.text.size);
+}
+
+inline std::string strip_tags(const std::string& text) {
+  std::string out;
+  strip_tags(text.data(), text.size(), &out);
+  return out;
+}
+
+// Call func(const TextToken&) for every tag, including tags nested in \t(...)
+template <typename Func>
+void for_each_tag(const TextSpan& text, Func&& func, bool block = false) {
+  TagTokenizer tokenizer = block ? TagTokenizer::Block(text) : TagTokenizer(text);
+  TextToken token;
+  while (tokenizer.next(&token)) {
+    if (token.type != TokenType::TAG) continue;
+    func(token);
+    if (token.name.equals("t") && token.parenthesized)
+      for_each_tag(token.args, func, true);
+  }
+}
+
+// Rebuild text, letting rewrite(const TextToken& tag, std::string* out)
+// append a replacement for a tag (returning true) or keep it (returning
+// false). Returns true when any tag was replaced. Lines without override
+// blocks are copied without tokenizing.
+template <typename Func>
+bool rewrite_tags(const char* data, std::size_t size, Func&& rewrite, std::string* out) {
+  out->clear();
+  if (!has_override_blocks(data, size)) {
+    out->append(data, size);
+    return false;
+  }
+
+  out->reserve(size + 16);
+  bool changed = false;
+  TagTokenizer tokenizer(data, size);
+  TextToken token;
+  while (tokenizer.next(&token)) {
+    if ((token.type == TokenType::TAG) && rewrite(token, out)) {
+      changed = true;
+      continue;
+    }
+    out->append(token.text.data, token.text.size);
+  }
+
+  return changed;
+}
+
+} // namespace ass
+
+#endif // TAGS_HPP_
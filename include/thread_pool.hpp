@@ -0,0 +1,94 @@
+// Fixed-size thread pool
+// Copyright (c) 2019 Slek
+
+#ifndef THREAD_POOL_HPP_
+#define THREAD_POOL_HPP_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+
+  // Use as many threads as hardware threads when num_threads is 0
+  explicit ThreadPool(std::size_t num_threads = 0)
+    : stopped_(false), running_(0) {
+    if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0) num_threads = 1;
+
+    workers_.reserve(num_threads);
+    for (std::size_t i = 0; i < num_threads; ++i)
+      workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+
+  // Finishes every queued task before joining the workers
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    task_condition_.notify_all();
+    for (std::thread& worker : workers_)
+      worker.join();
+  }
+
+  std::size_t NumThreads() const { return workers_.size(); }
+
+  void AddTask(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    task_condition_.notify_one();
+  }
+
+  // Block until the queue is empty and no task is running
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_condition_.wait(lock, [this] { return tasks_.empty() && running_ == 0; });
+  }
+
+private:
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void WorkerLoop() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        task_condition_.wait(lock, [this] { return stopped_ || !tasks_.empty(); });
+        if (tasks_.empty()) return; // stopped
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+        running_++;
+      }
+
+      task();
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_--;
+        if (tasks_.empty() && running_ == 0) idle_condition_.notify_all();
+      }
+    }
+  }
+
+  bool stopped_;
+  std::size_t running_;
+
+  std::mutex mutex_;
+  std::condition_variable task_condition_;
+  std::condition_variable idle_condition_;
+
+  std::deque<std::function<void()>> tasks_;
+  std::vector<std::thread> workers_;
+};
+
+#endif // THREAD_POOL_HPP_
@@ -0,0 +1,194 @@
+// Scoped trace spans exportable as Chrome trace JSON
+// Copyright (c) 2019 Slek
+//
+// Set ASS_TRACE=<file> in the environment to record every span of a run and
+// dump them on exit. The file can be opened with chrome://tracing or Perfetto.
+// When the variable is unset a span costs a single branch; building without
+// ASS_TRACING compiles the spans out entirely. Allocation profiling builds
+// (alloc_profile.hpp) keep the spans to attribute allocations to them.
+
+#ifndef TRACE_HPP_
+#define TRACE_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "alloc_profile.hpp"
+
+namespace trace {
+
+struct Event {
+  const char* name;
+  std::string detail;
+  std::uint64_t begin; // ns since tracer start
+  std::uint64_t end;
+  std::uint32_t tid;
+};
+
+class Tracer {
+public:
+
+  static Tracer& Instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  bool Enabled() const { return enabled_; }
+
+  std::uint64_t Now() const {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - origin_).count());
+  }
+
+  std::uint32_t ThreadId() {
+    static thread_local std::uint32_t tid = next_tid_++;
+    return tid;
+  }
+
+  void Record(Event&& event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back(std::move(event));
+  }
+
+  bool Dump(const std::string& path) const {
+    std::ofstream output(path);
+    if (!output.is_open()) return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const long pid = static_cast<long>(::getpid());
+    output << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (std::size_t i = 0; i < events_.size(); ++i) {
+      const Event& event = events_[i];
+      if (i) output << ",";
+      output << "\n{\"name\":\"" << Escape(event.name)
+             << "\",\"cat\":\"ass\",\"ph\":\"X\",\"pid\":" << pid
+             << ",\"tid\":" << event.tid
+             << ",\"ts\":" << event.begin / 1000 << "." << Fraction(event.begin)
+             << ",\"dur\":" << (event.end - event.begin) / 1000 << "." << Fraction(event.end - event.begin);
+      if (!event.detail.empty())
+        output << ",\"args\":{\"detail\":\"" << Escape(event.detail) << "\"}";
+      output << "}";
+    }
+    output << "\n]}\n";
+
+    return output.good();
+  }
+
+  ~Tracer() {
+    if (enabled_ && !Dump(path_))
+      std::fprintf(stderr, "[WARNING] Can't write trace file '%s'\n", path_.c_str());
+  }
+
+private:
+
+  Tracer()
+    : enabled_(false), origin_(std::chrono::steady_clock::now()), next_tid_(1) {
+    const char* path = std::getenv("ASS_TRACE");
+    if (path && *path) {
+      path_ = path;
+      enabled_ = true;
+    }
+  }
+
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  static std::string Escape(const std::string& str) {
+    std::string escaped;
+    escaped.reserve(str.size());
+    for (char ch : str) {
+      if (ch == '"' || ch == '\\') escaped.push_back('\\');
+      if (static_cast<unsigned char>(ch) < 0x20) continue;
+      escaped.push_back(ch);
+    }
+    return escaped;
+  }
+
+  static std::string Fraction(std::uint64_t ns) {
+    char buffer[4];
+    std::snprintf(buffer, sizeof(buffer), "%03u", static_cast<unsigned>(ns % 1000));
+    return buffer;
+  }
+
+  bool enabled_;
+  std::string path_;
+  std::chrono::steady_clock::time_point origin_;
+  std::atomic<std::uint32_t> next_tid_;
+
+  mutable std::mutex mutex_;
+  std::vector<Event> events_;
+};
+
+class Span {
+public:
+
+  explicit Span(const char* name)
+    : tracer_(Tracer::Instance()), active_(tracer_.Enabled()) {
+#ifdef ASS_ALLOC_PROFILING
+    alloc_previous_ = alloc::EnterSpan(name);
+#endif
+    if (active_) {
+      event_.name = name;
+      event_.begin = tracer_.Now();
+    }
+  }
+
+  Span(const char* name, const std::string& detail)
+    : tracer_(Tracer::Instance()), active_(tracer_.Enabled()) {
+#ifdef ASS_ALLOC_PROFILING
+    alloc_previous_ = alloc::EnterSpan(name);
+#endif
+    if (active_) {
+      event_.name = name;
+      event_.detail = detail;
+      event_.begin = tracer_.Now();
+    }
+  }
+
+  ~Span() {
+    if (active_) {
+      event_.end = tracer_.Now();
+      event_.tid = tracer_.ThreadId();
+      tracer_.Record(std::move(event_));
+    }
+#ifdef ASS_ALLOC_PROFILING
+    alloc::LeaveSpan(alloc_previous_);
+#endif
+  }
+
+private:
+
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+  Tracer& tracer_;
+  const bool active_;
+  Event event_;
+#ifdef ASS_ALLOC_PROFILING
+  int alloc_previous_;
+#endif
+};
+
+} // namespace trace
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#if defined(ASS_TRACING) || defined(ASS_ALLOC_PROFILING)
+  #define TRACE_SPAN(name) ::trace::Span TRACE_CONCAT(trace_span_, __LINE__)(name)
+  #define TRACE_SPAN_DETAIL(name, detail) ::trace::Span TRACE_CONCAT(trace_span_, __LINE__)(name, detail)
+#else
+  #define TRACE_SPAN(name) static_cast<void>(0)
+  #define TRACE_SPAN_DETAIL(name, detail) static_cast<void>(0)
+#endif
+
+#endif // TRACE_HPP_
@@ -72,4 +72,7 @@ bool StringContains(const std::string& str, const std::string& sub_str);
 // Check whether the character is a white space one.
 bool IsWhiteSpace(const int character);
 
+// Escape string for use inside a JSON string literal.
+std::string StringJsonEscape(const std::string& str);
+
 #endif  // ASS_TOOLS_UTIL_STRING_H_
@@ -0,0 +1,203 @@
+// SSA/ASS flavour of uuencode used by embedded fonts and graphics
+// Copyright (c) 2019 Slek
+//
+// Every 3 bytes become 4 characters holding 6 bits each plus 33. A trailing
+// group of 1 or 2 bytes becomes 2 or 3 characters. Encoded lines are 80
+// characters long, only the last one may be shorter.
+//
+// UUEncoder and UUDecoder work on blocks of any size, carrying incomplete
+// groups over to the next block, so files are converted while streaming.
+// Whole lines (60 bytes) are encoded at once, and runs of valid characters
+// are decoded 4 at a time without per-character checks.
+
+#ifndef UUENCODE_HPP_
+#define UUENCODE_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+
+namespace ass {
+
+const std::size_t UUENCODE_LINE_LENGTH = 80;
+const std::size_t UUENCODE_LINE_BYTES = UUENCODE_LINE_LENGTH / 4 * 3;
+
+namespace detail {
+
+// Make room for extra more characters, growing geometrically across blocks
+inline void reserve_more(std::string* out, std::size_t extra) {
+  const std::size_t needed = out->size() + extra;
+  if (needed > out->capacity()) out->reserve(std::max(needed, 2 * out->capacity()));
+}
+
+} // namespace detail
+
+// Size of the data encoded in [data, data + size), line breaks ignored
+inline std::size_t uudecoded_size(const char* data, std::size_t size) {
+  std::size_t chars = 0;
+  for (std::size_t i = 0; i < size; ++i)
+    chars += (data[i] != '\r') && (data[i] != '\n');
+  return chars / 4 * 3 + ((chars % 4) ? (chars % 4) - 1 : 0);
+}
+
+class UUEncoder {
+public:
+
+  explicit UUEncoder(const std::string& line_break)
+    : line_break_(line_break), column_(0), carry_size_(0) { }
+
+  // Append the encoding of [data, data + size) to out
+  void Encode(const char* data, std::size_t size, std::string* out) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    std::size_t i = 0;
+
+    // Complete the group started by the previous block
+    if (carry_size_ > 0) {
+      i = std::min(3 - carry_size_, size);
+      for (std::size_t k = 0; k < i; ++k) carry_[carry_size_ + k] = bytes[k];
+      carry_size_ += i;
+      if (carry_size_ < 3) return;
+      Group(carry_, 3, out);
+      carry_size_ = 0;
+    }
+
+    detail::reserve_more(out, (size - i) / 3 * 4 + ((size - i) / UUENCODE_LINE_BYTES + 1) * line_break_.size());
+    while (i + 3 <= size) {
+      if (((column_ % UUENCODE_LINE_LENGTH) == 0) && (i + UUENCODE_LINE_BYTES <= size)) {
+        Line(bytes + i, out);
+        i += UUENCODE_LINE_BYTES;
+      } else {
+        Group(bytes + i, 3, out);
+        i += 3;
+      }
+    }
+
+    carry_size_ = size - i;
+    for (std::size_t k = 0; k < carry_size_; ++k) carry_[k] = bytes[i + k];
+  }
+
+  // Encode the last, incomplete group
+  void Finish(std::string* out) {
+    if (carry_size_ > 0) Group(carry_, carry_size_, out);
+    carry_size_ = 0;
+    column_ = 0;
+  }
+
+private:
+
+  static void Encode3(const unsigned char* bytes, char* chars) {
+    const unsigned b0 = bytes[0], b1 = bytes[1], b2 = bytes[2];
+    chars[0] = static_cast<char>((b0 >> 2) + 33);
+    chars[1] = static_cast<char>((((b0 & 0x3) << 4) | (b1 >> 4)) + 33);
+    chars[2] = static_cast<char>((((b1 & 0xf) << 2) | (b2 >> 6)) + 33);
+    chars[3] = static_cast<char>((b2 & 0x3f) + 33);
+  }
+
+  void Line(const unsigned char* bytes, std::string* out) {
+    if (column_ == UUENCODE_LINE_LENGTH) *out += line_break_;
+    char line[UUENCODE_LINE_LENGTH];
+    for (std::size_t k = 0; k < UUENCODE_LINE_BYTES / 3; ++k)
+      Encode3(bytes + 3 * k, line + 4 * k);
+    out->append(line, UUENCODE_LINE_LENGTH);
+    column_ = UUENCODE_LINE_LENGTH;
+  }
+
+  void Group(const unsigned char* bytes, std::size_t size, std::string* out) {
+    if (column_ == UUENCODE_LINE_LENGTH) {
+      *out += line_break_;
+      column_ = 0;
+    }
+    const unsigned char group[3] = {bytes[0], (size > 1) ? bytes[1] : static_cast<unsigned char>(0),
+                                    (size > 2) ? bytes[2] : static_cast<unsigned char>(0)};
+    char chars[4];
+    Encode3(group, chars);
+    out->append(chars, size + 1);
+    column_ += size + 1;
+  }
+
+  std::string line_break_;
+  std::size_t column_;       // Characters in the current line
+  unsigned char carry_[3];   // Bytes of an incomplete group
+  std::size_t carry_size_;
+};
+
+class UUDecoder {
+public:
+
+  UUDecoder()
+    : quad_size_(0) { }
+
+  // Append the data encoded in [data, data + size) to out. Line breaks and
+  // white space are skipped; false on any other invalid character.
+  bool Decode(const char* data, std::size_t size, std::string* out) {
+    const unsigned char* chars = reinterpret_cast<const unsigned char*>(data);
+    detail::reserve_more(out, size / 4 * 3);
+
+    std::size_t i = 0;
+    while (i < size) {
+      if ((quad_size_ == 0) && (i + 4 <= size) && Valid(chars[i]) && Valid(chars[i + 1]) &&
+          Valid(chars[i + 2]) && Valid(chars[i + 3])) {
+        Decode4(chars + i, 3, out);
+        i += 4;
+        continue;
+      }
+
+      const unsigned char ch = chars[i++];
+      if ((ch == '\r') || (ch == '\n') || (ch == ' ') || (ch == '\t')) continue;
+      if (!Valid(ch)) return false;
+      quad_[quad_size_++] = ch;
+      if (quad_size_ == 4) {
+        Decode4(quad_, 3, out);
+        quad_size_ = 0;
+      }
+    }
+    return true;
+  }
+
+  // Decode the last, incomplete group; false when it can't hold any data
+  bool Finish(std::string* out) {
+    const std::size_t left = quad_size_;
+    quad_size_ = 0;
+    if (left == 0) return true;
+    if (left == 1) return false;
+    for (std::size_t k = left; k < 4; ++k) quad_[k] = 33;
+    Decode4(quad_, left - 1, out);
+    return true;
+  }
+
+private:
+
+  static bool Valid(unsigned char ch) {
+    return static_cast<unsigned char>(ch - 33) < 64;
+  }
+
+  static void Decode4(const unsigned char* chars, std::size_t bytes, std::string* out) {
+    const unsigned c0 = chars[0] - 33u, c1 = chars[1] - 33u, c2 = chars[2] - 33u, c3 = chars[3] - 33u;
+    const char group[3] = {static_cast<char>((c0 << 2) | (c1 >> 4)),
+                           static_cast<char>(((c1 & 0xf) << 4) | (c2 >> 2)),
+                           static_cast<char>(((c2 & 0x3) << 6) | c3)};
+    out->append(group, bytes);
+  }
+
+  unsigned char quad_[4];  // Characters of an incomplete group
+  std::size_t quad_size_;
+};
+
+// Encode data as lines joined by line_break
+inline std::string uuencode(const std::string& data, const std::string& line_break) {
+  std::string encoded;
+  UUEncoder encoder(line_break);
+  encoder.Encode(data.data(), data.size(), &encoded);
+  encoder.Finish(&encoded);
+  return encoded;
+}
+
+// Decode data into *out, false when it isn't valid
+inline bool uudecode(const std::string& data, std::string* out) {
+  UUDecoder decoder;
+  return decoder.Decode(data.data(), data.size(), out) && decoder.Finish(out);
+}
+
+} // namespace ass
+
+#endif // UUENCODE_HPP_
@@ -0,0 +1,643 @@
+// Watch an ASS script and reload only the events that changed
+// Copyright (c) 2019 Slek
+//
+// FileWatcher blocks until a file is saved (inotify on Linux, polling
+// elsewhere). ScriptTracker keeps the last version of the script in memory:
+// on reload, the common prefix and suffix of the old and new file contents
+// are skipped, and when the remaining bytes fall inside [Events] only those
+// lines are parsed and spliced into the loaded ASSFile. The resulting
+// EventPatch tells the tools which event range to reprocess.
+//
+// FileTail and follow() serve growing files instead, such as live captions:
+// only the event lines appended since the last read are handed to the tools,
+// which append their output in turn.
+
+#ifndef WATCH_HPP_
+#define WATCH_HPP_
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+  #include <poll.h>
+  #include <sys/inotify.h>
+#endif
+
+#include "ass.hpp"
+#include "fstream.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+
+namespace watch {
+
+typedef std::list<std::pair<std::string, std::string>> Lines;
+
+class FileWatcher {
+public:
+
+  explicit FileWatcher(const std::string& path)
+    : path_(path), fd_(-1), wd_(-1) {
+    const std::string::size_type slash = path.find_last_of('/');
+    dir_ = (slash == std::string::npos) ? "." : ((slash == 0) ? "/" : path.substr(0, slash));
+    name_ = path.substr(slash == std::string::npos ? 0 : slash + 1);
+
+#if defined(__linux__)
+    // The directory is watched, as editors often save through a rename
+    fd_ = ::inotify_init1(IN_CLOEXEC);
+    if (fd_ >= 0)
+      wd_ = ::inotify_add_watch(fd_, dir_.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+#endif
+    stamp_ = Stamp();
+  }
+
+  ~FileWatcher() {
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  // Block until the file is saved. Bursts of events closer than settle_ms
+  // are reported once.
+  bool Wait(int settle_ms = 50) {
+#if defined(__linux__)
+    if (wd_ >= 0) {
+      if (!ReadEvents(-1)) return false;
+      while (ReadEvents(settle_ms)) { }
+      stamp_ = Stamp();
+      return true;
+    }
+#endif
+
+    for (;;) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(250));
+      const std::string stamp = Stamp();
+      if (stamp != stamp_) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(settle_ms));
+        stamp_ = Stamp();
+        return true;
+      }
+    }
+  }
+
+private:
+
+  FileWatcher(const FileWatcher&) = delete;
+  FileWatcher& operator=(const FileWatcher&) = delete;
+
+  // Size and modification time, as a change marker for polling
+  std::string Stamp() const {
+    struct stat st;
+    if (::stat(path_.c_str(), &st) != 0) return std::string();
+    return StringPrintf("%lld:%lld", static_cast<long long>(st.st_size), static_cast<long long>(st.st_mtime));
+  }
+
+#if defined(__linux__)
+  // True when an event for the watched file arrives within timeout_ms
+  bool ReadEvents(int timeout_ms) {
+    for (;;) {
+      struct pollfd pfd = {fd_, POLLIN, 0};
+      const int ready = ::poll(&pfd, 1, timeout_ms);
+      if (ready <= 0) return false;
+
+      alignas(struct inotify_event) char buffer[4096];
+      const ssize_t length = ::read(fd_, buffer, sizeof(buffer));
+      if (length <= 0) return false;
+
+      bool matched = false;
+      for (const char* it = buffer; it < buffer + length; ) {
+        const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(it);
+        if ((event->len > 0) && (name_ == event->name)) matched = true;
+        it += sizeof(struct inotify_event) + event->len;
+      }
+      if (matched) return true;
+    }
+  }
+#endif
+
+  std::string path_;
+  std::string dir_;
+  std::string name_;
+  std::string stamp_;
+  int fd_;
+  int wd_;
+};
+
+// Reads the lines appended to a growing file. New data ends the wait at once
+// through inotify on Linux; elsewhere the file is polled.
+class FileTail {
+public:
+
+  explicit FileTail(const std::string& path)
+    : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC)), notify_fd_(-1), offset_(0), checked_(false) {
+#if defined(__linux__)
+    if (fd_ >= 0) {
+      notify_fd_ = ::inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+      if ((notify_fd_ >= 0) && (::inotify_add_watch(notify_fd_, path.c_str(), IN_MODIFY) < 0)) {
+        ::close(notify_fd_);
+        notify_fd_ = -1;
+      }
+    }
+#endif
+  }
+
+  ~FileTail() {
+    if (fd_ >= 0) ::close(fd_);
+    if (notify_fd_ >= 0) ::close(notify_fd_);
+  }
+
+  bool is_open() const { return fd_ >= 0; }
+
+  // Append the lines completed since the last call to *lines, line breaks
+  // removed ('\r' is kept). When there are none, waits up to timeout_ms for
+  // more data first. Throws when the file can't be read, shrinks, or isn't
+  // plain UTF-8.
+  void Read(std::vector<std::string>* lines, int timeout_ms) {
+    if (ReadLines(lines)) return;
+    Wait(timeout_ms);
+    ReadLines(lines);
+  }
+
+private:
+
+  FileTail(const FileTail&) = delete;
+  FileTail& operator=(const FileTail&) = delete;
+
+  bool ReadLines(std::vector<std::string>* lines) {
+    struct stat st;
+    if (::fstat(fd_, &st) != 0) throw ass::io_error("can't read input file");
+    if (st.st_size < offset_) throw ass::io_error("input file was truncated");
+
+    char buffer[1 << 16];
+    for (;;) {
+      const ssize_t length = ::read(fd_, buffer, sizeof(buffer));
+      if (length < 0) {
+        if (errno == EINTR) continue;
+        throw ass::io_error("can't read input file");
+      }
+      if (length == 0) break;
+      offset_ += length;
+      partial_.append(buffer, static_cast<std::size_t>(length));
+    }
+
+    if (!checked_ && (partial_.size() >= 4)) {
+      checked_ = true;
+      const ass::Encoding encoding = ass::detect_encoding(partial_.data(), partial_.size());
+      if ((ass::compression_for_data(partial_.data(), partial_.size()) != ass::Compression::NONE) ||
+          (encoding == ass::Encoding::UTF16LE) || (encoding == ass::Encoding::UTF16BE))
+        throw ass::io_error("followed input must be uncompressed UTF-8");
+      if (StringStartsWith(partial_, ass::BOM)) partial_.erase(0, ass::length(ass::BOM));
+    }
+
+    const std::size_t before = lines->size();
+    std::size_t pos = 0;
+    for (std::size_t eol; (eol = partial_.find('\n', pos)) != std::string::npos; pos = eol + 1)
+      lines->push_back(partial_.substr(pos, eol - pos));
+    partial_.erase(0, pos);
+    return lines->size() > before;
+  }
+
+  void Wait(int timeout_ms) {
+#if defined(__linux__)
+    if (notify_fd_ >= 0) {
+      struct pollfd pfd = {notify_fd_, POLLIN, 0};
+      if (::poll(&pfd, 1, timeout_ms) > 0) {
+        alignas(struct inotify_event) char buffer[4096];
+        while (::read(notify_fd_, buffer, sizeof(buffer)) > 0) { }
+      }
+      return;
+    }
+#endif
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+  }
+
+  int fd_;
+  int notify_fd_;
+  off_t offset_;        // Bytes read
+  bool checked_;        // Encoding checked
+  std::string partial_; // Incomplete last line
+};
+
+// Events replaced by the last reload: [first, first + removed) of the old
+// version became [first, first + inserted) of the new one. Indices exclude
+// the Format line. full is set when anything outside the event lines
+// changed, and the whole script must be reprocessed.
+struct EventPatch {
+  std::size_t first;
+  std::size_t removed;
+  std::size_t inserted;
+  bool full;
+
+  bool empty() const { return !full && (removed == 0) && (inserted == 0); }
+};
+
+class ScriptTracker {
+public:
+
+  explicit ScriptTracker(const std::string& path)
+    : path_(path) { }
+
+  // Initial load, throws on error
+  void Load() {
+    std::string text;
+    if (!ReadFile(&text)) throw ass::io_error("can't open input file");
+    LoadText(text);
+  }
+
+  // Reload the file after a change. Throws when the file can't be read or
+  // parsed, keeping the previous version.
+  EventPatch Reload() {
+    TRACE_SPAN("reload");
+    EventPatch patch = {0, 0, 0, false};
+
+    std::string text;
+    if (!ReadFile(&text)) throw ass::io_error("can't open input file");
+    if (!stale_ && (text.size() == text_.size()) && (std::memcmp(text.data(), text_.data(), text.size()) == 0)) return patch;
+
+    if (stale_ || !Patch(text, &patch)) {
+      LoadText(text);
+      stale_ = false;
+      patch.full = true;
+      patch.removed = patch.inserted = 0;
+    }
+    return patch;
+  }
+
+  // The last patch wasn't applied by the caller, so the next Reload gives a
+  // full one whatever changed
+  void Invalidate() { stale_ = true; }
+
+  ass::ASSFile& script() { return script_; }
+  const ass::ASSFile& script() const { return script_; }
+
+private:
+
+  // Whole (decompressed) contents of the file
+  bool ReadFile(std::string* text) const {
+    ass::ifstream input(path_);
+    if (!input.is_open()) return false;
+
+    text->clear();
+    char buffer[1 << 16];
+    while (input.read(buffer, sizeof(buffer)) || (input.gcount() > 0))
+      text->append(buffer, static_cast<std::size_t>(input.gcount()));
+    return true;
+  }
+
+  void LoadText(const std::string& text) {
+    TRACE_SPAN("load");
+    ass::ASSFile script;
+    std::istringstream input(text);
+    script.load(input);
+
+    script_ = std::move(script);
+    text_ = text;
+    IndexEvents();
+  }
+
+  // Byte ranges of the event lines of text_. The fast path is disabled when
+  // they can't be matched one to one with the loaded events.
+  void IndexEvents() {
+    spans_.clear();
+    indexed_ = false;
+
+    bool in_events = false, seen_events = false, seen_format = false;
+    std::size_t pos = 0;
+    while (pos < text_.size()) {
+      std::size_t eol = text_.find('\n', pos);
+      const std::size_t next = (eol == std::string::npos) ? text_.size() : eol + 1;
+
+      std::string line = text_.substr(pos, next - pos);
+      StringTrim(&line);
+
+      if (!line.empty() && (text_[pos] != ';')) {
+        if (ass::defines_section(line)) {
+          if (in_events) {
+            events_end_ = pos;
+            in_events = false;
+          }
+          if (line == ass::EVENTS) {
+            if (seen_events) return; // Events split across sections
+            in_events = seen_events = true;
+            events_end_ = text_.size();
+          }
+        } else if (in_events) {
+          if (!seen_format) {
+            seen_format = true;
+            events_begin_ = next;
+          } else {
+            spans_.push_back(pos);
+          }
+        }
+      }
+      pos = next;
+    }
+
+    if (!seen_format || !script_.HasSection(ass::EVENTS)) return;
+    if (script_.Section(ass::EVENTS).size() != spans_.size() + 1) return;
+    indexed_ = true;
+  }
+
+  // Splice the changed event lines into script_ and take text as the new
+  // version, false (leaving text untouched) when the change isn't confined
+  // to event lines
+  bool Patch(std::string& text, EventPatch* patch) {
+    if (!indexed_) return false;
+
+    const std::size_t old_size = text_.size(), new_size = text.size();
+    const std::size_t limit = std::min(old_size, new_size);
+
+    // Whole blocks are compared with memcmp first
+    const std::size_t block = 4096;
+    std::size_t prefix = 0;
+    while ((prefix + block <= limit) && (std::memcmp(&text_[prefix], &text[prefix], block) == 0)) prefix += block;
+    while ((prefix < limit) && (text_[prefix] == text[prefix])) ++prefix;
+    std::size_t suffix = 0;
+    while ((suffix + block <= limit - prefix) &&
+           (std::memcmp(&text_[old_size - suffix - block], &text[new_size - suffix - block], block) == 0)) suffix += block;
+    while ((suffix < limit - prefix) && (text_[old_size - 1 - suffix] == text[new_size - 1 - suffix])) ++suffix;
+
+    // Changed lines: [begin, old_end) in the old text, [begin, new_end) in the new one
+    std::size_t begin = text_.rfind('\n', prefix == 0 ? 0 : prefix - 1);
+    begin = ((begin == std::string::npos) || (prefix == 0)) ? 0 : begin + 1;
+    if (begin < events_begin_) return false;
+
+    std::size_t old_end = old_size - suffix;
+    if ((old_end > begin) && (text_[old_end - 1] != '\n')) old_end = LineEnd(text_, old_end);
+    for (;;) {
+      const std::size_t new_end = new_size - (old_size - old_end);
+      if ((new_end == begin) || (text[new_end - 1] == '\n') || (new_end == new_size)) break;
+      if (old_end == old_size) return false;
+      old_end = LineEnd(text_, old_end);
+    }
+    if (old_end > events_end_) return false;
+    const std::size_t new_end = new_size - (old_size - old_end);
+
+    // Parse the new lines, giving up on anything but events
+    const std::string& line_break = script_.LineBreak();
+    Lines lines;
+    std::vector<std::size_t> spans;
+    for (std::size_t pos = begin; pos < new_end; ) {
+      const std::size_t next = std::min(LineEnd(text, pos), new_end);
+      std::string line = text.substr(pos, next - pos);
+      if (!line.empty() && (line.back() == '\n')) line.pop_back();
+      if ((line_break == "\r\n") && !line.empty() && (line.back() == '\r')) line.pop_back();
+
+      std::string trimmed_line = line;
+      StringTrim(&trimmed_line);
+      if (!trimmed_line.empty() && (line.front() != ';')) {
+        if (ass::defines_section(trimmed_line)) return false;
+
+        const std::string::size_type delim_pos = line.find(':');
+        if (delim_pos == std::string::npos) return false;
+
+        std::string type = line.substr(0, delim_pos);
+        StringTrim(&type);
+        if (type == "Format") return false;
+
+        lines.push_back(std::make_pair(type, line.substr(delim_pos + 1)));
+        spans.push_back(pos);
+      }
+      pos = next;
+    }
+
+    // Old events in [begin, old_end)
+    const std::size_t first = static_cast<std::size_t>(std::lower_bound(spans_.begin(), spans_.end(), begin) - spans_.begin());
+    const std::size_t last = static_cast<std::size_t>(std::lower_bound(spans_.begin(), spans_.end(), old_end) - spans_.begin());
+
+    Lines& events = script_.Section(ass::EVENTS);
+    Lines::iterator it = std::next(events.begin(), static_cast<std::ptrdiff_t>(first + 1));
+    Lines::iterator it_end = std::next(it, static_cast<std::ptrdiff_t>(last - first));
+    it = events.erase(it, it_end);
+    events.splice(it, lines);
+
+    const std::ptrdiff_t delta = static_cast<std::ptrdiff_t>(new_size) - static_cast<std::ptrdiff_t>(old_size);
+    for (std::size_t k = last; k < spans_.size(); ++k)
+      spans_[k] = static_cast<std::size_t>(static_cast<std::ptrdiff_t>(spans_[k]) + delta);
+    spans_.erase(spans_.begin() + static_cast<std::ptrdiff_t>(first), spans_.begin() + static_cast<std::ptrdiff_t>(last));
+    spans_.insert(spans_.begin() + static_cast<std::ptrdiff_t>(first), spans.begin(), spans.end());
+    events_end_ = static_cast<std::size_t>(static_cast<std::ptrdiff_t>(events_end_) + delta);
+    text_.swap(text);
+
+    patch->first = first;
+    patch->removed = last - first;
+    patch->inserted = spans.size();
+    return true;
+  }
+
+  // Position just after the line holding pos
+  static std::size_t LineEnd(const std::string& text, std::size_t pos) {
+    const std::size_t eol = text.find('\n', pos);
+    return (eol == std::string::npos) ? text.size() : eol + 1;
+  }
+
+  std::string path_;
+  std::string text_;
+  ass::ASSFile script_;
+
+  bool indexed_ = false;
+  bool stale_ = false;
+  std::size_t events_begin_ = 0; // Just after the Format line
+  std::size_t events_end_ = 0;   // Start of the next section, or end of text
+  std::vector<std::size_t> spans_; // Start of every event line
+};
+
+// Events [first, first + count) of a script, indices excluding the Format line
+inline std::pair<Lines::const_iterator, Lines::const_iterator> event_range(const ass::ASSFile& ass, std::size_t first, std::size_t count) {
+  const Lines& events = ass.Section(ass::EVENTS);
+  Lines::const_iterator begin = std::next(events.cbegin(), static_cast<std::ptrdiff_t>(first + 1));
+  return std::make_pair(begin, std::next(begin, static_cast<std::ptrdiff_t>(count)));
+}
+
+// Replace events [first, first + removed) of a script with lines
+inline void splice_events(ass::ASSFile& ass, std::size_t first, std::size_t removed, Lines& lines) {
+  Lines& events = ass.Section(ass::EVENTS);
+  Lines::iterator it = std::next(events.begin(), static_cast<std::ptrdiff_t>(first + 1));
+  it = events.erase(it, std::next(it, static_cast<std::ptrdiff_t>(removed)));
+  events.splice(it, lines);
+}
+
+// Load input and call update(script, patch) with a full patch, then again
+// after every save of input until interrupted. Errors while watching are
+// reported and the previous output is kept; after a failed update the next
+// save is processed in full, as the output no longer matches the tracker.
+inline int run(const std::string& input, const std::function<void(ass::ASSFile&, const EventPatch&)>& update) {
+  FileWatcher watcher(input);
+  ScriptTracker tracker(input);
+
+  const EventPatch full = {0, 0, 0, true};
+  try {
+    tracker.Load();
+    update(tracker.script(), full);
+  } catch (const std::exception& e) {
+    std::cerr << "[ERROR] " << e.what() << std::endl;
+    return 1; // FAILURE
+  }
+  std::cerr << "Watching '" << input << "' for changes, press Ctrl+C to stop" << std::endl;
+
+  while (watcher.Wait()) {
+    const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    EventPatch patch;
+    try {
+      patch = tracker.Reload();
+      if (patch.empty()) continue;
+    } catch (const std::exception& e) {
+      std::cerr << "[ERROR] " << e.what() << std::endl;
+      continue;
+    }
+
+    try {
+      update(tracker.script(), patch);
+    } catch (const std::exception& e) {
+      tracker.Invalidate();
+      std::cerr << "[ERROR] " << e.what() << std::endl;
+      continue;
+    }
+
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    if (patch.full)
+      std::cerr << StringPrintf("Reprocessed the whole script in %.1f ms", ms) << std::endl;
+    else
+      std::cerr << StringPrintf("Reprocessed %zu event(s), %zu removed, in %.1f ms", patch.inserted, patch.removed, ms) << std::endl;
+  }
+
+  std::cerr << "[ERROR] Can't watch input file!" << std::endl;
+  return 1; // FAILURE
+}
+
+// Write lines after the ones of the last section written to out, which ends
+// with a line break, and make them visible at once
+inline void append_lines(std::ostream& out, const Lines& lines, const std::string& line_break) {
+  for (const std::pair<std::string, std::string>& entry : lines)
+    out << entry.first << ":" << entry.second << line_break;
+  out.flush();
+}
+
+namespace detail {
+
+// Set by SIGINT and SIGTERM while following
+inline volatile std::sig_atomic_t& follow_stopped() {
+  static volatile std::sig_atomic_t stopped = 0;
+  return stopped;
+}
+
+inline void StopFollowing(int) {
+  follow_stopped() = 1;
+}
+
+} // namespace detail
+
+// Wait until input holds its header (everything up to the Format line of
+// [Events]) and call begin(script) with it. Then call append(script, lines)
+// with the event lines appended to input, at most latency_ms after they are
+// written, until interrupted. tick(script), when given, is called after
+// every read, new lines or not, at most latency_ms apart. input must be
+// uncompressed UTF-8 ending with its [Events] section.
+inline int follow(const std::string& input, const std::function<void(ass::ASSFile&)>& begin,
+                  const std::function<void(const ass::ASSFile&, Lines&)>& append,
+                  const std::function<void(const ass::ASSFile&)>& tick = nullptr, int latency_ms = 100) {
+  FileTail tail(input);
+  if (!tail.is_open()) {
+    std::cerr << "[ERROR] Can't open input file!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  std::signal(SIGINT, detail::StopFollowing);
+  std::signal(SIGTERM, detail::StopFollowing);
+
+  ass::ASSFile script;
+  std::vector<std::string> lines;
+  std::size_t used = 0;
+  try {
+    std::string header;
+    bool in_events = false, has_format = false;
+    while (!has_format) {
+      if (detail::follow_stopped()) return 0; // SUCCESS
+      tail.Read(&lines, latency_ms);
+      for (; (used < lines.size()) && !has_format; ++used) {
+        header.append(lines[used]).append(1, '\n');
+        std::string trimmed_line = lines[used];
+        StringTrim(&trimmed_line);
+        if (ass::defines_section(trimmed_line)) in_events = (trimmed_line == ass::EVENTS);
+        else if (in_events) has_format = StringStartsWith(trimmed_line, "Format:");
+      }
+    }
+
+    std::istringstream stream(header);
+    script.load(stream);
+    begin(script);
+  } catch (const std::exception& e) {
+    std::cerr << "[ERROR] " << e.what() << std::endl;
+    return 1; // FAILURE
+  }
+  std::cerr << "Following '" << input << "', press Ctrl+C to stop" << std::endl;
+
+  const std::string& line_break = script.LineBreak();
+  bool in_events = true;
+  while (!detail::follow_stopped()) {
+    Lines events;
+    for (; used < lines.size(); ++used) {
+      std::string& line = lines[used];
+      if ((line_break == "\r\n") && !line.empty() && (line.back() == '\r')) line.pop_back();
+
+      std::string trimmed_line = line;
+      StringTrim(&trimmed_line);
+      if (trimmed_line.empty() || (line.front() == ';')) continue;
+
+      if (ass::defines_section(trimmed_line)) {
+        if (in_events) std::cerr << "[WARNING] Ignoring '" << trimmed_line << "' and the sections after it" << std::endl;
+        in_events = false;
+        continue;
+      }
+      if (!in_events) continue;
+
+      const std::string::size_type delim_pos = line.find(':');
+      if (delim_pos == std::string::npos) {
+        std::cerr << "[WARNING] Skipping line without type delimiter" << std::endl;
+        continue;
+      }
+      std::string type = line.substr(0, delim_pos);
+      StringTrim(&type);
+      events.push_back(std::make_pair(type, line.substr(delim_pos + 1)));
+    }
+    lines.clear();
+    used = 0;
+
+    // A batch that fails is reported and dropped, reading errors stop
+    try {
+      if (!events.empty()) append(script, events);
+      if (tick) tick(script);
+    } catch (const std::exception& e) {
+      std::cerr << "[ERROR] " << e.what() << std::endl;
+    }
+
+    try {
+      tail.Read(&lines, latency_ms);
+    } catch (const std::exception& e) {
+      std::cerr << "[ERROR] " << e.what() << std::endl;
+      return 1; // FAILURE
+    }
+  }
+
+  return 0; // SUCCESS
+}
+
+} // namespace watch
+
+#endif // WATCH_HPP_
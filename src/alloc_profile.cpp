@@ -0,0 +1,195 @@
+// Counting global operator new and delete for allocation profiling builds
+// Copyright (c) 2019 Slek
+//
+// Counters live in a fixed table of spans, zero initialized before any
+// constructor runs, so nothing here allocates and allocations made during
+// static initialization are counted too. Span 0 holds the allocations made
+// outside any span.
+
+#include "alloc_profile.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace alloc {
+
+namespace {
+
+const int MAX_SPANS = 256;
+
+struct Span {
+  std::atomic<const char*> name;
+  std::atomic<std::uint64_t> calls;
+  std::atomic<std::uint64_t> events;
+  std::atomic<std::uint64_t> allocations;
+  std::atomic<std::uint64_t> frees;
+  std::atomic<std::uint64_t> bytes;
+};
+
+Span spans[MAX_SPANS];
+std::atomic<int> used_spans(1);
+std::mutex spans_mutex;
+
+thread_local int current_span = 0;
+thread_local std::uint64_t thread_allocations = 0;
+thread_local std::uint64_t thread_bytes = 0;
+
+// Spans are keyed by name, compared by address first: names are literals
+int FindSpan(const char* name) {
+  const int used = used_spans.load(std::memory_order_acquire);
+  for (int i = 1; i < used; ++i) {
+    const char* span_name = spans[i].name.load(std::memory_order_relaxed);
+    if ((span_name == name) || (std::strcmp(span_name, name) == 0)) return i;
+  }
+  return -1;
+}
+
+int AddSpan(const char* name) {
+  std::lock_guard<std::mutex> lock(spans_mutex);
+  int index = FindSpan(name);
+  if (index >= 0) return index;
+
+  index = used_spans.load(std::memory_order_relaxed);
+  if (index == MAX_SPANS) return 0;
+  spans[index].name.store(name, std::memory_order_relaxed);
+  used_spans.store(index + 1, std::memory_order_release);
+  return index;
+}
+
+void* Allocate(std::size_t size) {
+  Span& span = spans[current_span];
+  span.allocations.fetch_add(1, std::memory_order_relaxed);
+  span.bytes.fetch_add(size, std::memory_order_relaxed);
+  thread_allocations++;
+  thread_bytes += size;
+  return std::malloc(size ? size : 1);
+}
+
+void Free(void* ptr) {
+  if (!ptr) return;
+  spans[current_span].frees.fetch_add(1, std::memory_order_relaxed);
+  std::free(ptr);
+}
+
+double PerEvent(std::uint64_t value, std::uint64_t events) {
+  return events ? static_cast<double>(value) / static_cast<double>(events) : 0.0;
+}
+
+// Prints the report when the program exits
+class Report {
+public:
+
+  ~Report() {
+    const char* path = std::getenv("ASS_ALLOC_PROFILE");
+    std::FILE* file = (path && *path) ? std::fopen(path, "w") : stderr;
+    if (!file) {
+      std::fprintf(stderr, "[WARNING] Can't write allocation profile '%s'\n", path);
+      return;
+    }
+
+    const int used = used_spans.load(std::memory_order_acquire);
+    int order[MAX_SPANS];
+    std::uint64_t allocations = 0, bytes = 0, frees = 0, events = 0;
+    for (int i = 0; i < used; ++i) {
+      order[i] = i;
+      allocations += spans[i].allocations.load(std::memory_order_relaxed);
+      bytes += spans[i].bytes.load(std::memory_order_relaxed);
+      frees += spans[i].frees.load(std::memory_order_relaxed);
+      events += spans[i].events.load(std::memory_order_relaxed);
+    }
+    std::sort(order, order + used, [](int a, int b) {
+      return spans[a].allocations.load(std::memory_order_relaxed) > spans[b].allocations.load(std::memory_order_relaxed);
+    });
+
+    std::fprintf(file, "Allocations: %llu (%llu bytes), frees: %llu, events: %llu\n",
+                 static_cast<unsigned long long>(allocations), static_cast<unsigned long long>(bytes),
+                 static_cast<unsigned long long>(frees), static_cast<unsigned long long>(events));
+    std::fprintf(file, "%-24s %10s %10s %12s %14s %10s %12s\n",
+                 "span", "calls", "events", "allocations", "bytes", "allocs/ev", "bytes/ev");
+    for (int k = 0; k < used; ++k) {
+      const Span& span = spans[order[k]];
+      const std::uint64_t span_allocations = span.allocations.load(std::memory_order_relaxed);
+      const std::uint64_t span_bytes = span.bytes.load(std::memory_order_relaxed);
+      if ((span_allocations == 0) && (order[k] != 0)) continue;
+      std::fprintf(file, "%-24s %10llu %10llu %12llu %14llu %10.2f %12.1f\n",
+                   order[k] ? span.name.load(std::memory_order_relaxed) : "(outside spans)",
+                   static_cast<unsigned long long>(span.calls.load(std::memory_order_relaxed)),
+                   static_cast<unsigned long long>(span.events.load(std::memory_order_relaxed)),
+                   static_cast<unsigned long long>(span_allocations), static_cast<unsigned long long>(span_bytes),
+                   PerEvent(span_allocations, events), PerEvent(span_bytes, events));
+    }
+
+    if (file != stderr) std::fclose(file);
+  }
+};
+
+Report report;
+
+} // namespace
+
+int EnterSpan(const char* name) {
+  int index = FindSpan(name);
+  if (index < 0) index = AddSpan(name);
+  spans[index].calls.fetch_add(1, std::memory_order_relaxed);
+
+  const int previous = current_span;
+  current_span = index;
+  return previous;
+}
+
+void LeaveSpan(int previous) {
+  current_span = previous;
+}
+
+void AddEvents(std::uint64_t events) {
+  spans[current_span].events.fetch_add(events, std::memory_order_relaxed);
+}
+
+Counts ThreadCounts() {
+  return Counts{thread_allocations, thread_bytes};
+}
+
+} // namespace alloc
+
+void* operator new(std::size_t size) {
+  void* ptr = alloc::Allocate(size);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new[](std::size_t size) {
+  void* ptr = alloc::Allocate(size);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return alloc::Allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return alloc::Allocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  alloc::Free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  alloc::Free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  alloc::Free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  alloc::Free(ptr);
+}
@@ -0,0 +1,107 @@
+// ASS-Client - Run ASS tools through a running ass_toolsd
+// Copyright (c) 2019 Slek
+
+#define PROGRAM_NAME "ass_client"
+#define PROGRAM_DESC "Run an ASS tool through a running ass_toolsd (socket: $ASS_TOOLSD_SOCKET, else\n  ass_toolsd.sock in $XDG_RUNTIME_DIR, else /tmp/ass_toolsd-<uid>.sock). Takes\n  the same arguments as the tool itself; when installed as a link named after a\n  tool (e.g. ass_time) the tool argument is implied. An input given as - is\n  read from stdin, an output given as - is written to stdout."
+#define PROGRAM_ARGS "tool [args...]"
+#define PROGRAM_VERS "1.0"
+#define COPY_INFO "Copyright (c) 2019 Slek"
+
+#define FLAGS_CASES                                                                                \
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <unistd.h>
+
+#include "flags.hpp"
+#include "ipc.hpp"
+#include "util/string.h"
+#include "util/version.h"
+
+namespace {
+
+const std::unordered_set<std::string> TOOLS = {"ass_time", "ass_split", "ass_extract", "ass_sort", "ass_merge"};
+
+std::string ToolName(const std::string& name) {
+  std::string tool = name.substr(name.find_last_of('/') + 1);
+  if (!StringStartsWith(tool, "ass_")) tool = "ass_" + tool;
+  return tool;
+}
+
+// Inputs given as '-' are sent inline (first input for every tool, both for ass_merge)
+bool ReadsStdin(const std::vector<std::string>& args) {
+  std::vector<std::string> positional;
+  for (const std::string& arg : args)
+    if ((arg.size() < 2) || (arg[0] != '-')) positional.push_back(arg);
+
+  if (positional.size() < 2) return false;
+  if (positional[1] == "-") return true;
+  return (positional[0] == "ass_merge") && (positional.size() > 2) && (positional[2] == "-");
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+
+  ipc::Request request;
+
+  // Invoked through a link named after a tool?
+  const std::string self = ToolName(argv[0]);
+  int first_arg = 1;
+  if (TOOLS.find(self) != TOOLS.end()) {
+    request.args.push_back(self);
+  } else {
+    if ((argc < 2) || flags::HelpRequired(2, argv)) {
+      flags::ShowHelp();
+      return (argc < 2) ? 1 : 0;
+    }
+
+    if (flags::VersionRequested(2, argv)) {
+      flags::ShowVersion();
+      return 0; // SUCCESS
+    }
+
+    request.args.push_back(ToolName(argv[1]));
+    first_arg = 2;
+  }
+
+  for (int i = first_arg; i < argc; ++i)
+    request.args.push_back(argv[i]);
+
+  char cwd[4096];
+  if (::getcwd(cwd, sizeof(cwd)))
+    request.cwd = cwd;
+
+  if (ReadsStdin(request.args)) {
+    request.has_input = true;
+    request.input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+  }
+
+  const std::string socket_path = ipc::socket_path();
+  int fd = ipc::connect(socket_path);
+  if (fd < 0) {
+    std::cerr << "[ERROR] Can't connect to ass_toolsd at '" << socket_path << "': " << std::strerror(errno) << std::endl;
+    return 1; // FAILURE
+  }
+
+  ipc::Response response;
+  if (!ipc::send_request(fd, request) || !ipc::recv_response(fd, &response)) {
+    std::cerr << "[ERROR] Connection to ass_toolsd lost!" << std::endl;
+    ::close(fd);
+    return 1; // FAILURE
+  }
+  ::close(fd);
+
+  std::cerr << response.err;
+  std::cout << response.out;
+  if (response.has_output)
+    std::cout.write(response.output.data(), response.output.size());
+
+  return response.status;
+}
@@ -0,0 +1,235 @@
+// ASS-Convert - Convert subtitles between ASS, SRT and WebVTT
+// Copyright (c) 2019 Slek
+
+#define PROGRAM_NAME "ass_convert"
+#define PROGRAM_DESC "Convert subtitles between ASS, SRT and WebVTT. Formats are taken from the\n  file extensions (.ass, .srt, .vtt, optionally .gz/.zst compressed). When input\n  is a directory, every subtitle file in it is converted in parallel into the\n  output directory, to the format selected with --ass, --srt or --vtt."
+#define PROGRAM_ARGS "input output"
+#define PROGRAM_VERS "1.0"
+#define COPY_INFO "Copyright (c) 2019 Slek"
+
+#define FLAGS_CASES                                                                                \
+    FLAG_CASE(ass, -1, "convert to ASS")                                                          \
+    FLAG_CASE(srt, -1, "convert to SRT")                                                          \
+    FLAG_CASE(vtt, -1, "convert to WebVTT")
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ass.hpp"
+#include "flags.hpp"
+#include "fstream.hpp"
+#include "mkv.hpp"
+#include "ops/convert.hpp"
+#include "thread_pool.hpp"
+#include "util/string.h"
+#include "util/version.h"
+
+namespace {
+
+struct Job {
+  std::string input;
+  std::string output;
+  ass::SubtitleFormat from;
+  ass::SubtitleFormat to;
+  std::string error;
+};
+
+std::string ScriptComment(const std::string& line_break) {
+  const std::string build = StringPrintf("; Script generated by ASSTools (%s)", GetBuildInfo().c_str());
+  const std::string url = "; http://github.com/Slek-Z/ass_tools";
+  return build + line_break + url;
+}
+
+void Convert(Job* job) {
+  ass::ifstream input(job->input);
+  if (!input.is_open()) {
+    job->error = "[ERROR] Can't open input file '" + job->input + "'!";
+    return;
+  }
+
+  ass::ofstream output(job->output);
+  if (!output.is_open()) {
+    job->error = "[ERROR] Can't open output file '" + job->output + "'!";
+    return;
+  }
+
+  try {
+    if (job->from == ass::SubtitleFormat::ASS) {
+      ass::ASSFile ass_input;
+      mkv::load_script(job->input, input, ass_input);
+      if (job->to == ass::SubtitleFormat::ASS) {
+        ass_input.ScriptComment() = ScriptComment(ass_input.LineBreak());
+        output << ass_input;
+      } else {
+        ass::CueWriter writer(output, job->to);
+        ass::ass_to_cues(ass_input, writer, job->to);
+      }
+    } else {
+      ass::CueReader reader(input, job->from);
+      if (job->to == ass::SubtitleFormat::ASS) {
+        ass::ASSFile header = ass::cue_script_header();
+        header.ScriptComment() = ScriptComment(header.LineBreak());
+        ass::cues_to_ass(reader, job->from, header, output);
+      } else {
+        ass::CueWriter writer(output, job->to);
+        ass::cues_to_cues(reader, job->from, writer, job->to);
+      }
+    }
+  } catch (const std::exception& e) {
+    job->error = "[ERROR] " + job->input + ": " + e.what();
+    return;
+  }
+
+  output.close();
+  if (!output.good())
+    job->error = "[ERROR] Can't write output file '" + job->output + "'!";
+}
+
+// Output name for a file converted into another format
+std::string OutputName(std::string name, ass::SubtitleFormat to) {
+  for (const char* suffix : {".gz", ".zst", ".zstd"})
+    if (StringEndsWith(name, suffix)) { name.resize(name.size() - std::string(suffix).size()); break; }
+  const std::string::size_type dot = name.rfind('.');
+  if (dot != std::string::npos) name.resize(dot);
+  return name + ass::subtitle_format_extension(to);
+}
+
+// Jobs for the subtitle files of a directory, sorted by name
+bool ListDirectory(const std::string& input, const std::string& output, ass::SubtitleFormat to, std::vector<Job>* jobs) {
+  DIR* dir = ::opendir(input.c_str());
+  if (!dir) return false;
+
+  std::vector<std::string> names;
+  while (struct dirent* entry = ::readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name.empty() || (name[0] == '.')) continue;
+    if ((entry->d_type != DT_REG) && (entry->d_type != DT_LNK) && (entry->d_type != DT_UNKNOWN)) continue;
+    names.push_back(name);
+  }
+  ::closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  for (const std::string& name : names) {
+    Job job;
+    job.input = input + "/" + name;
+    if (!ass::subtitle_format_for_path(name, &job.from) || (job.from == to)) continue;
+
+    struct stat st;
+    if ((::stat(job.input.c_str(), &st) != 0) || !S_ISREG(st.st_mode)) continue;
+
+    job.output = output + "/" + OutputName(name, to);
+    job.to = to;
+    jobs->push_back(job);
+  }
+
+  // Inputs differing only in extension (a.srt, a.vtt) would overwrite each
+  // other's output, so none of them is converted
+  std::unordered_map<std::string, std::size_t> first_job;
+  for (std::size_t i = 0; i < jobs->size(); ++i) {
+    const auto inserted = first_job.emplace((*jobs)[i].output, i);
+    if (inserted.second) continue;
+    for (Job* conflict : {&(*jobs)[inserted.first->second], &(*jobs)[i]})
+      conflict->error = "[ERROR] Output file '" + conflict->output + "' is shared by several inputs, '" + conflict->input + "' not converted!";
+  }
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+
+  if (flags::HelpRequired(argc, argv)) {
+    flags::ShowHelp();
+    return 0; // SUCCESS
+  }
+
+  if (flags::VersionRequested(argc, argv)) {
+    flags::ShowVersion();
+    return 0; // SUCCESS
+  }
+
+  int result = flags::ParseFlags(&argc, &argv, true);
+  if (result > 0) {
+    std::cerr << "unrecognized option '" << argv[result] << "'" << std::endl;
+    std::cerr << "Try '" << PROGRAM_NAME << " --help' for more information" << std::endl;
+    return 1; // FAILURE
+  }
+
+  if (argc != 3) {
+    flags::ShowHelp();
+    return 1; // FAILURE
+  }
+
+  if ((FLAGS_ass + FLAGS_srt + FLAGS_vtt) > 1) {
+    std::cerr << "[ERROR] Only one of --ass, --srt and --vtt can be given!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  const std::string input = argv[1], output = argv[2];
+  const bool has_target = FLAGS_ass || FLAGS_srt || FLAGS_vtt;
+  const ass::SubtitleFormat target = FLAGS_ass ? ass::SubtitleFormat::ASS
+                                   : (FLAGS_srt ? ass::SubtitleFormat::SRT : ass::SubtitleFormat::VTT);
+
+  std::vector<Job> jobs;
+  struct stat st;
+  const bool directory = (::stat(input.c_str(), &st) == 0) && S_ISDIR(st.st_mode);
+  if (directory) {
+    if (!has_target) {
+      std::cerr << "[ERROR] Output format (--ass, --srt or --vtt) is required for directories!" << std::endl;
+      return 1; // FAILURE
+    }
+    if ((::mkdir(output.c_str(), 0777) != 0) && (errno != EEXIST)) {
+      std::cerr << "[ERROR] Can't create output directory!" << std::endl;
+      return 1; // FAILURE
+    }
+    if (!ListDirectory(input, output, target, &jobs)) {
+      std::cerr << "[ERROR] Can't read input directory!" << std::endl;
+      return 1; // FAILURE
+    }
+  } else {
+    Job job;
+    job.input = input;
+    job.output = output;
+    if (!ass::subtitle_format_for_path(input, &job.from)) {
+      std::cerr << "[ERROR] Unknown input format!" << std::endl;
+      return 1; // FAILURE
+    }
+    job.to = target;
+    if (!has_target && !ass::subtitle_format_for_path(output, &job.to)) {
+      std::cerr << "[ERROR] Unknown output format!" << std::endl;
+      return 1; // FAILURE
+    }
+    jobs.push_back(job);
+  }
+
+  {
+    ThreadPool pool(jobs.size() < 2 ? 1 : 0);
+    for (Job& job : jobs)
+      if (job.error.empty()) pool.AddTask([&job]() { Convert(&job); });
+    pool.Wait();
+  }
+
+  // Errors are reported in file order
+  std::size_t failed = 0;
+  for (const Job& job : jobs) {
+    if (job.error.empty()) continue;
+    std::cerr << job.error << std::endl;
+    failed++;
+  }
+
+  if (directory)
+    std::cerr << StringPrintf("%zu file(s) converted, %zu failed", jobs.size() - failed, failed) << std::endl;
+
+  return failed ? 1 : 0;
+}
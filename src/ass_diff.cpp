@@ -0,0 +1,139 @@
+// ASS-Diff - Compare the events of two ASS subtitles
+// Copyright (c) 2019 Slek
+
+#define PROGRAM_NAME "ass_diff"
+#define PROGRAM_DESC "Compare the events of two ASS subtitles. Events are matched regardless of\n  their order and reported as retimed (only Start/End changed), retexted (only\n  other fields changed), modified, removed or added. Exits with 1 when the\n  events differ."
+#define PROGRAM_ARGS "input1 input2"
+#define PROGRAM_VERS "1.0"
+#define COPY_INFO "Copyright (c) 2019 Slek"
+
+#define FLAGS_CASES                                                                                \
+    FLAG_CASE(json, -1, "print one JSON object per change")
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ass.hpp"
+#include "flags.hpp"
+#include "fstream.hpp"
+#include "mkv.hpp"
+#include "ops/diff.hpp"
+#include "thread_pool.hpp"
+#include "util/string.h"
+#include "util/version.h"
+
+namespace {
+
+std::string FormatLine(const std::pair<std::string, std::string>& line) {
+  return line.first + ":" + line.second;
+}
+
+void PrintChange(const ass::EventChange& change) {
+  const char* kind = ass::change_kind_name(change.kind);
+
+  if (FLAGS_json) {
+    std::string out = std::string("{\"kind\":\"") + kind + "\"";
+    if (change.line1)
+      out += StringPrintf(",\"event1\":%zu,\"start1\":%d,\"end1\":%d", change.event1, change.start1, change.end1) +
+             ",\"line1\":\"" + StringJsonEscape(FormatLine(*change.line1)) + "\"";
+    if (change.line2)
+      out += StringPrintf(",\"event2\":%zu,\"start2\":%d,\"end2\":%d", change.event2, change.start2, change.end2) +
+             ",\"line2\":\"" + StringJsonEscape(FormatLine(*change.line2)) + "\"";
+    std::cout << out << "}\n";
+    return;
+  }
+
+  switch (change.kind) {
+    case ass::EventChange::RETIMED:
+      std::cout << StringPrintf("~ %zu -> %zu retimed: ", change.event1, change.event2)
+                << ass::format_time_signed(change.start1) << " - " << ass::format_time_signed(change.end1) << " => "
+                << ass::format_time_signed(change.start2) << " - " << ass::format_time_signed(change.end2) << "\n";
+      break;
+    case ass::EventChange::RETEXTED:
+    case ass::EventChange::MODIFIED:
+      std::cout << StringPrintf("~ %zu -> %zu %s:\n", change.event1, change.event2, kind)
+                << "  - " << FormatLine(*change.line1) << "\n"
+                << "  + " << FormatLine(*change.line2) << "\n";
+      break;
+    case ass::EventChange::REMOVED:
+      std::cout << StringPrintf("- %zu removed: ", change.event1) << FormatLine(*change.line1) << "\n";
+      break;
+    case ass::EventChange::ADDED:
+      std::cout << StringPrintf("+ %zu added: ", change.event2) << FormatLine(*change.line2) << "\n";
+      break;
+  }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+
+  if (flags::HelpRequired(argc, argv)) {
+    flags::ShowHelp();
+    return 0; // SUCCESS
+  }
+
+  if (flags::VersionRequested(argc, argv)) {
+    flags::ShowVersion();
+    return 0; // SUCCESS
+  }
+
+  int result = flags::ParseFlags(&argc, &argv, true);
+  if (result > 0) {
+    std::cerr << "unrecognized option '" << argv[result] << "'" << std::endl;
+    std::cerr << "Try '" << PROGRAM_NAME << " --help' for more information" << std::endl;
+    return 1; // FAILURE
+  }
+
+  if (argc != 3) {
+    flags::ShowHelp();
+    return 1; // FAILURE
+  }
+
+  ass::ifstream input1(argv[1]);
+  if (!input1.is_open()) {
+    std::cerr << "[ERROR] Can't open input1 file!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  ass::ifstream input2(argv[2]);
+  if (!input2.is_open()) {
+    std::cerr << "[ERROR] Can't open input2 file!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  // Both inputs are loaded concurrently
+  ass::ASSFile ass1, ass2;
+  std::exception_ptr errors[2];
+  {
+    ThreadPool pool(2);
+    pool.AddTask([&]() { try { mkv::load_script(argv[1], input1, ass1); } catch (...) { errors[0] = std::current_exception(); } });
+    pool.AddTask([&]() { try { mkv::load_script(argv[2], input2, ass2); } catch (...) { errors[1] = std::current_exception(); } });
+    pool.Wait();
+  }
+  for (const std::exception_ptr& error : errors)
+    if (error) std::rethrow_exception(error);
+
+  std::vector<ass::EventChange> changes;
+  ass::diff(ass1, ass2, &changes);
+
+  std::size_t counts[ass::EventChange::ADDED + 1] = {0};
+  for (const ass::EventChange& change : changes) {
+    PrintChange(change);
+    counts[change.kind]++;
+  }
+  std::cout << std::flush;
+
+  if (!FLAGS_json)
+    std::cerr << StringPrintf("%zu retimed, %zu retexted, %zu modified, %zu removed, %zu added",
+                              counts[ass::EventChange::RETIMED], counts[ass::EventChange::RETEXTED],
+                              counts[ass::EventChange::MODIFIED], counts[ass::EventChange::REMOVED],
+                              counts[ass::EventChange::ADDED]) << std::endl;
+
+  return changes.empty() ? 0 : 1;
+}
@@ -2,14 +2,19 @@
 // Copyright (c) 2019 Slek
 
 #define PROGRAM_NAME "ass_extract"
-#define PROGRAM_DESC "Extract ASS subtitles by styles."
+#define PROGRAM_DESC "Extract ASS subtitles by styles.\n  Comment lines (;) inside standard sections are not kept."
 #define PROGRAM_ARGS "input styles output"
 #define PROGRAM_VERS "1.0"
 #define COPY_INFO "Copyright (c) 2019 Slek"
 
 #define FLAGS_CASES                                                                                \
-    FLAG_CASE(except, -1, "extract all styles except the specified ones")
+    FLAG_CASE(except, -1, "extract all styles except the specified ones")                          \
+    FLAG_CASE(watch, -1, "keep running and update output whenever input is saved")                 \
+    FLAG_CASE(follow, -1, "keep running and process events appended to input as they arrive")      \
+    FLAG_CASE(keep_encoding, -1, "write output in the input encoding instead of UTF-8")            \
+    FLAG_CASE(skip_unchanged, -1, "leave output files whose contents wouldn't change untouched")
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
 #include <functional>
@@ -19,70 +24,17 @@
 #include <sstream>
 #include <string>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "ass.hpp"
 #include "flags.hpp"
+#include "fstream.hpp"
+#include "mkv.hpp"
+#include "ops/extract.hpp"
 #include "util/string.h"
 #include "util/version.h"
-
-inline void extract(const ass::ASSFile& ass, const std::unordered_set<std::string>& styles, ass::ASSFile& out, std::function<bool(const std::unordered_set<std::string>&, const std::string&)> comparator) {
-  out.clear();
-
-  out.BOM() = ass.BOM();
-
-  out.ScriptComment() = ass.ScriptComment();
-
-  bool has_events = false;
-  for (const std::string& section : ass.Sections()) {
-    if (section == ass::EVENTS) {
-      has_events = true;
-
-      const std::list<std::pair<std::string, std::string>>& lines = ass.Section(ass::EVENTS);
-
-      std::list<std::pair<std::string, std::string>>::const_iterator it = lines.cbegin();
-      if (it == lines.cend()) continue;
-
-      const std::pair<std::string, std::string>& format_line = *it;
-      out.add_line(ass::EVENTS, format_line.first, format_line.second);
-      ++it;
-
-      if (format_line.first != "Format")
-        throw ass::io_error("format line must appear first in events");
-
-      std::size_t text_idx = std::numeric_limits<std::size_t>::max();
-      if (!ass::get_field_index(format_line.second, "Text", &text_idx) ||
-           (text_idx != (StringSplit(format_line.second, ass::FIELD_DELIMITER).size()-1)))
-        throw ass::io_error("'Text' field must appear in last place");
-
-      std::size_t style_idx = std::numeric_limits<std::size_t>::max();
-      if (!ass::get_field_index(format_line.second, "Style", &style_idx))
-        throw ass::io_error("'Style' field not found in format definition string");
-
-      for (; it != lines.cend(); ++it) {
-        if (it->first != ass::DIALOGUE_EVENT) continue;
-
-        const std::string& line_data = it->second;
-
-        std::string style;
-        std::string::size_type style_begin, style_end;
-        if (ass::get_field(line_data, style_idx, &style_begin, &style_end)) {
-          if (style_begin < style_end) {
-            style = line_data.substr(style_begin, style_end - style_begin);
-          }
-        } else throw ass::io_error("'Style' field cannot be retrieved");
-
-        if (comparator(styles, style))
-          out.add_line(ass::EVENTS, ass::DIALOGUE_EVENT, line_data);
-      }
-    } else {
-      out.insert(section, ass.Section(section));
-    }
-  }
-
-  if (!has_events)
-    std::cerr << "[WARNING] Events section not found!" << std::endl;
-}
+#include "watch.hpp"
 
 int main(int argc, char* argv[]) {
 
@@ -108,51 +60,100 @@ int main(int argc, char* argv[]) {
     return 1; // FAILURE
   }
 
-  std::ifstream input(argv[1]);
+  if (FLAGS_watch && FLAGS_follow) {
+    std::cerr << "[ERROR] Only one of --watch and --follow can be given!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  ass::ifstream input(argv[1]);
   if (!input.is_open()) {
     std::cerr << "[ERROR] Can't open input file!" << std::endl;
     return 1; // FAILURE
   }
 
-  std::vector<std::string> styles = StringSplit(argv[2], ass::FIELD_DELIMITER);
-  std::unordered_set<std::string> styles_set;
-  for (std::string& style : styles) {
-    StringTrim(&style);
-    styles_set.insert(style);
-  }
+  const ass::StyleSet styles(argv[2], FLAGS_except);
+
+  // Output is UTF-8 unless the input encoding is kept
+  const ass::Encoding encoding = FLAGS_keep_encoding ? mkv::script_encoding(argv[1], input) : ass::Encoding::UTF8;
 
-  std::ofstream output(argv[3]);
+  ass::ofstream output(argv[3], encoding, FLAGS_skip_unchanged);
   if (!output.is_open()) {
     std::cerr << "[ERROR] Can't open output file!" << std::endl;
     return 1; // FAILURE
   }
 
-  std::function<bool(const std::unordered_set<std::string>&, const std::string&)> comparator = (FLAGS_except) ?
-      ([](const std::unordered_set<std::string>& set, const std::string& str) {
-        std::string str_trimmed = str;
-        StringTrim(&str_trimmed);
+  const std::string build = StringPrintf("; Script generated by ASSTools (%s)", GetBuildInfo().c_str());
+  const std::string url = "; http://github.com/Slek-Z/ass_tools";
+
+  if (FLAGS_follow) {
+    // Appended events are filtered and appended to output
+    return watch::follow(argv[1], [&](ass::ASSFile& header) {
+      header.ScriptComment() = build + header.LineBreak() + url;
+      ass::ASSFile ass_output;
+      extract(header, styles, ass_output);
+      output << ass_output;
+      output.flush();
+    }, [&](const ass::ASSFile& header, watch::Lines& lines) {
+      watch::Lines out;
+      ass::extract_events(header.Section(ass::EVENTS).front().second, lines.cbegin(), lines.cend(), styles, out);
+      watch::append_lines(output, out, header.LineBreak());
+    });
+  }
 
-        return set.find(str_trimmed) == set.cend();
-      })
-    :
-      ([](const std::unordered_set<std::string>& set, const std::string& str) {
-        std::string str_trimmed = str;
-        StringTrim(&str_trimmed);
+  if (FLAGS_watch) {
+    output.close();
+    const std::string output_path = argv[3];
+
+    // selected tells which input events are in the output, so that a patch
+    // can be mapped to the output events it replaces
+    ass::ASSFile ass_output;
+    std::vector<std::uint8_t> selected;
+    return watch::run(argv[1], [&](ass::ASSFile& ass_input, const watch::EventPatch& patch) {
+      if (patch.full) {
+        ass_input.ScriptComment() = build + ass_input.LineBreak() + url;
+        selected.clear();
+        extract(ass_input, styles, ass_output, &selected);
+      } else {
+        const auto range = watch::event_range(ass_input, patch.first, patch.inserted);
+        const std::vector<std::uint8_t>::iterator first = selected.begin() + static_cast<std::ptrdiff_t>(patch.first);
+        const std::vector<std::uint8_t>::iterator last = first + static_cast<std::ptrdiff_t>(patch.removed);
+        const std::size_t out_first = static_cast<std::size_t>(std::count(selected.begin(), first, 1));
+        const std::size_t out_removed = static_cast<std::size_t>(std::count(first, last, 1));
+
+        std::vector<std::uint8_t> patch_selected;
+        watch::Lines lines;
+        ass::extract_events(ass_input.Section(ass::EVENTS).front().second, range.first, range.second,
+                            styles, lines, &patch_selected);
+        watch::splice_events(ass_output, out_first, out_removed, lines);
+        selected.insert(selected.erase(first, last), patch_selected.begin(), patch_selected.end());
+      }
 
-        return set.find(str_trimmed) != set.cend();
-      });
+      ass::ofstream output(output_path, encoding, FLAGS_skip_unchanged);
+      if (!output.is_open()) throw ass::io_error("can't open output file");
+      output << ass_output;
+      output.close();
+      if (!output.good()) throw ass::io_error("can't write output file");
+      if (output.unchanged())
+        std::cerr << "[INFO] '" << output_path << "' unchanged, not rewritten" << std::endl;
+    });
+  }
 
   ass::ASSFile ass_input;
-  ass_input.load(input);
+  mkv::load_script(argv[1], input, ass_input);
 
-  const std::string build = StringPrintf("; Script generated by ASSTools (%s)", GetBuildInfo().c_str());
-  const std::string url = "; http://github.com/Slek-Z/ass_tools";
   ass_input.ScriptComment() = build + ass_input.LineBreak() + url;
 
   ass::ASSFile ass_output;
-  extract(ass_input, styles_set, ass_output, comparator);
+  extract(std::move(ass_input), styles, ass_output);
 
   output << ass_output;
+  output.close();
+  if (!output.good()) {
+    std::cerr << "[ERROR] Can't write output file '" << argv[3] << "'!" << std::endl;
+    return 1; // FAILURE
+  }
+  if (output.unchanged())
+    std::cerr << "[INFO] '" << argv[3] << "' unchanged, not rewritten" << std::endl;
 
   return 0; // SUCCESS
 }
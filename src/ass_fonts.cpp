@@ -0,0 +1,150 @@
+// ASS-Fonts - List, extract, attach and detach ASS embedded fonts
+// Copyright (c) 2019 Slek
+
+#define PROGRAM_NAME "ass_fonts"
+#define PROGRAM_DESC "List, extract, attach and detach the fonts embedded in ASS subtitles. Without\n  options, lists the embedded fonts and their sizes. --extract writes them\n  (or the named ones) into a directory, --attach embeds font files and\n  --detach removes them (or the named ones).\n  Comment lines (;) inside standard sections are not kept."
+#define PROGRAM_ARGS "input | --extract input directory [name...] | --attach input output font...\n  | --detach input output [name...]"
+#define PROGRAM_VERS "1.0"
+#define COPY_INFO "Copyright (c) 2019 Slek"
+
+#define FLAGS_CASES                                                                                \
+    FLAG_CASE(extract, -1, "extract fonts into a directory")                                       \
+    FLAG_CASE(attach, -1, "attach font files")                                                     \
+    FLAG_CASE(detach, -1, "detach fonts")
+
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ass.hpp"
+#include "flags.hpp"
+#include "fstream.hpp"
+#include "mkv.hpp"
+#include "ops/fonts.hpp"
+#include "util/string.h"
+#include "util/version.h"
+
+int main(int argc, char* argv[]) {
+
+  if (flags::HelpRequired(argc, argv)) {
+    flags::ShowHelp();
+    return 0; // SUCCESS
+  }
+
+  if (flags::VersionRequested(argc, argv)) {
+    flags::ShowVersion();
+    return 0; // SUCCESS
+  }
+
+  int result = flags::ParseFlags(&argc, &argv, true);
+  if (result > 0) {
+    std::cerr << "unrecognized option '" << argv[result] << "'" << std::endl;
+    std::cerr << "Try '" << PROGRAM_NAME << " --help' for more information" << std::endl;
+    return 1; // FAILURE
+  }
+
+  if ((FLAGS_extract + FLAGS_attach + FLAGS_detach) > 1) {
+    std::cerr << "[ERROR] Only one of --extract, --attach and --detach can be given!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  const bool list = !(FLAGS_extract || FLAGS_attach || FLAGS_detach);
+  if ((list && (argc != 2)) || (FLAGS_extract && (argc < 3)) || (FLAGS_attach && (argc < 4)) ||
+      (FLAGS_detach && (argc < 3))) {
+    flags::ShowHelp();
+    return 1; // FAILURE
+  }
+
+  ass::ifstream input(argv[1]);
+  if (!input.is_open()) {
+    std::cerr << "[ERROR] Can't open input file!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  ass::ASSFile ass_input;
+  mkv::load_script(argv[1], input, ass_input);
+
+  if (list) {
+    std::vector<ass::FontInfo> fonts;
+    ass::list_fonts(ass_input, &fonts);
+
+    std::size_t total = 0;
+    for (const ass::FontInfo& font : fonts) {
+      std::cout << StringPrintf("%10zu  ", font.size) << font.name << std::endl;
+      total += font.size;
+    }
+    std::cerr << StringPrintf("%zu font(s), %zu bytes", fonts.size(), total) << std::endl;
+    return 0; // SUCCESS
+  }
+
+  const std::vector<std::string> names(argv + 3, argv + argc);
+
+  if (FLAGS_extract) {
+    if (!ass_input.HasSection(ass::FONTS)) return 0; // SUCCESS
+
+    std::size_t extracted = 0;
+    for (const std::pair<std::string, std::string>& line : ass_input.Section(ass::FONTS)) {
+      if (line.first != ass::FONT_LINE) continue;
+
+      std::string name = ass::font_name(line.second);
+      bool selected = names.empty();
+      for (const std::string& selected_name : names)
+        selected |= (selected_name == name);
+      if (!selected) continue;
+
+      // Stored names never leave the output directory
+      const std::string::size_type slash = name.find_last_of("/\\");
+      if (slash != std::string::npos) name.erase(0, slash + 1);
+      if (name.empty() || (name == ".") || (name == "..")) {
+        std::cerr << "[WARNING] Skipping font with invalid name '" << ass::font_name(line.second) << "'" << std::endl;
+        continue;
+      }
+
+      const std::string path = std::string(argv[2]) + "/" + name;
+      std::ofstream output(path, std::ios::binary);
+      if (!output.is_open()) {
+        std::cerr << "[ERROR] Can't open output file '" << path << "'!" << std::endl;
+        return 1; // FAILURE
+      }
+      ass::extract_font(line.second, output);
+      output.close();
+      if (!output.good()) {
+        std::cerr << "[ERROR] Can't write output file '" << path << "'!" << std::endl;
+        return 1; // FAILURE
+      }
+      extracted++;
+    }
+
+    std::cerr << StringPrintf("%zu font(s) extracted", extracted) << std::endl;
+    return 0; // SUCCESS
+  }
+
+  if (FLAGS_attach) {
+    for (const std::string& path : names) {
+      std::ifstream font(path, std::ios::binary);
+      if (!font.is_open()) {
+        std::cerr << "[ERROR] Can't open font file '" << path << "'!" << std::endl;
+        return 1; // FAILURE
+      }
+      ass::attach_font(ass_input, ass::font_attachment_name(path), font);
+    }
+  } else {
+    const std::size_t removed = ass::detach_fonts(ass_input, names);
+    std::cerr << StringPrintf("%zu font(s) detached", removed) << std::endl;
+  }
+
+  const std::string build = StringPrintf("; Script generated by ASSTools (%s)", GetBuildInfo().c_str());
+  const std::string url = "; http://github.com/Slek-Z/ass_tools";
+  ass_input.ScriptComment() = build + ass_input.LineBreak() + url;
+
+  ass::ofstream output(argv[2]);
+  if (!output.is_open()) {
+    std::cerr << "[ERROR] Can't open output file!" << std::endl;
+    return 1; // FAILURE
+  }
+  output << ass_input;
+
+  return 0; // SUCCESS
+}
@@ -0,0 +1,164 @@
+// ASS-Lint - Check ASS subtitles events for overlaps and timing problems
+// Copyright (c) 2019 Slek
+
+#define PROGRAM_NAME "ass_lint"
+#define PROGRAM_DESC "Check ASS subtitles events. Reports dialogue lines shown at the same time with\n  the same style, layer and position (\\pos or \\move), events ending before they\n  start, zero-duration events and undefined styles. Files are checked in\n  parallel; exits with 1 when any issue is found. With --lenient, malformed\n  lines are skipped and reported instead of failing the file."
+#define PROGRAM_ARGS "input [input...]"
+#define PROGRAM_VERS "1.0"
+#define COPY_INFO "Copyright (c) 2019 Slek"
+
+#define FLAGS_CASES                                                                                \
+    FLAG_CASE(json, -1, "print one JSON object per issue")                                      \
+    FLAG_CASE(lenient, -1, "skip and report malformed lines")
+
+#include <cstddef>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ass.hpp"
+#include "flags.hpp"
+#include "fstream.hpp"
+#include "mkv.hpp"
+#include "ops/lint.hpp"
+#include "thread_pool.hpp"
+#include "util/string.h"
+#include "util/version.h"
+
+namespace {
+
+struct Report {
+  bool failed = false;
+  std::size_t issues = 0;
+  std::string out;
+  std::string err;
+};
+
+std::string FormatIssue(const std::string& file, const ass::LintIssue& issue) {
+  const char* kind = ass::lint_kind_name(issue.kind);
+
+  if (FLAGS_json) {
+    std::string out = "{\"file\":\"" + StringJsonEscape(file) + "\",\"kind\":\"" + kind + "\"" +
+                      StringPrintf(",\"event\":%zu", issue.event);
+    if (issue.kind == ass::LintIssue::OVERLAP)
+      out += StringPrintf(",\"other\":%zu", issue.other);
+    out += ",\"style\":\"" + StringJsonEscape(issue.style) + "\"" + StringPrintf(",\"layer\":%d", issue.layer);
+    if (issue.kind == ass::LintIssue::OVERLAP)
+      out += ",\"position\":\"" + StringJsonEscape(issue.position) + "\"";
+    out += StringPrintf(",\"start\":%d,\"end\":%d}\n", issue.start, issue.end);
+    return out;
+  }
+
+  std::string out = file + StringPrintf(": event %zu: ", issue.event) + kind + ": ";
+  switch (issue.kind) {
+    case ass::LintIssue::OVERLAP:
+      out += StringPrintf("overlaps event %zu", issue.other) + " from " + ass::format_time_signed(issue.start) + " to " +
+             ass::format_time_signed(issue.end) + " (style '" + issue.style + "'" + StringPrintf(", layer %d", issue.layer);
+      if (!issue.position.empty()) out += ", " + issue.position;
+      out += ")";
+      break;
+    case ass::LintIssue::INVALID_TIMING:
+      out += "ends at " + ass::format_time_signed(issue.end) + " before starting at " + ass::format_time_signed(issue.start);
+      break;
+    case ass::LintIssue::ZERO_DURATION:
+      out += "starts and ends at " + ass::format_time_signed(issue.start);
+      break;
+    case ass::LintIssue::UNDEFINED_STYLE:
+      out += "style '" + issue.style + "' is not defined";
+      break;
+  }
+  return out + "\n";
+}
+
+std::string FormatDiagnostic(const std::string& file, const ass::Diagnostic& diagnostic) {
+  const char* kind = ass::diagnostic_kind_name(diagnostic.kind);
+
+  if (FLAGS_json)
+    return "{\"file\":\"" + StringJsonEscape(file) + "\",\"kind\":\"" + kind + "\"" +
+           StringPrintf(",\"line\":%zu,\"offset\":%zu}\n", diagnostic.line, diagnostic.offset);
+
+  const char* action = (diagnostic.kind == ass::Diagnostic::MISSING_HEADER) ? "[Script Info] assumed" : "line skipped";
+  return file + StringPrintf(": line %zu (byte %zu): ", diagnostic.line, diagnostic.offset) + kind + ": " + action + "\n";
+}
+
+void LintFile(const std::string& file, Report* report) {
+  ass::ifstream input(file);
+  if (!input.is_open()) {
+    report->failed = true;
+    report->err = "[ERROR] Can't open input file '" + file + "'!\n";
+    return;
+  }
+
+  try {
+    ass::ASSFile ass_input;
+    ass::ParseResult parse_result;
+    mkv::load_script(file, input, ass_input, FLAGS_lenient ? &parse_result : nullptr);
+    for (const ass::Diagnostic& diagnostic : parse_result.diagnostics)
+      report->out += FormatDiagnostic(file, diagnostic);
+
+    std::vector<ass::LintIssue> issues;
+    ass::lint(ass_input, &issues);
+
+    report->issues = parse_result.diagnostics.size() + issues.size();
+    for (const ass::LintIssue& issue : issues)
+      report->out += FormatIssue(file, issue);
+  } catch (const std::exception& e) {
+    report->failed = true;
+    report->err = "[ERROR] " + file + ": " + e.what() + "\n";
+  }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+
+  if (flags::HelpRequired(argc, argv)) {
+    flags::ShowHelp();
+    return 0; // SUCCESS
+  }
+
+  if (flags::VersionRequested(argc, argv)) {
+    flags::ShowVersion();
+    return 0; // SUCCESS
+  }
+
+  int result = flags::ParseFlags(&argc, &argv, true);
+  if (result > 0) {
+    std::cerr << "unrecognized option '" << argv[result] << "'" << std::endl;
+    std::cerr << "Try '" << PROGRAM_NAME << " --help' for more information" << std::endl;
+    return 1; // FAILURE
+  }
+
+  if (argc < 2) {
+    flags::ShowHelp();
+    return 1; // FAILURE
+  }
+
+  const std::vector<std::string> files(argv + 1, argv + argc);
+  std::vector<Report> reports(files.size());
+
+  {
+    ThreadPool pool(files.size() < 2 ? 1 : 0);
+    for (std::size_t i = 0; i < files.size(); ++i)
+      pool.AddTask([&files, &reports, i]() { LintFile(files[i], &reports[i]); });
+    pool.Wait();
+  }
+
+  // Reports are printed in command line order
+  bool failed = false;
+  std::size_t issues = 0;
+  for (const Report& report : reports) {
+    std::cerr << report.err;
+    std::cout << report.out;
+    failed |= report.failed;
+    issues += report.issues;
+  }
+
+  if (!FLAGS_json)
+    std::cerr << StringPrintf("%zu issue(s) found in %zu file(s)", issues, files.size()) << std::endl;
+
+  return (failed || issues) ? 1 : 0;
+}
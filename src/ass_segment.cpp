@@ -0,0 +1,149 @@
+// ASS-Segment - Cut ASS subtitles into WebVTT segments for HLS
+// Copyright (c) 2019 Slek
+
+#define PROGRAM_NAME "ass_segment"
+#define PROGRAM_DESC "Cut ASS subtitles into WebVTT segments of the given duration (in seconds),\n  listed in an HLS playlist. Segments are named after the playlist (subs.m3u8\n  gives subs_00000.vtt, ...) and written next to it. Events crossing a segment\n  boundary are repeated in both segments. mpegts is the MPEG-TS time (90 kHz)\n  of time zero, stated in the X-TIMESTAMP-MAP of every segment (default 0)."
+#define PROGRAM_ARGS "input seconds playlist [mpegts]"
+#define PROGRAM_VERS "1.0"
+#define COPY_INFO "Copyright (c) 2019 Slek"
+
+#define FLAGS_CASES                                                                                \
+    FLAG_CASE(follow, -1, "keep running and publish segments as events are appended to input")
+
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ass.hpp"
+#include "flags.hpp"
+#include "fstream.hpp"
+#include "mkv.hpp"
+#include "ops/convert.hpp"
+#include "ops/segment.hpp"
+#include "util/string.h"
+#include "util/version.h"
+#include "watch.hpp"
+
+int main(int argc, char* argv[]) {
+
+  if (flags::HelpRequired(argc, argv)) {
+    flags::ShowHelp();
+    return 0; // SUCCESS
+  }
+
+  if (flags::VersionRequested(argc, argv)) {
+    flags::ShowVersion();
+    return 0; // SUCCESS
+  }
+
+  int result = flags::ParseFlags(&argc, &argv, true);
+  if (result > 0) {
+    std::cerr << "unrecognized option '" << argv[result] << "'" << std::endl;
+    std::cerr << "Try '" << PROGRAM_NAME << " --help' for more information" << std::endl;
+    return 1; // FAILURE
+  }
+
+  if ((argc != 4) && (argc != 5)) {
+    flags::ShowHelp();
+    return 1; // FAILURE
+  }
+
+  const double seconds = std::stod(argv[2]);
+  if (!std::isnormal(seconds) || (seconds < 0.001) || (seconds > 86400.0)) {
+    std::cerr << "[ERROR] Invalid segment duration!" << std::endl;
+    return 1; // FAILURE
+  }
+  const std::uint64_t duration = static_cast<std::uint64_t>(std::llround(seconds * 1000.0));
+
+  std::uint64_t mpegts = 0;
+  if (argc == 5) {
+    char* end = nullptr;
+    mpegts = std::strtoull(argv[4], &end, 10);
+    if ((end == argv[4]) || (*end != '\0') || (argv[4][0] == '-') || (mpegts >= ass::MPEGTS_WRAP)) {
+      std::cerr << "[ERROR] Invalid MPEG-TS time!" << std::endl;
+      return 1; // FAILURE
+    }
+  }
+
+  ass::Segmenter segmenter(argv[3], duration, mpegts, FLAGS_follow);
+
+  if (FLAGS_follow) {
+    // Segments close once the media time passes their end. It is the latest
+    // event start, carried on by the wall clock while no events arrive.
+    typedef std::chrono::steady_clock clock;
+    std::unique_ptr<ass::CueConverter> converter;
+    bool started = false;
+    std::uint64_t latest = 0;
+    clock::time_point latest_at;
+
+    const int status = watch::follow(argv[1], [&](ass::ASSFile& header) {
+      converter.reset(new ass::CueConverter(header, ass::SubtitleFormat::VTT));
+    }, [&](const ass::ASSFile&, watch::Lines& lines) {
+      ass::Cue cue;
+      for (const std::pair<std::string, std::string>& line : lines) {
+        if (!converter->Convert(line, &cue)) continue;
+        if (!segmenter.Add(cue)) {
+          std::cerr << "[WARNING] Skipping event that ended before the open segments" << std::endl;
+          continue;
+        }
+        if (!started || (cue.start > latest)) {
+          started = true;
+          latest = cue.start;
+          latest_at = clock::now();
+        }
+      }
+    }, [&](const ass::ASSFile&) {
+      if (!started) return;
+      const long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - latest_at).count();
+      segmenter.Close(latest + static_cast<std::uint64_t>(elapsed));
+    });
+
+    try {
+      segmenter.Finish();
+    } catch (const std::exception& e) {
+      std::cerr << "[ERROR] " << e.what() << std::endl;
+      return 1; // FAILURE
+    }
+    return status;
+  }
+
+  ass::ifstream input(argv[1]);
+  if (!input.is_open()) {
+    std::cerr << "[ERROR] Can't open input file!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  ass::ASSFile ass_input;
+  mkv::load_script(argv[1], input, ass_input);
+
+  try {
+    if (ass_input.HasSection(ass::EVENTS)) {
+      ass::CueConverter converter(ass_input, ass::SubtitleFormat::VTT);
+      std::vector<std::pair<ass::Cue, std::size_t>> cues;
+      ass::Cue cue;
+      for (const std::pair<std::string, std::string>& line : ass_input.Section(ass::EVENTS)) {
+        if (converter.Convert(line, &cue))
+          cues.push_back(std::make_pair(std::move(cue), cues.size()));
+      }
+
+      ass::sort_cues(&cues);
+      for (const std::pair<ass::Cue, std::size_t>& entry : cues)
+        segmenter.Add(entry.first);
+    }
+    segmenter.Finish();
+  } catch (const std::exception& e) {
+    std::cerr << "[ERROR] " << e.what() << std::endl;
+    return 1; // FAILURE
+  }
+
+  std::cerr << StringPrintf("%zu segment(s) written", segmenter.segments()) << std::endl;
+  return 0; // SUCCESS
+}
@@ -2,13 +2,17 @@
 // Copyright (c) 2019 Slek
 
 #define PROGRAM_NAME "ass_sort"
-#define PROGRAM_DESC "Sort ASS subtitles events."
+#define PROGRAM_DESC "Sort ASS subtitles events.\n  Comment lines (;) inside standard sections are not kept."
 #define PROGRAM_ARGS "input output"
 #define PROGRAM_VERS "1.0"
 #define COPY_INFO "Copyright (c) 2019 Slek"
 
 #define FLAGS_CASES                                                                                \
+    FLAG_CASE(watch, -1, "keep running and update output whenever input is saved")                 \
+    FLAG_CASE(keep_encoding, -1, "write output in the input encoding instead of UTF-8")            \
+    FLAG_CASE(skip_unchanged, -1, "leave output files whose contents wouldn't change untouched")
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
 #include <functional>
@@ -19,84 +23,42 @@
 #include <sstream>
 #include <string>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "ass.hpp"
 #include "flags.hpp"
+#include "fstream.hpp"
+#include "mkv.hpp"
+#include "ops/sort.hpp"
 #include "util/string.h"
 #include "util/version.h"
-
-inline void sort(const ass::ASSFile& ass, ass::ASSFile& out) {
-  out.clear();
-
-  out.BOM() = ass.BOM();
-  out.LineBreak() = ass.LineBreak();
-  out.ScriptComment() = ass.ScriptComment();
-
-  bool has_events = false;
-  std::map<ass::time_t, std::list<std::pair<std::string, std::string>>> event_lines;
-  for (const std::string& section : ass.Sections()) {
-    if (section == ass::EVENTS) {
-      has_events = true;
-
-      const std::list<std::pair<std::string, std::string>>& lines = ass.Section(ass::EVENTS);
-
-      std::list<std::pair<std::string, std::string>>::const_iterator it = lines.cbegin();
-      if (it == lines.cend()) continue;
-
-      const std::pair<std::string, std::string>& format_line = *it;
-      out.add_line(ass::EVENTS, format_line.first, format_line.second);
-      ++it;
-
-      if (format_line.first != "Format")
-        throw ass::io_error("format line must appear first in events");
-
-      std::size_t text_idx = std::numeric_limits<std::size_t>::max();
-      if (!ass::get_field_index(format_line.second, "Text", &text_idx) ||
-           (text_idx != (StringSplit(format_line.second, ass::FIELD_DELIMITER).size()-1)))
-        throw ass::io_error("'Text' field must appear in last place");
-
-      std::size_t start_idx = std::numeric_limits<std::size_t>::max();
-      if (!ass::get_field_index(format_line.second, "Start", &start_idx))
-        throw ass::io_error("'Start' field not found in format definition string");
-
-      for (; it != lines.cend(); ++it) {
-        const std::string& line_type = it->first;
-        const std::string& line_data = it->second;
-
-        bool start_defined = false;
-        ass::time_t start_ts = std::numeric_limits<ass::time_t>::max();
-
-        std::string::size_type start_begin, start_end;
-        if (ass::get_field(line_data, start_idx, &start_begin, &start_end)) {
-          if (start_begin < start_end) {
-            start_ts = ass::parse_time(line_data.substr(start_begin, start_end - start_begin));
-            start_defined = true;
-          }
-        } else throw ass::io_error("'Start' field cannot be retrieved");
-
-        if (!start_defined) {
-          out.add_line(ass::EVENTS, line_type, line_data);
-          continue;
-        }
-
-        event_lines[start_ts].push_back(std::make_pair(line_type, line_data));
-      }
-    } else {
-      out.insert(section, ass.Section(section));
-    }
-  }
-
-  if (!has_events)
-    std::cerr << "[WARNING] Events section not found!" << std::endl;
-  else {
-    for (const std::pair<ass::time_t, std::list<std::pair<std::string, std::string>>>& entry : event_lines) {
-      for (const std::pair<std::string, std::string>& line : entry.second)
-        out.add_line(ass::EVENTS, line.first, line.second);
-    }
+#include "watch.hpp"
+
+namespace {
+
+struct SortKey {
+  bool defined;
+  ass::time_t start;
+};
+
+// Sort keys of the events in [first, last)
+void ComputeKeys(const std::string& format, watch::Lines::const_iterator first, watch::Lines::const_iterator last,
+                 std::vector<SortKey>* keys) {
+  const ass::EventSchema schema(format);
+  if (!schema.has(ass::EventField::START))
+    throw ass::io_error("'Start' field not found in format definition string");
+
+  ass::EventFields fields;
+  for (watch::Lines::const_iterator it = first; it != last; ++it) {
+    SortKey key = {false, 0};
+    key.defined = ass::event_start(schema, it->second, &fields, &key.start);
+    keys->push_back(key);
   }
 }
 
+} // namespace
+
 int main(int argc, char* argv[]) {
 
   if (flags::HelpRequired(argc, argv)) {
@@ -121,29 +83,111 @@ int main(int argc, char* argv[]) {
     return 1; // FAILURE
   }
 
-  std::ifstream input(argv[1]);
+  ass::ifstream input(argv[1]);
   if (!input.is_open()) {
     std::cerr << "[ERROR] Can't open input file!" << std::endl;
     return 1; // FAILURE
   }
 
-  std::ofstream output(argv[2]);
+  // Output is UTF-8 unless the input encoding is kept
+  const ass::Encoding encoding = FLAGS_keep_encoding ? mkv::script_encoding(argv[1], input) : ass::Encoding::UTF8;
+
+  ass::ofstream output(argv[2], encoding, FLAGS_skip_unchanged);
   if (!output.is_open()) {
     std::cerr << "[ERROR] Can't open output file!" << std::endl;
     return 1; // FAILURE
   }
 
-  ass::ASSFile ass_input;
-  ass_input.load(input);
-
   const std::string build = StringPrintf("; Script generated by ASSTools (%s)", GetBuildInfo().c_str());
   const std::string url = "; http://github.com/Slek-Z/ass_tools";
+
+  if (FLAGS_watch) {
+    output.close();
+    const std::string output_path = argv[2];
+
+    // order holds the input events in output order: events without Start
+    // first, then by Start, ties in input order. A patch only parses the
+    // keys of its events and moves them to their new place.
+    ass::ASSFile ass_output;
+    std::vector<SortKey> keys;
+    std::vector<std::size_t> order;
+    const auto before = [&keys](std::size_t a, std::size_t b) {
+      if (keys[a].defined != keys[b].defined) return !keys[a].defined;
+      if (keys[a].defined && (keys[a].start != keys[b].start)) return keys[a].start < keys[b].start;
+      return a < b;
+    };
+
+    return watch::run(argv[1], [&](ass::ASSFile& ass_input, const watch::EventPatch& patch) {
+      if (patch.full) {
+        ass_input.ScriptComment() = build + ass_input.LineBreak() + url;
+        sort(ass_input, ass_output);
+
+        keys.clear();
+        order.clear();
+        if (ass_input.HasSection(ass::EVENTS)) {
+          const watch::Lines& events = ass_input.Section(ass::EVENTS);
+          ComputeKeys(events.front().second, std::next(events.cbegin()), events.cend(), &keys);
+          for (std::size_t i = 0; i < keys.size(); ++i) order.push_back(i);
+          std::sort(order.begin(), order.end(), before);
+        }
+      } else {
+        const watch::Lines& events = ass_input.Section(ass::EVENTS);
+        const auto range = watch::event_range(ass_input, patch.first, patch.inserted);
+        std::vector<SortKey> patch_keys;
+        ComputeKeys(events.front().second, range.first, range.second, &patch_keys);
+
+        const std::size_t first = patch.first, last = patch.first + patch.removed;
+        keys.insert(keys.erase(keys.begin() + static_cast<std::ptrdiff_t>(first), keys.begin() + static_cast<std::ptrdiff_t>(last)),
+                    patch_keys.begin(), patch_keys.end());
+
+        std::vector<std::size_t> remapped;
+        remapped.reserve(keys.size());
+        for (std::size_t i : order) {
+          if (i < first) remapped.push_back(i);
+          else if (i >= last) remapped.push_back(i - patch.removed + patch.inserted);
+        }
+        order.swap(remapped);
+
+        for (std::size_t i = first; i < first + patch.inserted; ++i)
+          order.insert(std::lower_bound(order.begin(), order.end(), i, before), i);
+
+        std::vector<const std::pair<std::string, std::string>*> lines;
+        lines.reserve(keys.size());
+        for (watch::Lines::const_iterator it = std::next(events.cbegin()); it != events.cend(); ++it)
+          lines.push_back(&(*it));
+
+        watch::Lines& out = ass_output.Section(ass::EVENTS);
+        out.erase(std::next(out.begin()), out.end());
+        for (std::size_t i : order)
+          out.push_back(*lines[i]);
+      }
+
+      ass::ofstream output(output_path, encoding, FLAGS_skip_unchanged);
+      if (!output.is_open()) throw ass::io_error("can't open output file");
+      output << ass_output;
+      output.close();
+      if (!output.good()) throw ass::io_error("can't write output file");
+      if (output.unchanged())
+        std::cerr << "[INFO] '" << output_path << "' unchanged, not rewritten" << std::endl;
+    });
+  }
+
+  ass::ASSFile ass_input;
+  mkv::load_script(argv[1], input, ass_input);
+
   ass_input.ScriptComment() = build + ass_input.LineBreak() + url;
 
   ass::ASSFile ass_output;
-  sort(ass_input, ass_output);
+  sort(std::move(ass_input), ass_output);
 
   output << ass_output;
+  output.close();
+  if (!output.good()) {
+    std::cerr << "[ERROR] Can't write output file '" << argv[2] << "'!" << std::endl;
+    return 1; // FAILURE
+  }
+  if (output.unchanged())
+    std::cerr << "[INFO] '" << argv[2] << "' unchanged, not rewritten" << std::endl;
 
   return 0; // SUCCESS
 }
@@ -2,13 +2,16 @@
 // Copyright (c) 2019 Slek
 
 #define PROGRAM_NAME "ass_split"
-#define PROGRAM_DESC "Split ASS subtitles."
+#define PROGRAM_DESC "Split ASS subtitles.\n  Comment lines (;) inside standard sections are not kept."
 #define PROGRAM_ARGS "input seconds out1 [out2]"
 #define PROGRAM_VERS "1.0"
 #define COPY_INFO "Copyright (c) 2019 Slek"
 
 #define FLAGS_CASES                                                                                \
-    FLAG_CASE(second_only, -1, "output only the second part on sigle output mode")
+    FLAG_CASE(second_only, -1, "output only the second part on sigle output mode")                 \
+    FLAG_CASE(follow, -1, "keep running and process events appended to input as they arrive")      \
+    FLAG_CASE(keep_encoding, -1, "write output in the input encoding instead of UTF-8")            \
+    FLAG_CASE(skip_unchanged, -1, "leave output files whose contents wouldn't change untouched")
 
 #include <cmath>
 #include <cstdint>
@@ -18,133 +21,17 @@
 #include <sstream>
 #include <string>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "ass.hpp"
 #include "flags.hpp"
+#include "fstream.hpp"
+#include "mkv.hpp"
+#include "ops/split.hpp"
 #include "util/string.h"
 #include "util/version.h"
-
-inline void split(const ass::ASSFile& ass, const ass::time_t t, ass::ASSFile& first, ass::ASSFile& second) {
-  first.clear();
-  second.clear();
-
-  first.BOM() = ass.BOM();
-  second.BOM() = ass.BOM();
-
-  first.ScriptComment() = ass.ScriptComment();
-  second.ScriptComment() = ass.ScriptComment();
-
-  bool has_events = false;
-  for (const std::string& section : ass.Sections()) {
-    if (section == ass::EVENTS) {
-      has_events = true;
-
-      const std::list<std::pair<std::string, std::string>>& lines = ass.Section(ass::EVENTS);
-
-      std::list<std::pair<std::string, std::string>>::const_iterator it = lines.cbegin();
-      if (it == lines.cend()) continue;
-
-      const std::pair<std::string, std::string>& format_line = *it;
-      first.add_line(ass::EVENTS, format_line.first, format_line.second);
-      second.add_line(ass::EVENTS, format_line.first, format_line.second);
-      ++it;
-
-      if (format_line.first != "Format")
-        throw ass::io_error("format line must appear first in events");
-
-      std::size_t text_idx = std::numeric_limits<std::size_t>::max();
-      if (!ass::get_field_index(format_line.second, "Text", &text_idx) ||
-           (text_idx != (StringSplit(format_line.second, ass::FIELD_DELIMITER).size()-1)))
-        throw ass::io_error("'Text' field must appear in last place");
-
-      std::size_t start_idx = std::numeric_limits<std::size_t>::max();
-      if (!ass::get_field_index(format_line.second, "Start", &start_idx))
-        throw ass::io_error("'Start' field not found in format definition string");
-
-      std::size_t end_idx = std::numeric_limits<std::size_t>::max();
-      if (!ass::get_field_index(format_line.second, "End", &end_idx))
-        throw ass::io_error("'End' field not found in format definition string");
-
-      for (; it != lines.cend(); ++it) {
-        const std::string& line_type = it->first;
-        const std::string& line_data = it->second;
-
-        ass::time_t start_ts = std::numeric_limits<ass::time_t>::max(),
-          end_ts = std::numeric_limits<ass::time_t>::max();
-        bool start_defined = false, end_defined = false;
-
-        std::string::size_type start_begin, start_end;
-        if (ass::get_field(line_data, start_idx, &start_begin, &start_end)) {
-          if (start_begin < start_end) {
-            start_ts = ass::parse_time(line_data.substr(start_begin, start_end - start_begin));
-            start_defined = true;
-          }
-        } else throw ass::io_error("'Start' field cannot be retrieved");
-
-        std::string::size_type end_begin, end_end;
-        if (ass::get_field(line_data, end_idx, &end_begin, &end_end)) {
-          if (end_begin < end_end) {
-            end_ts = ass::parse_time(line_data.substr(end_begin, end_end - end_begin));
-            end_defined = true;
-          }
-        } else throw ass::io_error("'End' field cannot be retrieved");
-
-        // End ignored in command and sound events
-        if ((line_type == ass::COMMAND_EVENT) || (line_type == ass::SOUND_EVENT)) end_defined = false;
-
-        bool add1 = true, add2 = true;
-        if (!start_defined) {
-          end_defined = false;
-        } else {
-          if (start_ts >= t) {
-            add1 = false;
-            // Correct timestamps
-            start_ts -= t;
-            if (end_defined && (end_ts >= t)) end_ts -= t;
-            else end_ts = 0;
-          } else {
-            add2 = false;
-            if (end_defined && (end_ts > t))
-              std::cerr << "[WARNING] Lossy split!" << std::endl;
-          }
-        }
-
-        std::string start_str, end_str;
-        if (start_defined)
-          start_str = ass::format_time(start_ts);
-        if (end_defined)
-          end_str = ass::format_time(end_ts);
-
-        std::stringstream event_data_stream;
-        if (start_begin < end_begin) {
-          event_data_stream << line_data.substr(0, start_begin)
-                            << start_str
-                            << line_data.substr(start_end, end_begin-start_end)
-                            << end_str
-                            << line_data.substr(end_end);
-        } else if (end_begin < start_begin) {
-          event_data_stream << line_data.substr(0, end_begin)
-                            << end_str
-                            << line_data.substr(end_end, start_begin-end_end)
-                            << start_str
-                            << line_data.substr(start_end);
-        } else throw ass::io_error("unexpected error");
-
-        if (add1)
-          first.add_line(ass::EVENTS, line_type, event_data_stream.str());
-        if (add2)
-          second.add_line(ass::EVENTS, line_type, event_data_stream.str());
-      }
-    } else {
-      first.insert(section, ass.Section(section));
-      second.insert(section, ass.Section(section));
-    }
-  }
-
-  if (!has_events)
-    std::cerr << "[WARNING] Events section not found!" << std::endl;
-}
+#include "watch.hpp"
 
 int main(int argc, char* argv[]) {
 
@@ -175,7 +62,7 @@ int main(int argc, char* argv[]) {
     return 1; //FAILURE
   }
 
-  std::ifstream input(argv[1]);
+  ass::ifstream input(argv[1]);
   if (!input.is_open()) {
     std::cerr << "[ERROR] Can't open input file!" << std::endl;
     return 1; // FAILURE
@@ -188,43 +75,84 @@ int main(int argc, char* argv[]) {
   }
   ass::time_t split_ts = ass::timestamp(split_time);
 
-  std::ofstream* pout1 = nullptr;
+  // Output is UTF-8 unless the input encoding is kept
+  const ass::Encoding encoding = FLAGS_keep_encoding ? mkv::script_encoding(argv[1], input) : ass::Encoding::UTF8;
+
+  ass::ofstream* pout1 = nullptr;
   if ((argc == 5) || !FLAGS_second_only) {
-    pout1 = new std::ofstream(argv[3]);
+    pout1 = new ass::ofstream(argv[3], encoding, FLAGS_skip_unchanged);
     if (!pout1->is_open()) {
       std::cerr << "[ERROR] Can't open" << ((argc == 5) ? " first " : " ") << "output file!" << std::endl;
       return 1; // FAILURE
     }
   }
 
-  std::ofstream* pout2 = nullptr;
+  ass::ofstream* pout2 = nullptr;
   if ((argc == 5) || FLAGS_second_only) {
-    pout2 = new std::ofstream((argc == 5) ? argv[4] : argv[3]);
+    pout2 = new ass::ofstream((argc == 5) ? argv[4] : argv[3], encoding, FLAGS_skip_unchanged);
     if (!pout2->is_open()) {
       std::cerr << "[ERROR] Can't open" << ((argc == 5) ? " second " : " ") << "output file!" << std::endl;
       return 1; // FAILURE
     }
   }
 
-  ass::ASSFile ass_input;
-  ass_input.load(input);
-
   const std::string build = StringPrintf("; Script generated by ASSTools (%s)", GetBuildInfo().c_str());
   const std::string url = "; http://github.com/Slek-Z/ass_tools";
+
+  if (FLAGS_follow) {
+    // Appended events are split and appended to the outputs
+    const int status = watch::follow(argv[1], [&](ass::ASSFile& header) {
+      header.ScriptComment() = build + header.LineBreak() + url;
+      ass::ASSFile ass1, ass2;
+      split(header, split_ts, ass1, ass2);
+      if (pout1) {
+        *pout1 << ass1;
+        pout1->flush();
+      }
+      if (pout2) {
+        *pout2 << ass2;
+        pout2->flush();
+      }
+    }, [&](const ass::ASSFile& header, watch::Lines& lines) {
+      watch::Lines out1, out2;
+      ass::split_events(header.Section(ass::EVENTS).front().second, lines.cbegin(), lines.cend(), split_ts, out1, out2);
+      if (pout1) watch::append_lines(*pout1, out1, header.LineBreak());
+      if (pout2) watch::append_lines(*pout2, out2, header.LineBreak());
+    });
+    delete pout1;
+    delete pout2;
+    return status;
+  }
+
+  ass::ASSFile ass_input;
+  mkv::load_script(argv[1], input, ass_input);
   ass_input.ScriptComment() = build + ass_input.LineBreak() + url;
 
   ass::ASSFile ass1, ass2;
-  split(ass_input, split_ts, ass1, ass2);
-
+  split(std::move(ass_input), split_ts, ass1, ass2);
+
+  // Closes and frees an output, reporting write errors and untouched files
+  const auto finish = [](ass::ofstream* output, const char* path) {
+    output->close();
+    const bool ok = output->good();
+    if (!ok)
+      std::cerr << "[ERROR] Can't write output file '" << path << "'!" << std::endl;
+    else if (output->unchanged())
+      std::cerr << "[INFO] '" << path << "' unchanged, not rewritten" << std::endl;
+    delete output;
+    return ok;
+  };
+
+  bool ok = true;
   if (pout1) {
     *pout1 << ass1;
-    delete pout1;
+    ok = finish(pout1, argv[3]) && ok;
   }
 
   if (pout2) {
     *pout2 << ass2;
-    delete pout2;
+    ok = finish(pout2, (argc == 5) ? argv[4] : argv[3]) && ok;
   }
 
-  return 0; // SUCCESS
+  return ok ? 0 : 1;
 }
@@ -0,0 +1,539 @@
+// ASS-Toolsd - Serve ASS tools requests over a Unix domain socket
+// Copyright (c) 2019 Slek
+
+#define PROGRAM_NAME "ass_toolsd"
+#define PROGRAM_DESC "Serve ass_time, ass_split, ass_extract, ass_sort and ass_merge requests\n  over a Unix domain socket (default: $ASS_TOOLSD_SOCKET, else ass_toolsd.sock in\n  $XDG_RUNTIME_DIR, else /tmp/ass_toolsd-<uid>.sock). An existing file there is\n  only replaced when it is a stale socket of the same user."
+#define PROGRAM_ARGS "[socket]"
+#define PROGRAM_VERS "1.0"
+#define COPY_INFO "Copyright (c) 2019 Slek"
+
+#define FLAGS_CASES                                                                                \
+
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ass.hpp"
+#include "columns.hpp"
+#include "flags.hpp"
+#include "fstream.hpp"
+#include "mkv.hpp"
+#include "ipc.hpp"
+#include "ops/extract.hpp"
+#include "ops/merge.hpp"
+#include "ops/sort.hpp"
+#include "ops/split.hpp"
+#include "ops/time.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "util/string.h"
+#include "util/version.h"
+
+namespace {
+
+const std::size_t CACHE_CAPACITY = 64;
+
+std::atomic<bool> stop_requested(false);
+
+// Output files left untouched by --skip_unchanged since startup
+std::atomic<std::size_t> unchanged_writes(0);
+
+void HandleSignal(int) {
+  stop_requested = true;
+}
+
+// Recently used scripts, parsed once and shared read-only between requests.
+// Entries are validated against the file identity, size and mtime.
+class ScriptCache {
+public:
+
+  explicit ScriptCache(std::size_t capacity)
+    : capacity_(capacity) { }
+
+  // The script at path. When given, encoding gets the encoding it was read in.
+  std::shared_ptr<const ass::ASSFile> Get(const std::string& path, ass::Encoding* encoding = nullptr) {
+    struct stat st;
+    if ((::stat(path.c_str(), &st) != 0) || !S_ISREG(st.st_mode))
+      throw ass::not_found("file not found");
+    const Stamp stamp = {st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::unordered_map<std::string, Entry>::iterator it = entries_.find(path);
+      if ((it != entries_.end()) && (it->second.stamp == stamp)) {
+        lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+        if (encoding) *encoding = it->second.encoding;
+        return it->second.script;
+      }
+    }
+
+    // Parse outside of the lock, concurrent misses on the same file are harmless
+    ass::ifstream input(path);
+    if (!input.is_open())
+      throw ass::io_error("can't open input file");
+    const ass::Encoding script_encoding = mkv::script_encoding(path, input);
+    std::shared_ptr<ass::ASSFile> script = std::make_shared<ass::ASSFile>();
+    mkv::load_script(path, input, *script);
+    if (encoding) *encoding = script_encoding;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unordered_map<std::string, Entry>::iterator it = entries_.find(path);
+    if (it != entries_.end()) {
+      lru_.erase(it->second.lru_it);
+      entries_.erase(it);
+    }
+    lru_.push_front(path);
+    entries_[path] = Entry{stamp, script, script_encoding, lru_.begin()};
+    while (entries_.size() > capacity_) {
+      entries_.erase(lru_.back());
+      lru_.pop_back();
+    }
+
+    return script;
+  }
+
+private:
+
+  struct Stamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+
+    bool operator==(const Stamp& other) const {
+      return (dev == other.dev) && (ino == other.ino) && (size == other.size) &&
+             (mtime_sec == other.mtime_sec) && (mtime_nsec == other.mtime_nsec);
+    }
+  };
+
+  struct Entry {
+    Stamp stamp;
+    std::shared_ptr<const ass::ASSFile> script;
+    ass::Encoding encoding;
+    std::list<std::string>::iterator lru_it;
+  };
+
+  const std::size_t capacity_;
+
+  std::mutex mutex_;
+  std::list<std::string> lru_;
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+// A single tool invocation received from a client
+class Job {
+public:
+
+  Job(const ipc::Request& request, ipc::Response& response, ScriptCache& cache)
+    : request_(request), response_(response), cache_(cache), input_used_(false),
+      encoding_(ass::Encoding::UTF8), loaded_(false) { }
+
+  // Split arguments into positional arguments and flags, as flags::ParseFlags does
+  bool ParseArgs(const std::unordered_set<std::string>& known_flags) {
+    for (const std::string& arg : request_.args) {
+      // Only "-x" and "--name" are flags, so negative numbers stay positional
+      if ((arg.size() >= 2) && (arg[0] == '-') && ((arg.size() == 2) || (arg[1] == '-'))) {
+        std::string flag = (arg[1] == '-') ? arg.substr(2) : arg.substr(1);
+        if (known_flags.find(flag) == known_flags.end()) {
+          err_ << "unrecognized option '" << arg << "'" << std::endl;
+          err_ << "Try '" << request_.args.front() << " --help' for more information" << std::endl;
+          return false;
+        }
+        flags_.insert(flag);
+      } else {
+        args_.push_back(arg);
+      }
+    }
+    return true;
+  }
+
+  bool Flag(const std::string& name) const { return flags_.find(name) != flags_.end(); }
+
+  const std::vector<std::string>& Args() const { return args_; }
+
+  std::ostream& Out() { return out_; }
+  std::ostream& Err() { return err_; }
+
+  // Load an input script. The first one gives the output encoding with
+  // --keep_encoding; inline input is UTF-8.
+  std::shared_ptr<const ass::ASSFile> Load(const std::string& arg) {
+    const bool first = !loaded_;
+    loaded_ = true;
+
+    if (arg == "-") {
+      if (!request_.has_input || input_used_)
+        throw ass::io_error("no inline input available");
+      input_used_ = true;
+
+      std::istringstream input(request_.input);
+      std::shared_ptr<ass::ASSFile> script = std::make_shared<ass::ASSFile>();
+      script->load(input);
+      return script;
+    }
+
+    return cache_.Get(Path(arg), first ? &encoding_ : nullptr);
+  }
+
+  bool Write(const std::string& arg, const ass::ASSFile& script) {
+    const ass::Encoding encoding = Flag("keep_encoding") ? encoding_ : ass::Encoding::UTF8;
+    if (arg == "-") {
+      std::ostringstream output;
+      output << script;
+      const std::string data = output.str();
+      ass::Encoder encoder(encoding);
+      encoder.Encode(data.data(), data.size(), &response_.output);
+      encoder.Finish(&response_.output);
+      response_.has_output = true;
+      return true;
+    }
+
+    ass::ofstream output(Path(arg), encoding, Flag("skip_unchanged"));
+    if (!output.is_open()) return false;
+    output << script;
+    output.close();
+    if (output.unchanged()) {
+      unchanged_writes++;
+      err_ << "[INFO] '" << arg << "' unchanged, not rewritten" << std::endl;
+    }
+    return output.good();
+  }
+
+  void Finish(int status) {
+    response_.status = status;
+    response_.out = out_.str();
+    response_.err = err_.str();
+  }
+
+private:
+
+  std::string Path(const std::string& arg) const {
+    if (arg.empty() || (arg[0] == '/') || request_.cwd.empty()) return arg;
+    return request_.cwd + "/" + arg;
+  }
+
+  const ipc::Request& request_;
+  ipc::Response& response_;
+  ScriptCache& cache_;
+
+  std::vector<std::string> args_;
+  std::unordered_set<std::string> flags_;
+  bool input_used_;
+  ass::Encoding encoding_; // Of the first input
+  bool loaded_;
+
+  std::ostringstream out_;
+  std::ostringstream err_;
+};
+
+std::string ScriptComment(const std::string& line_break) {
+  const std::string build = StringPrintf("; Script generated by ASSTools (%s)", GetBuildInfo().c_str());
+  const std::string url = "; http://github.com/Slek-Z/ass_tools";
+  return build + line_break + url;
+}
+
+int RunTime(Job& job) {
+  const std::vector<std::string>& args = job.Args();
+  if (args.size() < 4 || args.size() > 5) {
+    job.Err() << "Usage: ass_time input offset [scale] output" << std::endl;
+    return 1; // FAILURE
+  }
+
+  double offset_time = std::stod(args[2]);
+  if (!std::isfinite(offset_time)) {
+    job.Err() << "[ERROR] Invalid offset time!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  ass::Ratio scale;
+  if (args.size() == 5) {
+    if (!ass::parse_ratio(args[3], &scale)) {
+      job.Err() << "[ERROR] Invalid scale!" << std::endl;
+      return 1; // FAILURE
+    }
+  }
+
+  std::shared_ptr<const ass::ASSFile> ass_input = job.Load(args[1]);
+
+  ass::ASSFile ass_output;
+  transform(*ass_input, ass::timestamp_signed(offset_time), scale, ass_output, job.Flag("tags"));
+  ass_output.ScriptComment() = ScriptComment(ass_input->LineBreak());
+
+  if (!job.Write(args.back(), ass_output)) {
+    job.Err() << "[ERROR] Can't open output file!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  return 0; // SUCCESS
+}
+
+int RunSplit(Job& job) {
+  const std::vector<std::string>& args = job.Args();
+  if (args.size() < 4 || args.size() > 5) {
+    job.Err() << "Usage: ass_split input seconds out1 [out2]" << std::endl;
+    return 1; // FAILURE
+  }
+
+  const bool second_only = job.Flag("second_only");
+  if ((args.size() == 5) && second_only) {
+    job.Err() << "--second_only option can only be useds in single output mode" << std::endl;
+    return 1; //FAILURE
+  }
+
+  double split_time = std::stod(args[2]);
+  if (!std::isnormal(split_time) || split_time < 0.0) {
+    job.Err() << "[ERROR] Invalid split time!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  std::shared_ptr<const ass::ASSFile> ass_input = job.Load(args[1]);
+
+  ass::ASSFile ass1, ass2;
+  split(*ass_input, ass::timestamp(split_time), ass1, ass2);
+  ass1.ScriptComment() = ScriptComment(ass_input->LineBreak());
+  ass2.ScriptComment() = ScriptComment(ass_input->LineBreak());
+
+  if ((args.size() == 5) || !second_only) {
+    if (!job.Write(args[3], ass1)) {
+      job.Err() << "[ERROR] Can't open" << ((args.size() == 5) ? " first " : " ") << "output file!" << std::endl;
+      return 1; // FAILURE
+    }
+  }
+
+  if ((args.size() == 5) || second_only) {
+    if (!job.Write((args.size() == 5) ? args[4] : args[3], ass2)) {
+      job.Err() << "[ERROR] Can't open" << ((args.size() == 5) ? " second " : " ") << "output file!" << std::endl;
+      return 1; // FAILURE
+    }
+  }
+
+  return 0; // SUCCESS
+}
+
+int RunExtract(Job& job) {
+  const std::vector<std::string>& args = job.Args();
+  if (args.size() != 4) {
+    job.Err() << "Usage: ass_extract input styles output" << std::endl;
+    return 1; // FAILURE
+  }
+
+  std::shared_ptr<const ass::ASSFile> ass_input = job.Load(args[1]);
+
+  ass::ASSFile ass_output;
+  extract(*ass_input, ass::StyleSet(args[2], job.Flag("except")), ass_output);
+  ass_output.ScriptComment() = ScriptComment(ass_input->LineBreak());
+
+  if (!job.Write(args[3], ass_output)) {
+    job.Err() << "[ERROR] Can't open output file!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  return 0; // SUCCESS
+}
+
+int RunSort(Job& job) {
+  const std::vector<std::string>& args = job.Args();
+  if (args.size() != 3) {
+    job.Err() << "Usage: ass_sort input output" << std::endl;
+    return 1; // FAILURE
+  }
+
+  std::shared_ptr<const ass::ASSFile> ass_input = job.Load(args[1]);
+
+  ass::ASSFile ass_output;
+  sort(*ass_input, ass_output);
+  ass_output.ScriptComment() = ScriptComment(ass_input->LineBreak());
+
+  if (!job.Write(args[2], ass_output)) {
+    job.Err() << "[ERROR] Can't open output file!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  return 0; // SUCCESS
+}
+
+int RunMerge(Job& job) {
+  const std::vector<std::string>& args = job.Args();
+  if (args.size() < 4 || args.size() > 5) {
+    job.Err() << "Usage: ass_merge in1 in2 [delay] output" << std::endl;
+    return 1; // FAILURE
+  }
+
+  std::uint32_t offset_ts = 0;
+  if (args.size() == 5) {
+    double offset = std::stod(args[3]);
+    if (!std::isfinite(offset) || offset < 0.0) {
+      job.Err() << "[ERROR] Invalid offset!" << std::endl;
+      return 1; // FAILURE
+    }
+    offset_ts = static_cast<std::uint32_t>(offset * 100.);
+  }
+
+  std::shared_ptr<const ass::ASSFile> ass1 = job.Load(args[1]);
+  std::shared_ptr<const ass::ASSFile> ass2 = job.Load(args[2]);
+
+  ass::ASSFile merged;
+  merge(*ass1, *ass2, offset_ts, merged);
+
+  if (!job.Write(args.back(), merged)) {
+    job.Err() << "[ERROR] Can't open output file!" << std::endl;
+    return 1; // FAILURE
+  }
+
+  return 0; // SUCCESS
+}
+
+struct Operation {
+  std::function<int(Job&)> run;
+  std::string usage;
+  std::unordered_set<std::string> flags;
+};
+
+const std::unordered_map<std::string, Operation>& Operations() {
+  static const std::unordered_map<std::string, Operation> operations = {
+    {"ass_time", {RunTime, "input offset [scale] output", {"help", "version", "tags", "keep_encoding", "skip_unchanged"}}},
+    {"ass_split", {RunSplit, "input seconds out1 [out2]", {"help", "version", "second_only", "keep_encoding", "skip_unchanged"}}},
+    {"ass_extract", {RunExtract, "input styles output", {"help", "version", "except", "keep_encoding", "skip_unchanged"}}},
+    {"ass_sort", {RunSort, "input output", {"help", "version", "keep_encoding", "skip_unchanged"}}},
+    {"ass_merge", {RunMerge, "in1 in2 [delay] output", {"help", "version", "keep_encoding", "skip_unchanged"}}}
+  };
+  return operations;
+}
+
+void Serve(int fd, ScriptCache& cache) {
+  ipc::Request request;
+  if (!ipc::recv_request(fd, &request)) return;
+
+  ipc::Response response;
+  if (request.args.empty()) {
+    response.err = "[ERROR] Empty request!\n";
+    ipc::send_response(fd, response);
+    return;
+  }
+
+  TRACE_SPAN_DETAIL("request", request.args.front());
+
+  Job job(request, response, cache);
+  std::unordered_map<std::string, Operation>::const_iterator op = Operations().find(request.args.front());
+  if (op == Operations().end()) {
+    job.Err() << "[ERROR] Unknown tool '" << request.args.front() << "'" << std::endl;
+    job.Finish(1);
+  } else if (!job.ParseArgs(op->second.flags)) {
+    job.Finish(1);
+  } else if (job.Flag("help")) {
+    job.Out() << "Usage: " << op->first << " " << op->second.usage << std::endl;
+    job.Finish(0);
+  } else if (job.Flag("version")) {
+    job.Out() << op->first << " via " << PROGRAM_NAME << " v" << PROGRAM_VERS << " (" << GetBuildInfo() << ")" << std::endl;
+    job.Finish(0);
+  } else {
+    try {
+      job.Finish(op->second.run(job));
+    } catch (const std::exception& e) {
+      job.Err() << "[ERROR] " << e.what() << std::endl;
+      job.Finish(1);
+    }
+  }
+
+  ipc::send_response(fd, response);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+
+  if (flags::HelpRequired(argc, argv)) {
+    flags::ShowHelp();
+    return 0; // SUCCESS
+  }
+
+  if (flags::VersionRequested(argc, argv)) {
+    flags::ShowVersion();
+    return 0; // SUCCESS
+  }
+
+  int result = flags::ParseFlags(&argc, &argv, true);
+  if (result > 0) {
+    std::cerr << "unrecognized option '" << argv[result] << "'" << std::endl;
+    std::cerr << "Try '" << PROGRAM_NAME << " --help' for more information" << std::endl;
+    return 1; // FAILURE
+  }
+
+  if (argc > 2) {
+    flags::ShowHelp();
+    return 1; // FAILURE
+  }
+
+  const std::string socket_path = (argc == 2) ? std::string(argv[1]) : ipc::socket_path();
+
+  std::signal(SIGPIPE, SIG_IGN);
+
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = HandleSignal; // no SA_RESTART, accept() must be interrupted
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  int listen_fd = ipc::listen(socket_path);
+  if (listen_fd < 0) {
+    std::cerr << "[ERROR] Can't listen on '" << socket_path << "': " << std::strerror(errno) << std::endl;
+    return 1; // FAILURE
+  }
+
+  // Workers start with SIGINT and SIGTERM blocked, so they are delivered to
+  // this thread and interrupt accept()
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+
+  ScriptCache cache(CACHE_CAPACITY);
+  {
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+    ThreadPool pool;
+    pthread_sigmask(SIG_UNBLOCK, &stop_signals, nullptr);
+    std::cerr << "[INFO] Listening on '" << socket_path << "' with " << pool.NumThreads() << " threads" << std::endl;
+
+    while (!stop_requested) {
+      int fd = ::accept(listen_fd, nullptr, nullptr);
+      if (fd < 0) {
+        if (errno == EINTR) continue;
+        std::cerr << "[ERROR] accept: " << std::strerror(errno) << std::endl;
+        break;
+      }
+
+      pool.AddTask([fd, &cache]() {
+        Serve(fd, cache);
+        ::close(fd);
+      });
+    }
+  }
+
+  ::close(listen_fd);
+  ::unlink(socket_path.c_str());
+
+  if (unchanged_writes > 0)
+    std::cerr << "[INFO] " << unchanged_writes << " unchanged output(s) not rewritten" << std::endl;
+
+  return 0; // SUCCESS
+}
@@ -209,3 +209,19 @@ bool IsWhiteSpace(const int character) {
   return character == ' ' || character == '\n' || character == '\r' ||
          character == '\t';
 }
+
+std::string StringJsonEscape(const std::string& str) {
+  std::string escaped;
+  escaped.reserve(str.size() + 2);
+  for (char ch : str) {
+    if ((ch == '"') || (ch == '\\')) {
+      escaped.push_back('\\');
+      escaped.push_back(ch);
+    } else if (static_cast<unsigned char>(ch) < 0x20) {
+      escaped += StringPrintf("\\u%04x", static_cast<unsigned>(ch));
+    } else {
+      escaped.push_back(ch);
+    }
+  }
+  return escaped;
+}